@@ -13,6 +13,7 @@
 #include "FPDecoder.h"
 #include "FPLog.h"
 #include "FPSemantics.h"
+#include "FPSnapshotFile.h"
 
 using namespace Dyninst::PatchAPI;
 
@@ -71,6 +72,14 @@ class FPAnalysis {
          */
         virtual string finalInstReport();
 
+        /**
+         * RUNTIME: Called once before registration with one more than the
+         * largest instruction index in the registration table, so that
+         * per-instruction arrays can be sized up front. Defaults to doing
+         * nothing.
+         */
+        virtual void reserveInstructions(size_t numInsts);
+
         /**
          * RUNTIME: Called once at initialization for every instrumented instruction.
          */
@@ -83,6 +92,42 @@ class FPAnalysis {
         virtual void handlePostInstruction(FPSemantics *inst);
         virtual void handleReplacement(FPSemantics *inst);
 
+        /**
+         * RUNTIME: Return true if registerInstruction may be delayed until
+         * the first time an instruction is executed through a heavyweight
+         * handler (or skipped entirely if it never executes). Analyses that
+         * generate their own snippets or blobs usually need to register every
+         * instruction up front. Defaults to false.
+         */
+        virtual bool supportsLazyRegistration();
+
+        /**
+         * RUNTIME: Called in a fork-server child (see _INST_enable_analysis)
+         * with the configuration for that run, after the replacement tags
+         * have been reloaded. Analyses that keep other configuration-dependent
+         * state from registration should refresh it here. Defaults to doing
+         * nothing.
+         */
+        virtual void reloadConfiguration(FPConfig *runConfig);
+
+        /**
+         * RUNTIME: Fill in (at most maxEntries) entries with the current
+         * cumulative value of every nonzero counter (keyed by
+         * FP_SNAPSHOT_KEY(iidx, 0, kind)) and return how many were written;
+         * FPSnapshot fills in the analysis and turns the values into
+         * increments. Called from a signal handler, so it must not allocate,
+         * lock, or log. Defaults to reporting nothing.
+         */
+        virtual size_t snapshotCounters(FPSnapshotEntry *entries, size_t maxEntries);
+
+        /**
+         * INSTTIME: Allocate a pointer-sized slot (initially NULL) in the
+         * mutatee and store its address in the configuration under the given
+         * key. At initialization, the runtime fills in the address of the
+         * matching inline handler; see FPBinaryBlob::buildHandlerCall.
+         */
+        void* allocateHandlerSlot(BPatch_addressSpace *app, string key);
+
         /**
          * RUNTIME: Called once at finalization.
          */
@@ -94,7 +139,7 @@ class FPAnalysis {
         FPConfig *configuration;
         FPDecoder *decoder;
         FPLog *logFile;
-        FPContext *context;
+        static __thread FPContext *context;     // bound per thread at runtime
 
 };
 
@@ -1,10 +1,44 @@
 #ifndef __FPANALYSISCINST_H
 #define __FPANALYSISCINST_H
 
+#include "FPBinaryBlob.h"
+#include "FPCodeGen.h"
 #include "FPAnalysis.h"
 
 namespace FPInst {
 
+/**
+ * Per-instruction counter locations (other than the handler count array).
+ */
+struct FPAnalysisCInstData {
+    void *count_addr;       // blob counter (NULL if not inline)
+    long count_slot;        // sharded counter slot (-1 if not sharded)
+    long block_leader;      // instruction whose counter also counts this one
+                            // (-1 if counted individually)
+};
+
+/**
+ * Counter increment (replaces the original instruction). Increments a counter
+ * at a fixed address in the mutatee (or a sharded counter slot) and then runs
+ * the original instruction.
+ */
+class FPBinaryBlobCInst : public FPBinaryBlob, public Snippet {
+
+    public:
+
+        FPBinaryBlobCInst(FPSemantics *inst, void *countAddr, long countSlot);
+
+        bool generate(Point *pt, Buffer &buf);
+
+        void enableShardedCounters(void *ctl_addr);
+
+    private:
+
+        void *countAddr;
+        long countSlot;
+        void *shardControl;
+};
+
 /**
  * Instruction count analysis.
  * This very simple analysis creates a counter for every instruction and
@@ -12,6 +46,15 @@ namespace FPInst {
  * initialization code must call addSemantics with every instruction to be
  * monitored. This is a singleton analysis; you can't have multiple sets of
  * counters going at once.
+ *
+ * By default, counters are incremented by an FPBinaryBlobCInst that replaces
+ * the instruction; with "cinst_inline=no", a Dyninst snippet increments the
+ * runtime's count array instead.
+ *
+ * With "cinst_block_counts=yes", only the first counted instruction (the
+ * leader) in each basic block is instrumented, since all of the instructions
+ * in a block execute the same number of times. The other instructions are
+ * still registered and report the leader's count.
  */
 class FPAnalysisCInst : public FPAnalysis {
 
@@ -39,14 +82,23 @@ class FPAnalysisCInst : public FPAnalysis {
 
         void expandInstCount(size_t newSize);
         size_t *getCountArrayPtr();
+        unsigned long getCount(size_t idx);
+
+        bool isBlockCounting();
+        void setBlockLeader(FPSemantics *leader);
+        bool isCountedByBlock(FPSemantics *inst);
+        void addToBlock(FPSemantics *inst);
 
         string finalInstReport();
 
+        void reserveInstructions(size_t numInsts);
         void registerInstruction(FPSemantics *inst);
         void handlePreInstruction(FPSemantics *inst);
         void handlePostInstruction(FPSemantics *inst);
         void handleReplacement(FPSemantics *inst);
 
+        size_t snapshotCounters(FPSnapshotEntry *entries, size_t maxEntries);
+
         void finalOutput();
 
     private:
@@ -56,7 +108,15 @@ class FPAnalysisCInst : public FPAnalysis {
         size_t *instCount;
         size_t instCountSize;
 
+        FPAnalysisCInstData *instData;
+
         size_t insnsInstrumented;
+        size_t insnsCountedByBlock;
+
+        bool inlineCounters;
+        bool useShardedCounters;
+        bool blockCounts;
+        FPSemantics *blockLeader;
 
 };
 
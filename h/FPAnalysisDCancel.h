@@ -1,6 +1,8 @@
 #ifndef __FPANALYSISDCANCEL_H
 #define __FPANALYSISDCANCEL_H
 
+#include "FPBinaryBlob.h"
+#include "FPCodeGen.h"
 #include "FPConfig.h"
 #include "FPAnalysis.h"
 
@@ -14,6 +16,41 @@ struct FPAnalysisDCancelInstData {
     unsigned long count;
     unsigned long total_cancels;
     unsigned long total_digits;
+    void *count_addr;       // inline execution count (NULL if not inline)
+    long count_slot;        // sharded counter slot (-1 if not sharded)
+};
+
+/**
+ * Inline cancellation check (replaces the original instruction). For each
+ * add/subtract lane, the blob recomputes the result in a scratch register and
+ * compares the biased exponent fields of the operands and the result using
+ * integer shifts, so the common case never leaves the blob. Only when the
+ * result is zero or denormal, or the exponent drop exceeds min_priority, does
+ * it save the full register and FPU state and call the runtime handler
+ * (through a pointer that the runtime fills in at initialization) with the
+ * raw operand bits.
+ */
+class FPBinaryBlobDCancel : public FPBinaryBlob, public Snippet {
+
+    public:
+
+        FPBinaryBlobDCancel(FPSemantics *inst, FPAnalysisDCancelInstData instData,
+                void *handlerPtr, long minPriority);
+
+        bool generate(Point *pt, Buffer &buf);
+
+        void enableShardedCounters(void *ctl_addr);
+
+        static const size_t MAX_BLOB_SIZE = 4096;
+
+    private:
+
+        size_t buildLaneLoadXMM(unsigned char *pos, FPOperand *src, FPRegister dest_xmm);
+
+        FPAnalysisDCancelInstData instData;
+        void *handlerPtr;
+        long minPriority;
+        void *shardControl;
 };
 
 /**
@@ -25,6 +62,11 @@ struct FPAnalysisDCancelInstData {
  * digit number information is stored for every cancellation regardless of
  * sampling. This is a singleton analysis; you can't have multiple detectors
  * going at once.
+ *
+ * By default, SSE instructions are checked inline by an FPBinaryBlobDCancel
+ * that only calls back into the analysis for likely cancellations; other
+ * instructions (and all instructions with "dcancel_inline=no") use the regular
+ * pre-instrumentation handler.
  */
 class FPAnalysisDCancel : public FPAnalysis {
 
@@ -52,6 +94,7 @@ class FPAnalysisDCancel : public FPAnalysis {
         bool shouldPreInstrument(FPSemantics *inst);
         bool shouldPostInstrument(FPSemantics *inst);
         bool shouldReplace(FPSemantics *inst);
+        bool canCheckInline(FPSemantics *inst);
 
         Snippet::Ptr buildPreInstrumentation(FPSemantics *inst,
                 BPatch_addressSpace *app, bool &needsRegisters);
@@ -62,12 +105,19 @@ class FPAnalysisDCancel : public FPAnalysis {
 
         string finalInstReport();
 
+        void reserveInstructions(size_t numInsts);
         void registerInstruction(FPSemantics *inst);
+        bool supportsLazyRegistration();
         void handlePreInstruction(FPSemantics *inst);
         void handlePostInstruction(FPSemantics *inst);
         void handleReplacement(FPSemantics *inst);
 
         void checkForCancellation(FPSemantics *inst, FPOperationType opt, FPOperand *op1, FPOperand *op2);
+        void handleInlineCancellation(FPSemantics *inst, size_t opIdx, size_t setIdx,
+                unsigned long bits1, unsigned long bits2);
+
+        unsigned long getCount(size_t idx);
+        size_t snapshotCounters(FPSnapshotEntry *entries, size_t maxEntries);
 
         void finalOutput();
 
@@ -77,12 +127,19 @@ class FPAnalysisDCancel : public FPAnalysis {
         
         long min_priority;
         bool enable_sampling;
+        bool inlineChecks;
+        bool useShardedCounters;
+
+        bool isCandidate(FPSemantics *inst);
+        void *handlerPtr;
 
+        void checkOperands(FPSemantics *inst, FPOperationType opt, FPOperand *op1, FPOperand *op2);
         unsigned incrementCount(FPSemantics *inst);
         unsigned addCancellation(FPSemantics *inst, long digits);
         void expandInstData(size_t newSize);
         FPAnalysisDCancelInstData *instData;
         size_t instCount;
+        pthread_mutex_t instDataLock;       // serializes expandInstData
 
         void* cancelAddresses[256];
         size_t numCancelAddresses;
@@ -1,13 +1,39 @@
 #ifndef __FPANALYSISDNAN_H
 #define __FPANALYSISDNAN_H
 
+#include "FPBinaryBlob.h"
+#include "FPCodeGen.h"
 #include "FPConfig.h"
 #include "FPAnalysis.h"
 
 namespace FPInst {
 
 /**
- * Performs NaN detection analysis.
+ * Inline NaN check (replaces the original instruction). Each floating-point
+ * input lane is loaded into a scratch register and, with the sign bit shifted
+ * out, compared against an all-ones exponent; only a NaN compares greater, so
+ * the common case is a single compare and branch per input. Hits are passed to
+ * the runtime handler with the raw bits.
+ */
+class FPBinaryBlobDNan : public FPBinaryBlob, public Snippet {
+
+    public:
+
+        FPBinaryBlobDNan(FPSemantics *inst, void *handlerPtr);
+
+        bool generate(Point *pt, Buffer &buf);
+
+        static const size_t MAX_BLOB_SIZE = 4096;
+
+    private:
+
+        void *handlerPtr;
+};
+
+/**
+ * Performs NaN detection analysis. By default, SSE instructions are checked
+ * inline by an FPBinaryBlobDNan; other instructions (and all instructions with
+ * "dnan_inline=no") use the regular pre-instrumentation handler.
  */
 class FPAnalysisDNan : public FPAnalysis {
 
@@ -29,6 +55,7 @@ class FPAnalysisDNan : public FPAnalysis {
         bool shouldPreInstrument(FPSemantics *inst);
         bool shouldPostInstrument(FPSemantics *inst);
         bool shouldReplace(FPSemantics *inst);
+        bool canCheckInline(FPSemantics *inst);
 
         Snippet::Ptr buildPreInstrumentation(FPSemantics *inst,
                 BPatch_addressSpace *app, bool &needsRegisters);
@@ -40,9 +67,12 @@ class FPAnalysisDNan : public FPAnalysis {
         string finalInstReport();
 
         void registerInstruction(FPSemantics *inst);
+        bool supportsLazyRegistration();
         void handlePreInstruction(FPSemantics *inst);
         void handlePostInstruction(FPSemantics *inst);
         void handleReplacement(FPSemantics *inst);
+        void handleInlineNaN(FPSemantics *inst, size_t opIdx, size_t setIdx,
+                size_t inIdx, unsigned long bits);
 
         void finalOutput();
 
@@ -54,6 +84,11 @@ class FPAnalysisDNan : public FPAnalysis {
         size_t numRangeAddresses;
 
         size_t insnsInstrumented;
+
+        bool inlineChecks;
+        void *handlerPtr;
+
+        bool isCandidate(FPSemantics *inst);
 };
 
 }
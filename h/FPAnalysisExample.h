@@ -47,6 +47,7 @@ class FPAnalysisExample : public FPAnalysis {
         string finalInstReport();
 
         void registerInstruction(FPSemantics *inst);
+        bool supportsLazyRegistration();
         void handlePreInstruction(FPSemantics *inst);
         void handlePostInstruction(FPSemantics *inst);
         void handleReplacement(FPSemantics *inst);
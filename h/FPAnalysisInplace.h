@@ -53,11 +53,14 @@ class FPBinaryBlobInplace : public FPBinaryBlob, public Snippet {
         static const uint64_t IEEE64_FLAG       = 0x7ff4dead00000000;
         static const uint32_t IEEE32_FLAG       = 0x7ff4dead;
 
-        FPBinaryBlobInplace(FPSemantics *inst, FPSVPolicy *mainPolicy);
+        FPBinaryBlobInplace(FPSemantics *inst, FPSVPolicy *mainPolicy,
+                void *tagAddr = NULL);
 
         void enableLockPrefix();
         void disableLockPrefix();
 
+        void enableShardedCounters(void *ctl_addr, size_t slot);
+
         size_t buildSpecialOp(unsigned char *pos,
                 FPOperation *op, bool packed, bool &replaced);
         void addBlobInputEntry(vector<FPInplaceBlobInputEntry> &inputs,
@@ -102,6 +105,12 @@ class FPBinaryBlobInplace : public FPBinaryBlob, public Snippet {
 
         bool useLockPrefix;               // add LOCK prefix to INC instructions
 
+        void *shardControl;               // sharded counter control block (or NULL)
+        size_t shardSlot;                 // sharded counter slot for this instruction
+
+        void *tagAddr;                    // run-time tag slot (nonzero = single);
+                                          // NULL if the precision is fixed
+
         string debug_assembly;
         unsigned char debug_code[256];
         size_t debug_size;
@@ -111,6 +120,12 @@ class FPBinaryBlobInplace : public FPBinaryBlob, public Snippet {
 /**
  * Performs shadow-value analysis via in-place replacement. Only supports
  * down-casting (ex. replacement of doubles by singles).
+ *
+ * With "runtime_tags=yes" (fpinst -I), each binary blob contains both the
+ * single- and double-precision versions of its instruction and picks one by
+ * testing a per-instruction tag slot ("svinp_<idx>_tag_addr"). The slots are
+ * filled in from the current replacement tags at registration and again in
+ * reloadConfiguration, so one rewritten binary can run any configuration.
  */
 class FPAnalysisInplace : public FPAnalysis
 {
@@ -148,6 +163,7 @@ class FPAnalysisInplace : public FPAnalysis
         string finalInstReport();
 
         void registerInstruction(FPSemantics *inst);
+        void reloadConfiguration(FPConfig *runConfig);
         void handlePreInstruction(FPSemantics *inst);
         void handlePostInstruction(FPSemantics *inst);
         void handleReplacement(FPSemantics *inst);
@@ -173,6 +189,7 @@ class FPAnalysisInplace : public FPAnalysis
                 BPatch_addressSpace *app, bool &needsRegisters);
 
         void expandInstCount(size_t newSize);
+        void writeRuntimeTag(FPSemantics *inst, uint64_t *slot);
 
         void handleConvert(FPOperand *output, FPOperand *input);
         void handleZero(FPOperand *output);
@@ -242,6 +259,9 @@ class FPAnalysisInplace : public FPAnalysis
         vector<FPShadowEntry*> shadowEntries;
 
         bool useLockPrefix;               // add LOCK prefix to INC instructions
+        bool useShardedCounters;          // use per-thread sharded counters
+        bool useRuntimeTags;              // precision chosen at run time (incremental mode)
+        vector<pair<FPSemantics*, uint64_t*> > runtimeTagSlots;
 
         size_t *instCountSingle;
         size_t *instCountDouble;
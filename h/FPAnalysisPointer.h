@@ -91,6 +91,7 @@ class FPAnalysisPointer : public FPAnalysis
         string finalInstReport();
 
         void registerInstruction(FPSemantics *inst);
+        bool supportsLazyRegistration();
         void handlePreInstruction(FPSemantics *inst);
         void handlePostInstruction(FPSemantics *inst);
         void handleReplacement(FPSemantics *inst);
@@ -16,6 +16,9 @@ struct FPAnalysisRPrecInstData {
     unsigned long precision;
     unsigned long count;
     void *count_addr;
+    long count_slot;        // sharded counter slot (-1 if not sharded)
+    void *mask_addr;        // 16-byte truncation mask (NULL if the mask is
+                            // baked into the blob as an immediate)
 };
 
 /**
@@ -30,6 +33,8 @@ class FPBinaryBlobRPrec : public FPBinaryBlob, public Snippet {
         void enableLockPrefix();
         void disableLockPrefix();
 
+        void enableShardedCounters(void *ctl_addr);
+
         // allows FPAnalysisRPrec to selectively disable truncation if it wants
         void disableTruncation();
         void enableTruncation();
@@ -44,6 +49,7 @@ class FPBinaryBlobRPrec : public FPBinaryBlob, public Snippet {
         FPAnalysisRPrecInstData instData;
         bool doTruncation;
         bool useLockPrefix;
+        void *shardControl;
 
 };
 
@@ -79,6 +85,13 @@ class FPBinaryBlobRPrec : public FPBinaryBlob, public Snippet {
  * an instruction needs to output in order for the rest of the program to
  * succeed.
  *
+ * With "r_prec_runtime_precision=yes" (implied by "runtime_tags=yes"), each
+ * blob loads its truncation mask from a per-instruction slot instead of an
+ * immediate, and the mask is written from the configured precision when the
+ * instruction is registered at run time. A single rewritten binary can then be
+ * run at any precision by changing the configuration ($CRAFT_CONFIG, if set)
+ * instead of re-instrumenting.
+ *
  */
 class FPAnalysisRPrec : public FPAnalysis {
 
@@ -112,12 +125,16 @@ class FPAnalysisRPrec : public FPAnalysis {
         string finalInstReport();
 
         void registerInstruction(FPSemantics *inst);
+        void reloadConfiguration(FPConfig *runConfig);
         void handlePreInstruction(FPSemantics *inst);
         void handlePostInstruction(FPSemantics *inst);
         void handleReplacement(FPSemantics *inst);
 
         void reducePrecision(FPSemantics *inst, FPOperand *op);
 
+        unsigned long getCount(size_t idx);
+        size_t snapshotCounters(FPSnapshotEntry *entries, size_t maxEntries);
+
         void finalOutput();
 
     private:
@@ -125,6 +142,13 @@ class FPAnalysisRPrec : public FPAnalysis {
         FPAnalysisRPrec();
 
         bool useLockPrefix;
+        bool useShardedCounters;
+        bool useRuntimePrecision;
+
+        FPConfig *precisionConfig;
+        FPConfig *getPrecisionConfig();
+        unsigned long getConfiguredPrecision(size_t idx);
+        void writeTruncationMask(FPSemantics *inst, FPAnalysisRPrecInstData &data);
 
         void expandInstData(size_t newSize);
         FPAnalysisRPrecInstData *instData;
@@ -16,6 +16,7 @@ struct FPAnalysisTRangeInstData {
     long double min, max;
     unsigned long count;
     void *min_addr, *max_addr, *count_addr;
+    long count_slot;        // sharded counter slot (-1 if not sharded)
 };
 
 class FPBinaryBlobTRange : public FPBinaryBlob, public Snippet {
@@ -26,9 +27,12 @@ class FPBinaryBlobTRange : public FPBinaryBlob, public Snippet {
 
         bool generate(Point *pt, Buffer &buf);
 
+        void enableShardedCounters(void *ctl_addr);
+
     private:
 
         FPAnalysisTRangeInstData instData;
+        void *shardControl;
 };
 
 /**
@@ -71,6 +75,9 @@ class FPAnalysisTRange : public FPAnalysis {
 
         void checkRange(FPSemantics *inst, FPOperand *op);
 
+        unsigned long getCount(size_t idx);
+        size_t snapshotCounters(FPSnapshotEntry *entries, size_t maxEntries);
+
         void finalOutput();
 
     private:
@@ -85,6 +92,8 @@ class FPAnalysisTRange : public FPAnalysis {
         size_t numRangeAddresses;
 
         size_t insnsInstrumented;
+
+        bool useShardedCounters;
 };
 
 }
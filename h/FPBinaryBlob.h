@@ -3,6 +3,7 @@
 
 #include "FPCodeGen.h"
 #include "FPContext.h"
+#include "FPCounterShards.h"
 #include "FPSemantics.h"
 
 using namespace std;
@@ -21,7 +22,7 @@ class FPBinaryBlob {
         //static const int32_t DYNINST_STACK_OFFSET = 0x88;
         static const int32_t DYNINST_STACK_OFFSET = 0x90;
 
-        FPBinaryBlob(FPSemantics *inst);
+        FPBinaryBlob(FPSemantics *inst, size_t maxBytes = 1024);
 
         unsigned char *getBlobCode();
 
@@ -47,6 +48,15 @@ class FPBinaryBlob {
         size_t buildFakeStackPopGPR64(unsigned char *pos, FPRegister gpr);
         size_t buildFakeStackPopXMM(unsigned char *pos, FPRegister xmm);
 
+        size_t buildShardedIncMem64(unsigned char *pos, void *ctl_addr,
+                size_t slot, FPRegister ctl_gpr, FPRegister shard_gpr);
+
+        size_t buildHandlerCall(unsigned char *pos, void *handlerPtr,
+                FPRegister temp_gpr, const uint64_t *immArgs, size_t numImmArgs,
+                const FPRegister *xmmArgs, size_t numXmmArgs);
+
+        size_t buildLaneLoadXMM(unsigned char *pos, FPOperand *src, FPRegister dest_xmm);
+
         size_t buildOperandLoadGPR(unsigned char *pos, FPOperand *src, FPRegister dest_gpr);
         size_t buildOperandLoadXMM(unsigned char *pos, FPOperand *src, FPRegister dest_xmm, bool packed);
         size_t buildOperandStoreGPR(unsigned char *pos, FPRegister src, FPOperand *dest);
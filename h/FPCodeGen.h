@@ -118,6 +118,10 @@ class FPCodeGen {
         size_t buildCmpGPR64WithGPR64(unsigned char *pos, FPRegister rm, FPRegister reg);
 
         size_t buildAddGPR64ToGPR64(unsigned char *pos, FPRegister reg, FPRegister rm);
+        size_t buildSubGPR64FromGPR64(unsigned char *pos, FPRegister reg, FPRegister rm);
+
+        size_t buildShiftLeftGPR64(unsigned char *pos, FPRegister gpr, uint8_t bits);
+        size_t buildShiftRightGPR64(unsigned char *pos, FPRegister gpr, uint8_t bits);
 
         size_t buildIncMem64(unsigned char *pos, int32_t offset, bool lock = false);
 
@@ -139,6 +143,10 @@ class FPCodeGen {
         size_t buildJumpLessEqualNear32(unsigned char *pos,
                 int32_t offset, int32_t* &offset_pos);
 
+        // signed comparison (the ones above are unsigned)
+        size_t buildJumpSignedLessEqualNear32(unsigned char *pos,
+                int32_t offset, int32_t* &offset_pos);
+
         size_t buildNop(unsigned char *pos);
 
         // PINSR/PEXTR (SSE4) versions
@@ -155,6 +163,14 @@ class FPCodeGen {
         size_t buildSPAdjustment(unsigned char *pos,
                 int32_t offset);
 
+        size_t buildSPAlignment(unsigned char *pos,
+                uint8_t alignment);
+
+        size_t buildCallGPR64(unsigned char *pos, FPRegister gpr);
+
+        size_t buildFxsaveSP(unsigned char *pos);
+        size_t buildFxrstorSP(unsigned char *pos);
+
         size_t buildTrampExit(unsigned char *pos);
 
         size_t buildTrampReentrance(unsigned char *pos);
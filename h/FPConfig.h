@@ -2,9 +2,11 @@
 #define __FPCONFIG_H
 
 #include <ctype.h>
+#include <stdint.h>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 #include <map>
 #include <vector>
 
@@ -15,6 +17,53 @@ using namespace std;
 
 namespace FPInst {
 
+/**
+ * Binary configuration file layout:
+ *
+ *   FPConfigFileHeader
+ *   FPConfigFileSetting[numSettings]
+ *   uint32_t shadowLines[numShadowLines]           (string offsets)
+ *   uint32_t padding                               (if numShadowLines is odd)
+ *   FPConfigFileReplaceEntry[numReplaceEntries]    (in tree order)
+ *   FPConfigFileTag[numTags]                       (sorted by address)
+ *   string table (NUL-terminated strings)
+ *
+ * String offsets are relative to the start of the string table. The replace
+ * entries and resolved tags are used in place from a read-only mapping; only
+ * the (small) settings and shadow value tables are copied on load.
+ */
+struct FPConfigFileHeader {
+    char magic[8];              // CONFIG_FILE_MAGIC
+    uint32_t version;
+    uint32_t numSettings;
+    uint32_t numShadowLines;
+    uint32_t reserved;
+    uint64_t numReplaceEntries;
+    uint64_t numTags;
+    uint64_t stringsOffset;
+    uint64_t fileSize;
+};
+
+struct FPConfigFileSetting {
+    uint32_t key;
+    uint32_t value;
+};
+
+struct FPConfigFileReplaceEntry {
+    uint64_t idx;
+    uint64_t address;
+    int64_t  parent;            // index of parent entry (-1 if none)
+    uint32_t name;
+    uint8_t  type;
+    uint8_t  tag;
+    uint16_t reserved;
+};
+
+struct FPConfigFileTag {
+    uint64_t address;
+    uint64_t tag;               // effective tag
+};
+
 /**
  * Stores key-value pairs representing an analysis configuration.
  */
@@ -26,6 +75,9 @@ class FPConfig
 
         FPConfig();
         FPConfig(string filename);
+        ~FPConfig();
+
+        static bool isBinaryFile(string filename);
 
         bool hasValue(string key);
         string getValue(string key);
@@ -34,8 +86,28 @@ class FPConfig
         void getAllSettings(vector<string> &vals);
 
         bool hasReplaceTagTree();
+        void buildReplaceTagTable();
+
+        /**
+         * Replace the resolved instruction tags with those from another
+         * configuration file (text or binary), leaving the settings and the
+         * replacement tree itself alone. Used by the runtime in incremental
+         * mode, where one rewritten binary is reused for many configurations.
+         * Returns false if the file has no replacement entries.
+         */
+        bool loadReplaceTags(string filename);
+
         FPReplaceEntryTag getReplaceTag(void *address);
 
+        /**
+         * Get the resolved address-to-tag table in the binary file format
+         * (sorted by address). fpinst embeds this in the mutatee, and the
+         * runtime installs it with useReplaceTagTable() and searches it in
+         * place instead of rebuilding the configuration tree.
+         */
+        void getReplaceTagTable(vector<FPConfigFileTag> &tags);
+        void useReplaceTagTable(FPConfigFileTag *tags, size_t count);
+
         void getAllShadowEntries(vector<FPShadowEntry*> &entries);
         void getAllReplaceEntries(vector<FPReplaceEntry*> &entries);
         int getAddressList(void* addresses[], string key);
@@ -48,6 +120,7 @@ class FPConfig
         void addReplaceEntry(FPReplaceEntry *entry);
         void setValue(string key, string value);
         void saveFile(string filename);
+        bool saveBinaryFile(string filename);
 
     private:
 
@@ -89,6 +162,13 @@ class FPConfig
         FPReplaceEntry *currentFunction;
         FPReplaceEntry *currentBasicBlock;
 
+        static const uint32_t CONFIG_FILE_VERSION = 2;
+
+        bool loadBinaryFile(string filename);
+        void unloadBinaryFile();
+        void loadMappedReplaceEntries();
+        size_t getNumReplaceEntries();
+
         string getShadowEntryLine(FPShadowEntry *entry);
         string getReplaceEntryLine(FPReplaceEntry *rentry);
         void buildSummary(ostream &out, bool includeReplace=true);
@@ -96,7 +176,28 @@ class FPConfig
         map<string, string> settings;
         vector<FPShadowEntry*> shadowEntries;
         vector<FPReplaceEntry*> replaceEntries;
-        map<void*, FPReplaceEntry*> instructionEntries;
+
+        /**
+         * Flat address-to-effective-tag table (sorted by address), with
+         * module/function/block inheritance already resolved. Built once after
+         * the configuration is loaded and rebuilt only if entries are added
+         * afterwards; lookups never modify it.
+         */
+        vector<pair<void*, FPReplaceEntryTag> > tagTable;
+        bool tagTableValid;
+        bool tagTableOverride;      // set by loadReplaceTags
+
+        // mapped binary configuration file (if any); the replace entries are
+        // only turned into FPReplaceEntry objects if someone asks for them.
+        // mappedTags may also point at an embedded table (see
+        // useReplaceTagTable) with no mapping behind it.
+        char *mapBase;
+        size_t mapSize;
+        FPConfigFileReplaceEntry *mappedEntries;
+        size_t numMappedEntries;
+        FPConfigFileTag *mappedTags;
+        size_t numMappedTags;
+        const char *mappedStrings;
 };
 
 }
@@ -102,12 +102,13 @@ typedef struct {
  * snippets can easily be written to refresh values and to save them back to the
  * system.
  *
- * Note that right now this class is used as a singleton. There are several
- * global variables in the source file that act as pointers to the member
- * variables of this object. These must be intialized when the analysis begins.
- * This layer of indirection preserves the ability to use multiple FPContext
- * objects if this functionality is needed in the future, but currently I have
- * only seen the need for a single context.
+ * There is one context per mutatee thread. The runtime library allocates a
+ * contiguous pool of them at initialization, and several global variables in
+ * the library source act as pointers to the register fields of the first
+ * context in the pool. Instrumentation offsets these pointers by the Dyninst
+ * thread index (in multiples of sizeof(FPContext)) to reach the context for
+ * the current thread, and the handler entry points bind that context to the
+ * thread (and to FPAnalysis::context) on first use.
  */
 class FPContext
 {
@@ -0,0 +1,106 @@
+#ifndef __FPCOUNTERSHARDS_H
+#define __FPCOUNTERSHARDS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sstream>
+
+#include "BPatch.h"
+#include "BPatch_addressSpace.h"
+
+#include "FPConfig.h"
+
+using namespace std;
+
+namespace FPInst {
+
+/**
+ * Control block shared between binary blobs and the runtime library. It is
+ * allocated in the mutatee at instrumentation time (so that blobs can refer to
+ * it with an absolute address) and filled in by the runtime at initialization.
+ * Field offsets are hard-coded into generated code; do not reorder.
+ */
+struct FPCounterShardControl {
+    int64_t tls_offset;     // offset of _INST_counter_shard (an
+                            // FPCounterShardTLS) from the thread pointer
+                            // (zero until the runtime is initialized)
+    int64_t next_shard;     // index of the next unclaimed shard
+    int64_t max_shards;     // total number of per-thread shards
+    int64_t stride;         // size of a single shard (in bytes)
+    char   *base;           // first per-thread shard
+    char   *overflow;       // shared shard for threads beyond max_shards
+};
+
+/**
+ * Thread-local shard pointers (_INST_counter_shard). At most one of these is
+ * set: shard for threads that own a shard, and overflow (cached so that the
+ * shard counter is only bumped once per thread) for threads that do not.
+ * Field offsets are hard-coded into generated code; do not reorder.
+ */
+struct FPCounterShardTLS {
+    char *shard;
+    char *overflow;
+};
+
+/**
+ * Per-thread sharded instruction counters.
+ *
+ * Each counter is assigned a slot at instrumentation time. At runtime, every
+ * thread claims its own cache-line-padded shard (a copy of all slots) the
+ * first time it executes a counting blob and stores a pointer to it in a
+ * thread-local variable; the blob locates that variable using an FS-relative
+ * access. After that, blobs increment counters in the thread's shard without
+ * any atomic read-modify-write instructions. Threads beyond the maximum shard
+ * count fall back to LOCK-prefixed increments on a shared overflow shard.
+ * The final count for a slot is the sum over all shards. The shards are an
+ * anonymous mapping, so unclaimed shards cost no memory.
+ *
+ * The thread-local variable uses the initial-exec TLS model, which requires
+ * that the runtime library be loaded at startup (as it is in rewritten
+ * binaries).
+ */
+class FPCounterShards {
+
+    public:
+
+        static FPCounterShards* getInstance();
+
+        // INSTTIME
+        void* getControlAddress(BPatch_addressSpace *app, FPConfig *config);
+        size_t allocateSlot(FPConfig *config);
+
+        // RUNTIME
+        void initialize(FPConfig *config, size_t maxShards);
+        bool isInitialized();
+        unsigned long getCount(size_t slot);
+        size_t getNumSlots();
+
+        static const size_t CACHE_LINE_SIZE = 64;
+
+        static const int32_t CTL_TLS_OFFSET = 0;
+        static const int32_t CTL_NEXT_SHARD = 8;
+        static const int32_t CTL_MAX_SHARDS = 16;
+        static const int32_t CTL_STRIDE     = 24;
+        static const int32_t CTL_BASE       = 32;
+        static const int32_t CTL_OVERFLOW   = 40;
+
+        static const int32_t TLS_SHARD      = 0;
+        static const int32_t TLS_OVERFLOW   = 8;
+
+    private:
+
+        FPCounterShards();
+
+        static FPCounterShards* singletonShards;
+
+        FPCounterShardControl *control;
+        size_t numSlots;
+};
+
+}
+
+#endif
+
@@ -0,0 +1,158 @@
+#ifndef __FPDECODECACHE_H
+#define __FPDECODECACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "FPSemantics.h"
+
+using namespace std;
+
+namespace FPInst {
+
+/**
+ * On-disk decode cache file layout:
+ *
+ *   FPDecodeCacheHeader
+ *   FPDecodeCacheEntry[numEntries]     (sorted by address)
+ *   data area; for each entry (at dataOffset, 16-byte aligned):
+ *     FPDecodeCacheOp[numOps]
+ *     FPDecodeCacheOperand[numOperands]
+ *     char assembly[asmLength]
+ *
+ * All offsets are relative to the start of the file, so the file can be
+ * mapped read-only and used in place.
+ */
+struct FPDecodeCacheHeader {
+    char magic[8];              // DECODE_CACHE_MAGIC
+    uint32_t version;
+    uint32_t recordSizes;       // checksum of the record sizes below
+    char key[128];              // binary identifier (see computeBinaryKey)
+    uint64_t numEntries;
+    uint64_t fileSize;
+};
+
+struct FPDecodeCacheEntry {
+    uint64_t addr;
+    uint64_t dataOffset;
+    uint32_t numOps;
+    uint32_t numOperands;
+    uint32_t asmLength;
+    uint8_t  nbytes;
+    uint8_t  bytes[15];
+};
+
+struct FPDecodeCacheOp {
+    int32_t  type;
+    uint32_t numInputs;
+    uint32_t numOutputs;
+    uint32_t numOpSets;
+    int16_t  inputs[8];         // operand indices
+    int16_t  outputs[8];
+    uint32_t setNumIn[4];
+    uint32_t setNumOut[4];
+    int16_t  setIn[4][4];
+    int16_t  setOut[4][2];
+};
+
+struct FPDecodeCacheOperand {
+    int32_t type;
+    int32_t reg;
+    int32_t base;
+    int32_t index;
+    int32_t segment;
+    uint8_t immediate;
+    uint8_t inverted;
+    int64_t tag;
+    int64_t disp;
+    int64_t scale;
+    FPOperandValue value;
+};
+
+/**
+ * Persistent cache of decoded instructions (FPSemantics objects), keyed by
+ * binary identifier and instruction address. Decoding with XED dominates the
+ * startup cost of fpconf, fpinst, and the runtime library, and during an
+ * automated search the same binary is decoded hundreds of times.
+ *
+ * Existing cache files are mapped read-only and entries are reconstructed on
+ * demand; the instruction bytes are stored with each entry and checked on
+ * lookup. New entries are accumulated in memory and the merged cache is
+ * written back by save() (through a temporary file and rename, so concurrent
+ * readers always see a complete file).
+ */
+class FPDecodeCache {
+
+    public:
+
+        static const uint32_t DECODE_CACHE_VERSION = 1;
+
+        /**
+         * Returns an identifier for the given binary: the GNU build-id if the
+         * binary has one, otherwise a hash of the file contents.
+         */
+        static string computeBinaryKey(const char *path);
+
+        FPDecodeCache(string path, string key, bool writable);
+        ~FPDecodeCache();
+
+        /**
+         * Maps the cache file; returns false if it is missing, corrupt, or
+         * was created for a different binary.
+         */
+        bool load();
+
+        /**
+         * Rebuilds a cached instruction (NULL if not present).
+         */
+        FPSemantics* lookup(unsigned long iidx, void *addr,
+                unsigned char *bytes, size_t nbytes);
+
+        /**
+         * Records a newly-decoded instruction (ignored if not writable).
+         */
+        void add(FPSemantics *inst);
+
+        bool isModified();
+        bool save();
+
+        string getPath();
+        string getKey();
+        size_t getNumHits();
+        size_t getNumMisses();
+
+    private:
+
+        static uint32_t getRecordSizes();
+
+        void unload();
+        FPDecodeCacheEntry* findEntry(uint64_t addr);
+        void serialize(FPSemantics *inst, FPDecodeCacheEntry &entry, string &data);
+
+        string path;
+        string key;
+        bool writable;
+
+        // mapped file
+        char *mapBase;
+        size_t mapSize;
+        FPDecodeCacheEntry *entries;
+        size_t numEntries;
+
+        // new (unsaved) entries
+        map<uint64_t, pair<FPDecodeCacheEntry, string> > pending;
+
+        size_t numHits;
+        size_t numMisses;
+};
+
+}
+
+#endif
+
@@ -5,16 +5,37 @@ extern "C" {
 #include "xed-interface.h"
 }
 
+#include "FPDecodeCache.h"
 #include "FPDecoder.h"
 #include "FPOperation.h"
 
 #include <map>
 #include <sstream>
+#include <vector>
 
 using namespace std;
 
 namespace FPInst {
 
+/**
+ * Called whenever a deferred instruction is decoded (see FPDecoderXED::defer).
+ */
+typedef void (*FPDecodeCallback)(FPSemantics *inst);
+
+/**
+ * Raw bytes of an instruction that has been registered but not yet decoded.
+ */
+struct FPDeferredInst {
+    void *addr;
+    unsigned char *bytes;
+    size_t nbytes;
+};
+
+/**
+ * Shared work list for FPDecoderXED::decodeDeferred worker threads.
+ */
+struct FPDecodeBatch;
+
 class FPDecoderXED : public FPDecoder {
 
     public:
@@ -36,17 +57,59 @@ class FPDecoderXED : public FPDecoder {
         FPSemantics* lookup(unsigned long iidx);
         FPSemantics* lookupByAddr(void* addr);
 
+        /**
+         * Sort the address index used by lookupByAddr. This happens
+         * automatically on the first lookup, but calling it explicitly (e.g.,
+         * after decoding an entire application) keeps the cost out of the
+         * lookup path. Instructions decoded after the index is built are
+         * inserted into it in sorted order, so lookups never see a stale
+         * index. Not thread-safe.
+         */
+        void buildAddressIndex();
+
+        // lazy decoding: record the instruction now and decode it the first
+        // time it is looked up; the bytes must remain valid until then
+        void defer(unsigned long iidx, void *addr, unsigned char *bytes, size_t nbytes);
+
+        /**
+         * Decode all deferred instructions now, splitting the XED decoding
+         * across the given number of threads (including the caller). Decode
+         * cache lookups and updates are still done serially. Afterwards the
+         * deferred bytes are no longer referenced and may be released. Not
+         * thread-safe.
+         */
+        void decodeDeferred(unsigned nthreads);
+
+        void setDecodeCallback(FPDecodeCallback callback);
+        size_t getNumDecoded();
+
+        // persistent decode cache (consulted before decoding with XED)
+        void setCache(FPDecodeCache *cache);
+        FPDecodeCache* getCache();
+
     private:
 
+        FPSemantics* buildCached(unsigned long index, void *addr, unsigned char *bytes, size_t nbytes);
         FPSemantics* build(unsigned long index, void *addr, unsigned char *bytes, size_t nbytes);
+        static void* decodeWorker(void *arg);
 
         static FPRegister xedReg2FPReg(xed_reg_enum_t reg);
 
         void expandInstCache(size_t newSize);
         FPSemantics** instCacheArray;
+        FPDeferredInst* deferredArray;
         size_t instCacheSize;
+        size_t numDecoded;
+
+        FPDecodeCallback decodeCallback;
+        FPDecodeCache *cache;
+        volatile int deferredLock;
 
-        std::map<void *,unsigned long> iidxByAddr;
+        // flat address -> instruction index map, sorted by address
+        void addAddress(void *addr, unsigned long iidx);
+        std::vector<std::pair<void*, unsigned long> > addrIndex;
+        bool addrIndexSorted;
+        bool addrIndexBuilt;
 
         static string disassemble(xed_decoded_inst_t *xedd);
 
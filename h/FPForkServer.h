@@ -0,0 +1,32 @@
+#ifndef __FPFORKSERVER_H
+#define __FPFORKSERVER_H
+
+/**
+ * Fork-server protocol (libfpanalysis <-> fpforkrun):
+ *
+ * When a rewritten binary is started with CRAFT_FORK_SERVER=<socket>, the
+ * runtime initializes as usual and then, at the entry of main, listens on a
+ * Unix SOCK_SEQPACKET socket at that path instead of running the program.
+ * Each client connection sends a single request message:
+ *
+ *   "<working directory>\0<configuration file>\0"
+ *
+ * along with its stdin, stdout and stderr descriptors (SCM_RIGHTS). The
+ * server forks a child that switches to those descriptors and directory,
+ * reloads the replacement tags (and any other run-time settings, such as
+ * r_prec masks) from the configuration file, opens a fresh log, and then
+ * continues into main with the server's original arguments and environment
+ * (other than CRAFT_CONFIG), so the mode only fits searches where every run
+ * uses the same command line. When the child exits, the server replies with
+ * its wait status (an int) and closes the connection; if the client closes
+ * the connection first (e.g., because it was killed by a timeout), the child
+ * is killed. A request with an empty working directory shuts the server
+ * down.
+ */
+
+#define FP_FORK_SERVER_ENV      "CRAFT_FORK_SERVER"
+#define FP_FORK_SERVER_MAX_MSG  8192
+#define FP_FORK_SERVER_NUM_FDS  3
+
+#endif
+
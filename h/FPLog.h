@@ -1,11 +1,15 @@
 #ifndef __FPLOG_H
 #define __FPLOG_H
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
 #include <map>
+#include <sstream>
 
+#include <pthread.h>
+#include <string.h>
 #include "time.h"
 
 // StackwalkerAPI and SymtabAPI (needed for error traces)
@@ -22,6 +26,7 @@ using namespace Dyninst::SymtabAPI;
 using namespace Dyninst::Stackwalker;
 
 #include "FPSemantics.h"
+#include "FPLogBinary.h"
 
 using namespace std;
 
@@ -31,30 +36,69 @@ enum FPLogMsgType {
     STATUS, ERROR, WARNING, SUMMARY, CANCELLATION, ICOUNT, SHVALUE
 };
 
+// stack trace sampling defaults (see FPLog::setTraceSampling)
+const unsigned long DEFAULT_TRACE_MAX_PER_INST = 10;
+const double DEFAULT_TRACE_SAMPLE_RATE = 0.01;
+
+enum FPLogFormat {
+    LOG_XML,                // XML elements (readable by the viewer)
+    LOG_BINARY              // fixed-size records (see FPLogBinary.h)
+};
+
+enum FPLogWriteMode {
+    LOG_BUFFERED,           // write in large chunks from the calling thread
+    LOG_BUFFERED_THREAD,    // write in large chunks from a background thread
+    LOG_CRASHSAFE           // flush after every message
+};
+
 /**
  * Handles log file I/O.
  * Can serialize messages to an output file, including any desired stack traces
  * or debug information.
+ *
+ * By default, output is accumulated in memory and written out whenever more
+ * than LOG_BUFFER_SIZE bytes are pending (and at close), optionally by a
+ * background thread. This means that a crash can lose recent messages; use
+ * crash-safe mode (which flushes after each message) if that matters more than
+ * speed.
+ *
+ * Handlers may log from several threads at once, so the public methods that
+ * touch the buffer or the trace/instruction tables are serialized by a
+ * (recursive) log lock.
  */
 class FPLog
 {
     public:
 
         static string msgType2Str(FPLogMsgType type);
+        static FPLogWriteMode str2WriteMode(string mode);
 
         FPLog(string filename);
         FPLog(string filename, string appname);
 
         void setDebugFile(string filename);
 
+        void setFormat(FPLogFormat format);
+        FPLogFormat getFormat();
+        void setWriteMode(FPLogWriteMode mode);
+        FPLogWriteMode getWriteMode();
+        void flush();
+        void reopen(string filename);
+
         void enableStackWalks();
         void disableStackWalks();
         bool isStackWalkingEnabled();
 
         void addMessage(FPLogMsgType type, long priority, 
-                string label, string details, string trace,
+                const string &label, const string &details, const string &trace,
+                FPSemantics *inst=NULL);
+        void addMessage(FPLogMsgType type, long priority, 
+                const string &label, const string &details, long traceId,
                 FPSemantics *inst=NULL);
 
+        long getStackTraceId(unsigned skipFrames=5);
+        long getStackTraceId(FPSemantics *inst, unsigned skipFrames=5);
+        void setTraceSampling(unsigned long maxPerInst, double rate);
         string getStackTrace(unsigned skipFrames=5);
         string getFakeStackTrace(void *addr);
 
@@ -75,14 +119,79 @@ class FPLog
 
     private:
 
+        static const size_t LOG_BUFFER_SIZE = 4*1024*1024;
+
+        static void* writerThreadMain(void *log);
+
+        void initLock();
+
         string sanitize(const string &text);
 
+        void writeHeader();
+
+        void loadFunctionRanges();
+        string lookupFunction(Offset addr);
+        bool lookupSourceLine(Offset addr, string &file, long &line);
+
+        string symbolizeFrames(vector<Frame> &frames);
+        long addTrace(const string &trace);
         void writeTraces();
         void writeInstructions();
 
+        void writeRecord(uint32_t kind, const void *data, size_t size);
+        uint64_t addString(const string &str);
+        uint64_t internString(const string &str);
+
+        void messageFinished();
+        void writeBuffer();
+        void stopWriterThread();
+
+        pthread_mutex_t logLock;
+
         bool fileOpen;
         ofstream logfile;
+        stringstream buffer;
+        FPLogWriteMode writeMode;
+        FPLogFormat format;
+        string appname;
+        size_t numMessages;
+        bool dataWritten;
+
+        // binary format state; binOffset is the file offset of the next
+        // record, and labels and other short repeated strings are interned
+        // (everything else is streamed once and forgotten)
+        uint64_t binOffset;
+        map<string, uint64_t> binStringIds;
+
+        // background writer (LOG_BUFFERED_THREAD); pending output is handed
+        // off under writerLock and written to logfile by the writer thread
+        pthread_t writerThread;
+        pthread_mutex_t writerLock;
+        pthread_cond_t writerCond;
+        string writerPending;
+        bool writerRunning;
+        bool writerStop;
+
+        // stack traces; traces captured by getStackTraceId() are interned by
+        // a hash of their return addresses and symbolized once at close
+        struct FPLogRawTrace {
+            unsigned id;
+            vector<Address> addrs;
+            vector<Frame> frames;
+        };
         map<string, unsigned> traces;
+        multimap<uint64_t, size_t> rawTraceIndex;
+        vector<FPLogRawTrace> rawTraces;
+        unsigned nextTraceId;
+
+        // per-instruction trace sampling: the first traceMaxPerInst walks for
+        // each instruction are always taken, later ones with probability
+        // traceSampleRate (using a private generator so that the
+        // application's rand() sequence is unaffected)
+        vector<unsigned long> traceCounts;
+        unsigned long traceMaxPerInst;
+        double traceSampleRate;
+        uint64_t traceRandState;
         map<FPSemantics *, unsigned> instructions;
 
         // stack walking stuff
@@ -97,6 +206,23 @@ class FPLog
 
         // debug information
         Symtab *debug_symtab;
+
+        // symbolization caches; function ranges are loaded once from the
+        // debug symtab, and line ranges are remembered as they are queried
+        // (one query usually covers several consecutive instructions)
+        struct FPLogSourceRange {
+            Offset start;
+            Offset end;
+            string name;        // function or file name
+            long line;
+            bool operator<(const FPLogSourceRange &r) const {
+                return start < r.start;
+            }
+        };
+        vector<FPLogSourceRange> funcRanges;
+        bool funcRangesLoaded;
+        map<Offset, FPLogSourceRange> lineRanges;
+        map<Offset, FPLogSourceRange>::iterator lastLine;
 };
 
 }
@@ -0,0 +1,77 @@
+#ifndef __FPLOGBINARY_H
+#define __FPLOGBINARY_H
+
+#include <stdint.h>
+
+namespace FPInst {
+
+/**
+ * Binary log file layout (written by FPLog when log_format=binary):
+ *
+ *   FPLogBinaryHeader
+ *   record stream (FPLogBinaryRecord followed by its payload)
+ *
+ * Every record payload is padded to a multiple of eight bytes. Strings are
+ * streamed as FP_LOG_RECORD_STRING records (NUL-terminated) just ahead of the
+ * first record that refers to them, so they are flushed together with their
+ * messages; string fields hold the absolute file offset of the first
+ * character (offset zero is the empty string). Messages are written as they
+ * are logged; trace and instruction records follow at close, after which the
+ * header is filled in. A log with recordsEnd == 0 was not closed cleanly; all
+ * complete records up to the end of the file can still be recovered.
+ */
+
+#define FP_LOG_BINARY_MAGIC     "FPLOGBIN"
+#define FP_LOG_BINARY_VERSION   2
+
+struct FPLogBinaryHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t appname;
+    uint64_t numMessages;
+    uint64_t recordsOffset;
+    uint64_t recordsEnd;
+};
+
+enum FPLogBinaryRecordKind {
+    FP_LOG_RECORD_STRING = 1,
+    FP_LOG_RECORD_MESSAGE,
+    FP_LOG_RECORD_TRACE,
+    FP_LOG_RECORD_INST
+};
+
+struct FPLogBinaryRecord {
+    uint32_t kind;          // FPLogBinaryRecordKind
+    uint32_t size;          // payload size in bytes (padded)
+};
+
+struct FPLogBinaryMessage {
+    int64_t  time;
+    int64_t  priority;
+    uint64_t label;
+    uint64_t details;
+    int64_t  inst;          // instruction id (-1 if none)
+    uint32_t type;          // FPLogMsgType
+    uint32_t trace;         // trace id (0 if none)
+};
+
+struct FPLogBinaryTrace {
+    uint64_t id;
+    uint64_t text;
+};
+
+struct FPLogBinaryInst {
+    uint64_t id;
+    uint64_t address;
+    uint64_t function;
+    uint64_t file;
+    int64_t  lineno;        // -1 if no line information
+    uint64_t disassembly;
+    uint64_t text;
+};
+
+}
+
+#endif
+
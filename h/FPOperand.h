@@ -188,6 +188,8 @@ class FPOperand {
 
     private:
 
+        friend class FPDecodeCache;
+
         FPRegister reg;
         long tag;
         FPRegister base, index;
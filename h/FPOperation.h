@@ -145,6 +145,8 @@ class FPOperation {
         string toStringV();
 
     private:
+
+        friend class FPDecodeCache;
         
         FPOperand* inputs[8];
         FPOperand* outputs[8];
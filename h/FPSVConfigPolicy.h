@@ -9,12 +9,17 @@ namespace FPInst {
 /**
  * Handles decision-making for config-based in-place replacement. Differs to the
  * settings in an FPConfig object for replacement decisions.
+ *
+ * With runtime tags (incremental mode), every candidate is instrumented and
+ * the tags may change after instrumentation; instructions that are not
+ * tagged single-precision are then handled in double precision (i.e., they
+ * keep their original behavior).
  */
 class FPSVConfigPolicy : public FPSVPolicy {
 
     public:
 
-        FPSVConfigPolicy(FPConfig *config);
+        FPSVConfigPolicy(FPConfig *config, bool runtimeTags=false);
 
         bool shouldInstrument(FPSemantics *inst);
 
@@ -28,6 +33,9 @@ class FPSVConfigPolicy : public FPSVPolicy {
     private:
 
         FPConfig *config;
+        bool runtimeTags;
+
+        FPSVType getTagSVType(FPSemantics *inst);
 
 };
 
@@ -0,0 +1,104 @@
+#ifndef __FPSNAPSHOT_H
+#define __FPSNAPSHOT_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include "FPAnalysis.h"
+#include "FPSnapshotFile.h"
+
+namespace FPInst {
+
+/**
+ * Periodically streams the counters of the active analyses to a side file
+ * (see FPSnapshotFile.h) so that long-running jobs can be monitored.
+ *
+ * take() is called from the SIGPROF handler, so it must not block, allocate,
+ * or take locks: it fills one of two preallocated buffers and hands it to a
+ * writer thread, which does the actual I/O. If the writer is still busy with
+ * the previous buffer, the snapshot is dropped (and counted) instead.
+ *
+ * Per-instruction arrays are read without locks. They are normally sized once
+ * during registration (see FPAnalysis::reserveInstructions), and analyses
+ * bracket any later resize with beginResize() and endResize(); snapshots that
+ * would overlap a resize are dropped (and counted) instead.
+ *
+ * The last value written for every counter is kept so that each record only
+ * holds the counters that changed, as increments.
+ */
+class FPSnapshot {
+
+    public:
+
+        static FPSnapshot* getInstance();
+
+        /**
+         * Open the snapshot file, allocate buffers for every counter of
+         * numInsts instructions, and start the writer thread.
+         */
+        bool open(const char *filename, FPAnalysis **analyses,
+                size_t numAnalyses, size_t numInsts, long interval);
+        bool isOpen();
+
+        /**
+         * Take a snapshot (async-signal-safe).
+         */
+        void take();
+
+        /**
+         * Take a final snapshot, wait for it to be written, and stop the
+         * writer thread. The timer should already be disarmed.
+         */
+        void close();
+
+        size_t getNumTaken();
+        size_t getNumDropped();
+
+        /**
+         * Bracket a resize of per-instruction arrays that snapshotCounters()
+         * reads; beginResize() waits for a snapshot in progress in another
+         * thread to finish. Resizes may nest and run concurrently.
+         */
+        static void beginResize();
+        static void endResize();
+
+    private:
+
+        FPSnapshot();
+
+        static void* writerMain(void *arg);
+        void writeLoop();
+        bool writeAll(const char *buf, size_t len);
+
+        static FPSnapshot* singletonSnapshot;
+
+        static volatile long resizing;  // number of resizes in progress
+        static volatile int reading;    // set while take() reads counters
+
+        FPAnalysis **analyses;
+        size_t numAnalyses;
+        size_t numInsts;
+        size_t maxEntries;
+        uint64_t *lastValues;       // indexed by instruction, analysis, kind
+
+        int fd;
+        char *buffers[2];
+        size_t bufferUsed[2];
+        int current;                // buffer filled by take()
+        volatile int pending;       // buffer owned by the writer (-1 if idle)
+        volatile int busy;          // reentrancy guard for take()
+        volatile bool stopping;
+
+        sem_t ready;
+        pthread_t writer;
+        struct timespec start;
+
+        unsigned long seq;
+        unsigned long dropped;
+};
+
+}
+
+#endif
+
@@ -0,0 +1,66 @@
+#ifndef __FPSNAPSHOTFILE_H
+#define __FPSNAPSHOTFILE_H
+
+#include <stdint.h>
+
+namespace FPInst {
+
+/**
+ * Counter snapshot file layout (written by FPSnapshot when
+ * snapshot_interval is set):
+ *
+ *   FPSnapshotHeader
+ *   { FPSnapshotRecord, FPSnapshotEntry[numEntries] } ...
+ *
+ * Records are appended as the program runs, so the file can be read (or
+ * tailed) at any time; a short record at the end was still being written.
+ * Each record only holds the counters that changed since the previous record,
+ * as increments, so the current value of a counter is the sum of its entries
+ * in all records so far. An entry's key packs the instruction index, the
+ * analysis (an index into the header's tag table), and the FPSnapshotKind.
+ * "dropped" is the number of snapshots skipped so far because the writer had
+ * not yet finished with the previous one or the counters were being resized;
+ * the increments they would have held show up in the next record.
+ */
+
+#define FP_SNAPSHOT_MAGIC           "FPSNAP"
+#define FP_SNAPSHOT_VERSION         2
+#define FP_SNAPSHOT_MAX_ANALYSES    16
+#define FP_SNAPSHOT_TAG_LEN         16
+
+enum FPSnapshotKind {
+    SNAPSHOT_COUNT = 0,     // execution count
+    SNAPSHOT_CANCELS = 1,   // cancellation count (d_cancel)
+    SNAPSHOT_NUM_KINDS
+};
+
+#define FP_SNAPSHOT_KEY(iidx,analysis,kind) \
+    (((uint64_t)(iidx) << 8) | ((uint64_t)(analysis) << 4) | (uint64_t)(kind))
+#define FP_SNAPSHOT_IIDX(key)       ((key) >> 8)
+#define FP_SNAPSHOT_ANALYSIS(key)   (((key) >> 4) & 0xf)
+#define FP_SNAPSHOT_KIND(key)       ((key) & 0xf)
+
+struct FPSnapshotHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t numAnalyses;
+    uint64_t interval;      // milliseconds
+    char     tags[FP_SNAPSHOT_MAX_ANALYSES][FP_SNAPSHOT_TAG_LEN];
+};
+
+struct FPSnapshotRecord {
+    uint64_t seq;
+    uint64_t time;          // microseconds since the first snapshot was armed
+    uint64_t numEntries;
+    uint64_t dropped;
+};
+
+struct FPSnapshotEntry {
+    uint64_t key;           // FP_SNAPSHOT_KEY(iidx, analysis, kind)
+    uint64_t value;         // increment since the previous record
+};
+
+}
+
+#endif
+
@@ -9,6 +9,25 @@ extern long _INST_DISABLED;
 extern long _INST_INACTIVE;
 extern long _INST_ACTIVE;
 extern long _INST_status;
+extern __thread long _INST_thread_status;
+
+/*
+ * _INST_status is the process-wide state (_INST_DISABLED until the analysis
+ * is enabled, then _INST_INACTIVE until it is disabled or cleaned up), and
+ * _INST_thread_status records whether the current thread is inside the
+ * library. Everything that runs library code on behalf of the mutatee should
+ * be bracketed by these so that library allocations are recognized (see
+ * fpinst_malloc) and replaced functions are not re-entered.
+ */
+inline void _INST_enter_library()
+{
+    _INST_thread_status = _INST_ACTIVE;
+}
+
+inline void _INST_leave_library()
+{
+    _INST_thread_status = _INST_INACTIVE;
+}
 
 #endif
 
@@ -1,6 +1,8 @@
 #ifndef __FPINFO_H
 #define __FPINFO_H
 
+#include <stdint.h>
+
 // STL classes
 #include <string>
 
@@ -37,6 +39,21 @@ struct FPAnalysisInfo {
 };
 
 
+/**
+ * FPRegistrationEntry - Packed description of a single instrumented
+ *                       instruction; fpinst embeds a table of these in the
+ *                       mutatee and the fpanalysis library decodes the whole
+ *                       table at startup (see _INST_register_inst_table)
+ */
+#define FP_REG_ENTRY_MAX_BYTES 15
+struct FPRegistrationEntry {
+        uint64_t iidx;                          // instruction index
+        uint64_t addr;                          // original address
+        uint8_t  nbytes;                        // instruction length
+        uint8_t  bytes[FP_REG_ENTRY_MAX_BYTES]; // original instruction bytes
+} __attribute__((packed));
+
+
 // total number of valid analyses
 // NEWMODE: increment this number
 //
@@ -3,8 +3,11 @@
 
 // standard C libs
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 // STL classes
 #include <string>
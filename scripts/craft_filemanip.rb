@@ -24,6 +24,8 @@ def save_settings
     f.puts "baseline_runtime=#{$baseline_runtime}"
     f.puts "lang=#{($fortran_mode ? "fortran" : "other")}"
     f.puts "variable_mode=#{($variable_mode ? "yes" : "no")}"
+    f.puts "incremental_mode=#{($incremental_mode ? "yes" : "no")}"
+    f.puts "fork_server_mode=#{($fork_server_mode ? "yes" : "no")}"
     f.puts "base_type=#{$base_type}"
     f.puts "skip_nonexecuted=#{$skip_nonexecuted}"
     f.puts "initial_cfg_fn=#{$initial_cfg_fn}"
@@ -38,6 +40,7 @@ def save_settings
     f.puts "num_trials=#{$num_trials.to_s}"
     f.puts "timeout_limit=#{$timeout_limit.to_s}"
     f.puts "max_inproc=#{$max_inproc.to_s}"
+    f.puts "cores_per_config=#{$cores_per_config.to_s}"
     f.puts "keep_all_runs=#{$keep_all_runs ? "yes" : "no"}"
     f.puts "group_by_labels=#{$group_by_labels.join(",")}"
     f.puts "merge_overlapping_groups=#{$merge_overlapping_groups ? "yes" : "no"}"
@@ -71,6 +74,10 @@ def load_settings
             $fortran_mode = (value == "fortran")
         when "variable_mode"
             $variable_mode = (value == "yes")
+        when "incremental_mode"
+            $incremental_mode = (value == "yes")
+        when "fork_server_mode"
+            $fork_server_mode = (value == "yes")
         when "base_type"
             $base_type = value
         when "skip_nonexecuted"
@@ -99,6 +106,8 @@ def load_settings
             $timeout_limit = value.to_i
         when "max_inproc"
             $max_inproc = value.to_i
+        when "cores_per_config"
+            $cores_per_config = value.to_i
         when "keep_all_runs"
             $keep_all_runs = (value == "yes")
         when "group_by_labels"
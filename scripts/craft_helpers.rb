@@ -20,6 +20,9 @@ def parse_command_line
             elsif opt =~ /^-j/ then
                 # parallel: "-j4" variant
                 $max_inproc = opt[2,opt.length-2].to_i
+            elsif opt == "-P" then
+                # pin each config to a set of cores
+                $cores_per_config = ARGV.shift.to_i
             elsif opt == "-k" then
                 # keep all temporary files
                 $keep_all_runs = true
@@ -57,6 +60,12 @@ def parse_command_line
             elsif opt == '-N' then
                 # fortran mode
                 $fortran_mode = true
+            elsif opt == '-I' then
+                # incremental mode
+                $incremental_mode = true
+            elsif opt == '-F' then
+                # fork-server mode (incremental mode only)
+                $fork_server_mode = true
             elsif opt == '-V' then
                 # variable mode
                 $variable_mode = true
@@ -137,6 +146,14 @@ def parse_command_line
         puts "No binary included on command-line."
         exit
     end
+    if $fork_server_mode and (!$incremental_mode or $variable_mode) then
+        puts "Fork-server mode (-F) requires incremental mode (-I)."
+        exit
+    end
+    if $fork_server_mode and ($job_mode != "exec" or $cores_per_config > 0) then
+        puts "Fork-server mode (-F) only supports unpinned \"exec\" jobs."
+        exit
+    end
 end
 
 def merge_additional_configs
@@ -424,6 +441,51 @@ def run_profiler
     return passed
 end
 
+def build_incremental_mutant
+    if not File.exist?($inc_path) then
+        Dir.mkdir($inc_path)
+    end
+    Dir.chdir($inc_path)
+
+    # instrument every candidate from the original configuration once; each
+    # configuration run then only supplies its own tags (via CRAFT_CONFIG)
+    cmd = "#{$fpinst_invoke} -i -I #{$fortran_mode ? "-N" : ""} -c #{$orig_config_fn} #{$binary_path}"
+    Open3.popen3(cmd) do |io_in, io_out, io_err|
+        io_out.each_line do |line| end
+    end
+
+    Dir.chdir($search_path)
+    return File.exist?("#{$inc_path}mutant")
+end
+
+def start_fork_server
+    # run the shared mutant once through the driver; it initializes and then
+    # waits at the entry of main for fpforkrun requests (see FPForkServer.h).
+    # Every run reuses the driver's command line from this invocation.
+    $fork_socket = "#{Dir.tmpdir}/craft-#{Process.pid}.sock"
+    FileUtils.rm_f($fork_socket)
+    $fork_server_pid = Process.spawn({"CRAFT_FORK_SERVER" => $fork_socket},
+        "#{$search_path}#{$craft_driver} #{$inc_path}mutant",
+        :chdir => $inc_path, [:out, :err] => ["#{$inc_path}fork_server.log", "w"])
+    until File.socket?($fork_socket)
+        if Process.waitpid($fork_server_pid, Process::WNOHANG) then
+            return false
+        end
+        sleep 0.1
+    end
+    return true
+end
+
+def stop_fork_server
+    # the server finishes any outstanding runs before exiting
+    system("#{$fpforkrun_invoke} -q #{$fork_socket}")
+    begin
+        Process.waitpid($fork_server_pid)
+    rescue Errno::ECHILD
+        # already reaped
+    end
+end
+
 def read_profiler_data
     pt_by_id = Hash.new
 
@@ -612,6 +674,20 @@ def start_config (cfg)
     if $variable_mode then
         script.print "#{$search_path}#{$craft_builder} #{cfg_file} | tee .build_status"
         script.puts " &>> #{out_fn}"
+    elsif $incremental_mode then
+        script.puts "export CRAFT_CONFIG=#{cfg_file}"
+        if $fork_server_mode then
+            # forward the driver's run to the fork server (which ignores the
+            # arguments and uses those of its own driver run)
+            File.open("#{cfg_path}mutant", "w") do |wrapper|
+                wrapper.puts "#!/usr/bin/env bash"
+                wrapper.puts "exec #{$fpforkrun_invoke} #{$fork_socket}"
+            end
+            File.chmod(0700, "#{cfg_path}mutant")
+        else
+            script.puts "ln -sf #{$inc_path}mutant mutant"
+        end
+        script.puts "touch .build_status"
     else
         script.print "#{$fpinst_invoke} -i #{$fortran_mode ? "-N" : ""}"
         script.print " -c #{cfg_file} #{$binary_path} | tee .build_status"
@@ -630,8 +706,12 @@ def start_config (cfg)
     File.chmod(0700, run_fn)
     case $job_mode
     when "exec"
-        pid = fork { exec "#{run_fn}" }
-        Process.detach(pid)
+        # not detached; the search loop reaps it (see is_config_running?)
+        if cfg.attrs.has_key?("cores") then
+            pid = fork { exec "taskset", "-c", cfg.attrs["cores"], run_fn }
+        else
+            pid = fork { exec "#{run_fn}" }
+        end
     when "slurm"
         output = `sbatch #{run_fn} 2>&1`
         if output =~ /Submitted batch job (\d+)/ then
@@ -648,8 +728,19 @@ end
 def is_config_running? (cfg)
     case $job_mode
     when "exec"
-        # TODO: check all child pids as well? (unnecessary so far in testing)
-        return `ps -o state= -p #{cfg.attrs["pid"]}`.chomp =~ /R|D|S/
+        pid = cfg.attrs["pid"].to_i
+        return false if $exited_pids.has_key?(pid)
+        begin
+            if Process.waitpid(pid, Process::WNOHANG) then
+                $exited_pids[pid] = $?.exitstatus
+                return false
+            end
+            return true
+        rescue Errno::ECHILD
+            # not one of our children; fall back to checking the process table
+            # TODO: check all child pids as well? (unnecessary so far in testing)
+            return `ps -o state= -p #{pid}`.chomp =~ /R|D|S/
+        end
     when "slurm"
         status = `sacct -nDX -o state -j #{cfg.attrs["pid"]}`
         return false if status =~ /BOOT_FAIL|CANCELLED|COMPLETED|DEADLINE|FAILED/
@@ -687,6 +778,18 @@ def halt_config (cfg)
 end
 
 def wait_for_config (cfg)
+    if $job_mode == "exec" then
+        pid = cfg.attrs["pid"].to_i
+        begin
+            if not $exited_pids.has_key?(pid) then
+                Process.waitpid(pid)
+                $exited_pids[pid] = $?.exitstatus
+            end
+            return
+        rescue Errno::ECHILD
+            # not one of our children; poll below
+        end
+    end
     wait_time = 1
     while is_config_running?(cfg)
         sleep wait_time
@@ -695,6 +798,75 @@ def wait_for_config (cfg)
     end
 end
 
+def init_job_scheduler
+
+    # only "exec" jobs are our own child processes
+    return if $job_mode != "exec"
+
+    # wake up the search loop whenever a test finishes (see wait_for_job_events)
+    $child_exit_r, $child_exit_w = IO.pipe
+    trap("CHLD") do
+        begin
+            $child_exit_w.write_nonblock(".")
+        rescue IO::WaitWritable, Errno::EINTR
+            # the loop already has a wakeup pending
+        end
+    end
+
+    # split the cores we are allowed to use into disjoint sets
+    $free_core_sets = []
+    $num_core_sets = 0
+    return if $cores_per_config <= 0
+    if not system("taskset -V > /dev/null 2>&1") then
+        puts "WARNING: taskset not found; configurations will not be pinned to cores."
+        return
+    end
+    cores = []
+    File.foreach("/proc/self/status") do |line|
+        if line =~ /^Cpus_allowed_list:\s*(\S+)/ then
+            $1.split(",").each do |range|
+                lo, hi = range.split("-").map { |c| c.to_i }
+                cores.concat((lo..(hi.nil? ? lo : hi)).to_a)
+            end
+        end
+    end if File.exist?("/proc/self/status")
+    cores = (0...Etc.nprocessors).to_a if cores.empty?
+    cores.each_slice($cores_per_config) do |set|
+        $free_core_sets << set.join(",") if set.size == $cores_per_config
+    end
+    $free_core_sets << cores.join(",") if $free_core_sets.empty?
+    $num_core_sets = $free_core_sets.size
+    puts "Pinning configurations to #{$num_core_sets} set(s) of #{$cores_per_config} core(s)."
+end
+
+def get_inproc_limit
+    # the core sets also cap the number of simultaneous tests
+    return $max_inproc if $num_core_sets == 0
+    return $num_core_sets if $max_inproc < 0
+    return min($max_inproc, $num_core_sets)
+end
+
+def assign_cores (cfg)
+    cfg.attrs.delete("cores")   # stale if resumed
+    cfg.attrs["cores"] = $free_core_sets.shift if $free_core_sets.size > 0
+end
+
+def release_cores (cfg)
+    $free_core_sets << cfg.attrs.delete("cores") if cfg.attrs.has_key?("cores")
+end
+
+def wait_for_job_events (timeout)
+    # sleep until a test finishes (or the given time passes); a test that
+    # finished before we got here has already written to the pipe
+    if IO.select([$child_exit_r], nil, nil, max(timeout, 0)) then
+        begin
+            $child_exit_r.read_nonblock(4096)
+        rescue IO::WaitReadable, EOFError
+            # drained
+        end
+    end
+end
+
 def get_config_results (cfg)
 
     # output filename
@@ -787,6 +959,8 @@ def print_usage
     puts "   -J <name>      use <name> job submission system (default is \"exec\")"
     puts "                    valid systems:  \"exec\", \"slurm\""
     puts "   -k             keep all temporary run files"
+    puts "   -P <n>         pin each configuration to its own set of <n> cores (\"exec\" jobs only;"
+    puts "                    also limits simultaneous jobs to the number of core sets)"
     puts "   -s <name>      use <name> strategy (default is \"bin_simple\")"
     puts "                    valid strategies:  \"simple\", \"bin_simple\", \"comp_simple\", \"exhaustive\","
     puts "                                       \"combinational\", \"compositional\", \"rprec\""
@@ -802,6 +976,11 @@ def print_usage
     puts "   -D <p> <a>     debug mode (<p> -> <a> instead of double->single)"
     puts "                    (-d and -D also adjust the fpconf options appropriately)"
     puts "   -f             stop splitting configs at the function level"
+    puts "   -I             incremental mode: rewrite the binary once and switch precision at run time"
+    puts "                    (in-place mixed-precision searches only)"
+    puts "   -F             fork-server mode (with \"-I\"): initialize the shared mutant once and fork"
+    puts "                    every run from it (the driver must run the mutant with the same"
+    puts "                    arguments every time; unpinned \"exec\" jobs only)"
     puts "   -N             enable Fortran mode (passes \"-N\" to fpinst)"
     puts "   -S             disable queue sorting (improves overall performance but may converge slower)"
     puts " "
@@ -878,6 +1057,7 @@ def print_status
         status_text << "#{indent}Search strategy: #{"%23s" % $strategy_name}"
         status_text << "#{indent}Base type:  #{"%28s" % $base_type}"
         status_text << "#{indent}Max in-proc configs:       #{"%13d" % $max_inproc}"
+        status_text << "#{indent}Cores per config:          #{"%13d" % $cores_per_config}" if $cores_per_config > 0
         status_text << "#{indent}Trials per config:         #{"%13d" % $num_trials}"
         status_text << "#{indent}Total candidates:          #{"%13d" % $total_candidates}"
         summary = get_tested_configs_summary
@@ -1194,6 +1374,7 @@ def clean_everything
     Dir.glob("#{$search_tag}.*") do |fn| toDelete << fn end
     Dir.glob($perf_path) do |fn| toDelete << fn end
     Dir.glob($prof_path) do |fn| toDelete << fn end
+    Dir.glob($inc_path) do |fn| toDelete << fn end
     Dir.glob($run_path) do |fn| toDelete << fn end
     Dir.glob($final_path) do |fn| toDelete << fn end
     Dir.glob($best_path) do |fn| toDelete << fn end
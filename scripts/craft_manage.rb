@@ -76,6 +76,28 @@ def initialize_search
     # depends on initial configuration being present
     initialize_program
 
+    # shared instrumented binary (incremental mode only)
+    if $incremental_mode and not $variable_mode then
+        print "Building incremental mutant ... "
+        $stdout.flush
+        if !build_incremental_mutant then
+            puts "Unable to build incremental mutant!"
+            puts "Aborting search."
+            exit
+        end
+        puts "Done."
+        if $fork_server_mode then
+            print "Starting fork server ... "
+            $stdout.flush
+            if !start_fork_server then
+                puts "Unable to start fork server!"
+                puts "Aborting search."
+                exit
+            end
+            puts "Done."
+        end
+    end
+
     # initial performance run
     # depends on $program being initialized
     print "Performing baseline performance test ... "
@@ -169,15 +191,20 @@ def resume_lower_search
 end # }}}
 # {{{ run_main_search_loop
 def run_main_search_loop
-    wait_time = 1   # exponential backoff for queue monitoring
+    wait_time = 1   # exponential backoff for queue monitoring (non-"exec" jobs)
+    init_job_scheduler
+    inproc_limit = get_inproc_limit
     while get_workqueue_length + get_inproc_length > 0 do
 
         # check for configs that have timed out
         limit = $timeout_limit*$num_trials + 60   # +60s for instrumentation
+        next_timeout = 60                         # check at least once per minute
         get_inproc_configs.each do |cfg|
             rtime = Time.now.to_i - cfg.attrs["start_time"]
             if rtime > limit then
                 halt_config(cfg)
+            else
+                next_timeout = min(next_timeout, limit - rtime + 1)
             end
         end
 
@@ -205,6 +232,7 @@ def run_main_search_loop
             add_to_mainlog(msg)
 
             # update data structures and invoke strategy to update search
+            release_cores(cfg)
             add_tested_config(cfg)
             remove_from_inproc(cfg)
             $strategy.handle_completed_config(cfg)
@@ -214,18 +242,25 @@ def run_main_search_loop
         end
 
         # start new configurations if possible
-        while get_workqueue_length > 0 and ($max_inproc < 0 or
-                                            get_inproc_length < $max_inproc) do
+        while get_workqueue_length > 0 and (inproc_limit < 0 or
+                                            get_inproc_length < inproc_limit) do
             cfg = get_next_workqueue_item
             puts "Testing config #{cfg.shortlabel}."
+            assign_cores(cfg)
             start_config(cfg)
             add_to_inproc(cfg)
-            wait_for_config(cfg) if $max_inproc == 1
+            wait_for_config(cfg) if inproc_limit == 1
         end
 
-        sleep wait_time unless $max_inproc == 1
-        wait_time *= 2
-        wait_time = min(wait_time, 60)  # check at least once per minute
+        if $job_mode == "exec" then
+            # our own children; wake up as soon as one of them exits
+            wait_for_job_events(next_timeout) unless inproc_limit == 1 or
+                                                     get_inproc_length == 0
+        else
+            sleep wait_time unless inproc_limit == 1
+            wait_time *= 2
+            wait_time = min(wait_time, 60)  # check at least once per minute
+        end
 
     end
 end # }}}
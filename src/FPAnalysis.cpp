@@ -2,6 +2,8 @@
 
 namespace FPInst {
 
+__thread FPContext *FPAnalysis::context = NULL;
+
 FPAnalysis::FPAnalysis()
 { }
 
@@ -62,6 +64,9 @@ string FPAnalysis::finalInstReport()
     return "";
 }
 
+void FPAnalysis::reserveInstructions(size_t)
+{ }
+
 void FPAnalysis::registerInstruction(FPSemantics *)
 { }
 
@@ -74,6 +79,33 @@ void FPAnalysis::handlePostInstruction(FPSemantics *)
 void FPAnalysis::handleReplacement(FPSemantics *)
 { }
 
+bool FPAnalysis::supportsLazyRegistration()
+{
+    return false;
+}
+
+void FPAnalysis::reloadConfiguration(FPConfig * /*runConfig*/)
+{ }
+
+size_t FPAnalysis::snapshotCounters(FPSnapshotEntry * /*entries*/, size_t /*maxEntries*/)
+{
+    return 0;
+}
+
+void* FPAnalysis::allocateHandlerSlot(BPatch_addressSpace *app, string key)
+{
+    void *empty = NULL;
+    BPatch_variableExpr *var = app->malloc(sizeof(void*));
+    var->writeValue(&empty, sizeof(void*), false);
+
+    stringstream ss;
+    ss.clear(); ss.str("");
+    ss << hex << var->getBaseAddr();
+    configuration->setValue(key, ss.str());
+
+    return var->getBaseAddr();
+}
+
 void FPAnalysis::finalOutput()
 { }
 
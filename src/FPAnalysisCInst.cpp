@@ -1,4 +1,5 @@
 #include "FPAnalysisCInst.h"
+#include "FPSnapshot.h"
 
 namespace FPInst {
 
@@ -25,8 +26,14 @@ FPAnalysisCInst::FPAnalysisCInst()
 {
     instCountSize = 0;
     instCount = NULL;
+    instData = NULL;
     expandInstCount(2000);
     insnsInstrumented = 0;
+    insnsCountedByBlock = 0;
+    inlineCounters = true;
+    useShardedCounters = false;
+    blockCounts = false;
+    blockLeader = NULL;
 }
 
 string FPAnalysisCInst::getTag()
@@ -43,12 +50,21 @@ void FPAnalysisCInst::configure(FPConfig *config, FPDecoder *decoder,
         FPLog *log, FPContext *context)
 {
     FPAnalysis::configure(config, decoder, log, context);
+    if (config->getValue("cinst_inline") == "no") {
+        inlineCounters = false;
+    }
+    if (config->getValue("use_sharded_counters") == "yes") {
+        useShardedCounters = true;
+    }
+    if (config->getValue("cinst_block_counts") == "yes") {
+        blockCounts = true;
+    }
     //status << "c_inst: initialized" << endl;
 }
 
-bool FPAnalysisCInst::shouldPreInstrument(FPSemantics * /*inst*/)
+bool FPAnalysisCInst::shouldPreInstrument(FPSemantics *inst)
 {
-    return true;
+    return !inlineCounters && !isCountedByBlock(inst);
 }
 
 bool FPAnalysisCInst::shouldPostInstrument(FPSemantics * /*inst*/)
@@ -56,9 +72,9 @@ bool FPAnalysisCInst::shouldPostInstrument(FPSemantics * /*inst*/)
     return false;
 }
 
-bool FPAnalysisCInst::shouldReplace(FPSemantics * /*inst*/)
+bool FPAnalysisCInst::shouldReplace(FPSemantics *inst)
 {
-    return false;
+    return inlineCounters && !isCountedByBlock(inst);
 }
 
 Snippet::Ptr FPAnalysisCInst::buildPreInstrumentation(FPSemantics *inst,
@@ -85,36 +101,170 @@ Snippet::Ptr FPAnalysisCInst::buildPostInstrumentation(FPSemantics * /*inst*/,
     return Snippet::Ptr();
 }
 
-Snippet::Ptr FPAnalysisCInst::buildReplacementCode(FPSemantics * /*inst*/,
-        BPatch_addressSpace * /*app*/, bool & /*needsRegisters*/)
+Snippet::Ptr FPAnalysisCInst::buildReplacementCode(FPSemantics *inst,
+        BPatch_addressSpace *app, bool & /*needsRegisters*/)
 {
-    return Snippet::Ptr();
+    size_t idx = inst->getIndex();
+    void *countAddr = NULL;
+    long countSlot = -1;
+
+    stringstream ss("");
+    string key, value;
+
+    if (useShardedCounters) {
+        countSlot = (long)FPCounterShards::getInstance()->allocateSlot(configuration);
+
+        ss << "inst" << dec << idx << "_cinst_count_slot";
+        key = ss.str(); ss.str("");
+        ss << dec << countSlot;
+        value = ss.str(); ss.str("");
+        configuration->setValue(key, value);
+    } else {
+        countAddr = app->malloc(sizeof(unsigned long))->getBaseAddr();
+
+        ss << "inst" << dec << idx << "_cinst_count_addr";
+        key = ss.str(); ss.str("");
+        ss << hex << countAddr;
+        value = ss.str(); ss.str("");
+        configuration->setValue(key, value);
+    }
+
+    insnsInstrumented++;
+
+    FPBinaryBlobCInst *blob = new FPBinaryBlobCInst(inst, countAddr, countSlot);
+    if (useShardedCounters) {
+        blob->enableShardedCounters(
+                FPCounterShards::getInstance()->getControlAddress(app, configuration));
+    }
+    return Snippet::Ptr(blob);
+}
+
+FPBinaryBlobCInst::FPBinaryBlobCInst(FPSemantics *inst,
+        void *countAddr, long countSlot)
+    : FPBinaryBlob(inst)
+{
+    this->countAddr = countAddr;
+    this->countSlot = countSlot;
+    this->shardControl = NULL;
+}
+
+void FPBinaryBlobCInst::enableShardedCounters(void *ctl_addr)
+{
+    shardControl = ctl_addr;
+}
+
+bool FPBinaryBlobCInst::generate(Point * /*pt*/, Buffer &buf)
+{
+    size_t origNumBytes = inst->getNumBytes();
+    unsigned char *orig_code, *pos, *opos;
+    FPRegister temp_gpr1, temp_gpr2;
+    FPOperation *op;
+    FPOperand *eip_operand = NULL;
+    size_t i, j, k;
+
+    initialize();
+
+    // allocate space for blob code
+    orig_code = (unsigned char*)malloc(origNumBytes);
+    inst->getBytes(orig_code);
+
+    setBlobAddress((void*)buf.curAddr());
+    pos = getBlobCode();
+
+    // check for an IP-relative operand
+    for (i=0; i<inst->numOps; i++) {
+        op = (*inst)[i];
+        for (j=0; j<op->numOpSets; j++) {
+            for (k=0; k<op->opSets[j].nIn; k++) {
+                if (op->opSets[j].in[k]->getBase() == REG_EIP) {
+                    eip_operand = op->opSets[j].in[k];
+                }
+            }
+            for (k=0; k<op->opSets[j].nOut; k++) {
+                if (op->opSets[j].out[k]->getBase() == REG_EIP) {
+                    eip_operand = op->opSets[j].out[k];
+                }
+            }
+        }
+    }
+
+    // increment count (the header saves flags)
+    pos += buildHeader(pos);
+    temp_gpr1 = getUnusedGPR();
+    if (temp_gpr1 != REG_EAX) {
+        pos += buildFakeStackPushGPR64(pos, temp_gpr1);
+    }
+    if (shardControl) {
+        temp_gpr2 = getUnusedGPR();
+        pos += buildFakeStackPushGPR64(pos, temp_gpr2);
+        pos += buildShardedIncMem64(pos, shardControl,
+                (size_t)countSlot, temp_gpr1, temp_gpr2);
+        pos += buildFakeStackPopGPR64(pos, temp_gpr2);
+    } else {
+        // incq (%temp_gpr1) -- the counter may not be 32-bit addressable
+        pos += mainGen->buildMovImm64ToGPR64(pos,
+                (uint64_t)countAddr, temp_gpr1);
+        pos += mainGen->buildInstruction(pos, 0, true, false,
+                0xff, REG_NONE, temp_gpr1, true, 0);
+    }
+    if (temp_gpr1 != REG_EAX) {
+        pos += buildFakeStackPopGPR64(pos, temp_gpr1);
+    }
+    pos += buildFooter(pos);
+
+    // emit original instruction
+    opos = orig_code;
+    for (i=0; i < origNumBytes; i++) {
+        *pos++ = *opos++;
+    }
+    if (eip_operand) {
+        adjustDisplacement(eip_operand->getDisp(), pos);
+    }
+    free(orig_code);
+
+    finalize();
+
+    unsigned char *b;
+    for (b = (unsigned char*)getBlobCode(); b < pos; b++) {
+        buf.push_back(*b);
+    }
+    return true;
 }
 
 void FPAnalysisCInst::expandInstCount(size_t newSize)
 {
     size_t *newInstCount;
+    FPAnalysisCInstData *newInstData;
     size_t i = 0;
     newSize = (newSize > instCountSize*2) ? (newSize + 10) : (instCountSize*2 + 10);
     //printf("expand_inst_count - old size: %d    new size: %d\n", instCountSize, newSize);
     newInstCount = (size_t*)malloc(newSize * sizeof(size_t));
-    if (!newInstCount) {
+    newInstData = (FPAnalysisCInstData*)malloc(newSize * sizeof(FPAnalysisCInstData));
+    if (!newInstCount || !newInstData) {
         fprintf(stderr, "OUT OF MEMORY!\n");
         exit(-1);
     }
+    FPSnapshot::beginResize();
     if (instCount != NULL) {
         for (; i < instCountSize; i++) {
             newInstCount[i] = instCount[i];
+            newInstData[i] = instData[i];
         }
         free(instCount);
+        free(instData);
         instCount = NULL;
     }
     for (; i < newSize; i++) {
         newInstCount[i] = 0;
+        newInstData[i].count_addr = NULL;
+        newInstData[i].count_slot = -1;
+        newInstData[i].block_leader = -1;
     }
     instCount = newInstCount;
+    instData = newInstData;
     instCountSize = newSize;
     _INST_main_inst_count = instCount;
+    FPSnapshot::endResize();
 }
 
 size_t * FPAnalysisCInst::getCountArrayPtr()
@@ -122,18 +272,117 @@ size_t * FPAnalysisCInst::getCountArrayPtr()
     return instCount;
 }
 
+unsigned long FPAnalysisCInst::getCount(size_t idx)
+{
+    unsigned long cnt;
+    if (idx >= instCountSize) {
+        return 0;
+    }
+    if (instData[idx].block_leader >= 0) {
+        return getCount((size_t)instData[idx].block_leader);
+    }
+    cnt = instCount[idx];
+    if (instData[idx].count_slot >= 0) {
+        cnt += FPCounterShards::getInstance()->getCount((size_t)instData[idx].count_slot);
+    } else if (instData[idx].count_addr) {
+        cnt += *(unsigned long*)(instData[idx].count_addr);
+    }
+    return cnt;
+}
+
+size_t FPAnalysisCInst::snapshotCounters(FPSnapshotEntry *entries, size_t maxEntries)
+{
+    unsigned long cnt;
+    size_t i, n = 0;
+    for (i = 0; i < instCountSize && n < maxEntries; i++) {
+        cnt = getCount(i);
+        if (cnt > 0) {
+            entries[n].key = FP_SNAPSHOT_KEY(i, 0, SNAPSHOT_COUNT);
+            entries[n].value = cnt;
+            n++;
+        }
+    }
+    return n;
+}
+
+bool FPAnalysisCInst::isBlockCounting()
+{
+    return blockCounts;
+}
+
+void FPAnalysisCInst::setBlockLeader(FPSemantics *leader)
+{
+    blockLeader = leader;
+}
+
+bool FPAnalysisCInst::isCountedByBlock(FPSemantics *inst)
+{
+    return blockCounts && blockLeader != NULL && inst != blockLeader;
+}
+
+void FPAnalysisCInst::addToBlock(FPSemantics *inst)
+{
+    stringstream ss("");
+    string key, value;
+
+    assert(isCountedByBlock(inst));
+    ss << "inst" << dec << inst->getIndex() << "_cinst_block";
+    key = ss.str(); ss.str("");
+    ss << dec << blockLeader->getIndex();
+    value = ss.str(); ss.str("");
+    configuration->setValue(key, value);
+
+    insnsCountedByBlock++;
+}
+
 string FPAnalysisCInst::finalInstReport()
 {
     stringstream ss;
     ss << "CInst: " << insnsInstrumented << " instrumented";
+    if (blockCounts) {
+        ss << ", " << insnsCountedByBlock << " counted by block";
+    }
     return ss.str();
 }
 
+void FPAnalysisCInst::reserveInstructions(size_t numInsts)
+{
+    // size the count arrays once instead of growing them during registration
+    if (numInsts > instCountSize)
+        expandInstCount(numInsts);
+}
+
 void FPAnalysisCInst::registerInstruction(FPSemantics *inst)
 {
     long idx = inst->getIndex();
+    stringstream ss("");
+    string key;
     if ((size_t)idx >= instCountSize)
         expandInstCount(idx+1);
+
+    ss.clear(); ss.str(""); ss << "inst" << dec << idx << "_cinst_count_addr";
+    key = ss.str();
+    if (configuration->hasValue(key)) {
+        ss.clear(); ss.str(configuration->getValue(key));
+        ss >> instData[idx].count_addr;
+        if (instData[idx].count_addr) {
+            *(unsigned long*)(instData[idx].count_addr) = 0;
+        }
+    }
+
+    ss.clear(); ss.str(""); ss << "inst" << dec << idx << "_cinst_count_slot";
+    key = ss.str();
+    if (configuration->hasValue(key)) {
+        ss.clear(); ss.str(configuration->getValue(key));
+        ss >> instData[idx].count_slot;
+    }
+
+    ss.clear(); ss.str(""); ss << "inst" << dec << idx << "_cinst_block";
+    key = ss.str();
+    if (configuration->hasValue(key)) {
+        ss.clear(); ss.str(configuration->getValue(key));
+        ss >> instData[idx].block_leader;
+    }
 }
 
 void FPAnalysisCInst::handlePreInstruction(FPSemantics *inst)
@@ -168,8 +417,8 @@ void FPAnalysisCInst::finalOutput()
             ss2.str("");
             //ss << hex << inst->getAddress() << dec << "  ";
             ss << inst->getDisassembly();
-            ss2 << "instruction #" << i << ": count=" << instCount[i];
-            logFile->addMessage(ICOUNT, instCount[i], ss.str(), ss2.str(),
+            ss2 << "instruction #" << i << ": count=" << getCount(i);
+            logFile->addMessage(ICOUNT, getCount(i), ss.str(), ss2.str(),
                     "", inst);
         }
     }
@@ -1,4 +1,5 @@
 #include "FPAnalysisDCancel.h"
+#include "FPSnapshot.h"
 
 namespace FPInst {
 
@@ -24,9 +25,13 @@ FPAnalysisDCancel::FPAnalysisDCancel()
 {
     min_priority = 10;
     enable_sampling = true;
+    inlineChecks = true;
+    useShardedCounters = false;
+    handlerPtr = NULL;
     numCancelAddresses = 0;
     instCount = 0;
     instData = NULL;
+    pthread_mutex_init(&instDataLock, NULL);
     expandInstData(4096);
     insnsInstrumented = 0;
 }
@@ -54,6 +59,12 @@ void FPAnalysisDCancel::configure(FPConfig *config, FPDecoder *decoder,
         disableSampling();
         //status << "d_cancel: sampling disabled" << endl;
     }
+    if (config->getValue("dcancel_inline") == "no") {
+        inlineChecks = false;
+    }
+    if (config->getValue("use_sharded_counters") == "yes") {
+        useShardedCounters = true;
+    }
     configAddresses(config);
     if (isRestrictedByAddress()) {
         //status << "d_cancel: addresses=" << listAddresses();
@@ -112,7 +123,7 @@ string FPAnalysisDCancel::listAddresses() {
     return ss.str();
 }
 
-bool FPAnalysisDCancel::shouldPreInstrument(FPSemantics *inst)
+bool FPAnalysisDCancel::isCandidate(FPSemantics *inst)
 {
     bool addOrSub = false, handle = false;
     FPOperation *op;
@@ -157,14 +168,59 @@ bool FPAnalysisDCancel::shouldPreInstrument(FPSemantics *inst)
     return handle;
 }
 
+bool FPAnalysisDCancel::canCheckInline(FPSemantics *inst)
+{
+    FPOperation *op;
+    FPOperand *in1, *in2;
+    bool found = false;
+    size_t i, j;
+
+    if (!inlineChecks) {
+        return false;
+    }
+
+    // the blob only handles scalar or packed SSE additions and subtractions
+    for (i=0; i<inst->numOps; i++) {
+        op = (*inst)[i];
+        if (op->numOpSets == 0) {
+            continue;
+        }
+        if (op->type != OP_ADD && op->type != OP_SUB) {
+            return false;
+        }
+        for (j=0; j<op->numOpSets; j++) {
+            if (op->opSets[j].nIn != 2) {
+                return false;
+            }
+            in1 = op->opSets[j].in[0];
+            in2 = op->opSets[j].in[1];
+            if ((in1->getType() != IEEE_Single && in1->getType() != IEEE_Double) ||
+                 in1->getType() != in2->getType()) {
+                return false;
+            }
+            if (!(in1->isRegisterSSE() || in1->isMemory()) ||
+                !(in2->isRegisterSSE() || in2->isMemory())) {
+                return false;
+            }
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool FPAnalysisDCancel::shouldPreInstrument(FPSemantics *inst)
+{
+    return isCandidate(inst) && !canCheckInline(inst);
+}
+
 bool FPAnalysisDCancel::shouldPostInstrument(FPSemantics * /*inst*/)
 {
     return false;
 }
 
-bool FPAnalysisDCancel::shouldReplace(FPSemantics * /*inst*/)
+bool FPAnalysisDCancel::shouldReplace(FPSemantics *inst)
 {
-    return false;
+    return isCandidate(inst) && canCheckInline(inst);
 }
 
 Snippet::Ptr FPAnalysisDCancel::buildPreInstrumentation(FPSemantics * /*inst*/,
@@ -181,10 +237,249 @@ Snippet::Ptr FPAnalysisDCancel::buildPostInstrumentation(FPSemantics * /*inst*/,
     return Snippet::Ptr();
 }
 
-Snippet::Ptr FPAnalysisDCancel::buildReplacementCode(FPSemantics * /*inst*/,
-        BPatch_addressSpace * /*app*/, bool & /*needsRegisters*/)
+Snippet::Ptr FPAnalysisDCancel::buildReplacementCode(FPSemantics *inst,
+        BPatch_addressSpace *app, bool & /*needsRegisters*/)
 {
-    return Snippet::Ptr();
+    size_t idx = inst->getIndex();
+    if (idx >= instCount) {
+        expandInstData(idx+1);
+    }
+
+    stringstream ss("");
+    string key, value;
+
+    if (useShardedCounters) {
+        instData[idx].count_slot = (long)FPCounterShards::getInstance()->allocateSlot(configuration);
+
+        ss << "inst" << dec << idx << "_dcancel_count_slot";
+        key = ss.str(); ss.str("");
+        ss << dec << instData[idx].count_slot;
+        value = ss.str(); ss.str("");
+        configuration->setValue(key, value);
+    } else {
+        instData[idx].count_addr = app->malloc(sizeof(unsigned long))->getBaseAddr();
+
+        ss << "inst" << dec << idx << "_dcancel_count_addr";
+        key = ss.str(); ss.str("");
+        ss << hex << instData[idx].count_addr;
+        value = ss.str(); ss.str("");
+        configuration->setValue(key, value);
+    }
+
+    insnsInstrumented++;
+
+    // the runtime publishes _INST_handle_inline_dcancel here
+    if (handlerPtr == NULL) {
+        handlerPtr = allocateHandlerSlot(app, "dcancel_handler_addr");
+    }
+
+    FPBinaryBlobDCancel *blob = new FPBinaryBlobDCancel(inst, instData[idx],
+            handlerPtr, min_priority);
+    if (useShardedCounters) {
+        blob->enableShardedCounters(
+                FPCounterShards::getInstance()->getControlAddress(app, configuration));
+    }
+    return Snippet::Ptr(blob);
+}
+
+FPBinaryBlobDCancel::FPBinaryBlobDCancel(FPSemantics *inst,
+        FPAnalysisDCancelInstData instData, void *handlerPtr, long minPriority)
+    : FPBinaryBlob(inst, MAX_BLOB_SIZE)
+{
+    this->instData = instData;
+    this->handlerPtr = handlerPtr;
+    this->minPriority = minPriority;
+    this->shardControl = NULL;
+}
+
+void FPBinaryBlobDCancel::enableShardedCounters(void *ctl_addr)
+{
+    shardControl = ctl_addr;
+}
+
+bool FPBinaryBlobDCancel::generate(Point * /*pt*/, Buffer &buf)
+{
+    size_t origNumBytes = inst->getNumBytes();
+    unsigned char *orig_code, *pos, *opos;
+    FPRegister temp_gpr1, temp_gpr2, temp_gpr3;
+    FPRegister temp_xmm1, temp_xmm2, temp_xmm3;
+
+    initialize();
+
+    // allocate space for blob code
+    orig_code = (unsigned char*)malloc(origNumBytes);
+    inst->getBytes(orig_code);
+
+    setBlobAddress((void*)buf.curAddr());
+    pos = getBlobCode();
+
+    // set up some class-wide variables
+    temp_gpr1 = getUnusedGPR();
+    temp_gpr2 = getUnusedGPR();
+    temp_gpr3 = getUnusedGPR();
+    temp_xmm1 = getUnusedSSE();
+    temp_xmm2 = getUnusedSSE();
+    temp_xmm3 = getUnusedSSE();
+
+    FPOperation *op;
+    FPOperand *in1, *in2;
+    FPOperand *eip_operand = NULL;
+    size_t i, j, k;
+    unsigned char *skip_jmp_pos[3], *hit_jmp_pos[2], *max_jmp_pos;
+    int32_t *skip_offset_pos[3], *hit_offset_pos[2], *max_offset_pos;
+    unsigned char prefix, opcode;
+    uint8_t sign_shift, exp_shift;
+    uint64_t args[3];
+    FPRegister xmm_args[2];
+
+    // check for an IP-relative operand
+    for (i=0; i<inst->numOps; i++) {
+        op = (*inst)[i];
+        for (j=0; j<op->numOpSets; j++) {
+            for (k=0; k<op->opSets[j].nIn; k++) {
+                if (op->opSets[j].in[k]->getBase() == REG_EIP) {
+                    eip_operand = op->opSets[j].in[k];
+                }
+            }
+        }
+    }
+
+    xmm_args[0] = temp_xmm1;
+    xmm_args[1] = temp_xmm2;
+
+    pos += buildHeader(pos);
+    if (temp_gpr1 != REG_EAX) {
+        pos += buildFakeStackPushGPR64(pos, temp_gpr1);
+    }
+    pos += buildFakeStackPushGPR64(pos, temp_gpr2);
+    pos += buildFakeStackPushGPR64(pos, temp_gpr3);
+    pos += buildFakeStackPushXMM(pos, temp_xmm1);
+    pos += buildFakeStackPushXMM(pos, temp_xmm2);
+    pos += buildFakeStackPushXMM(pos, temp_xmm3);
+
+    // for each operation
+    for (i=0; i<inst->numOps; i++) {
+        op = (*inst)[i];
+
+        // for each operand set (packed lanes)
+        for (j=0; j<op->numOpSets; j++) {
+            in1 = op->opSets[j].in[0];
+            in2 = op->opSets[j].in[1];
+
+            // the biased exponent is extracted by shifting out the sign bit
+            // (and for single precision, any stale upper bits) and then
+            // shifting the exponent field down to the bottom
+            if (in1->getType() == IEEE_Single) {
+                prefix = 0xf3;
+                sign_shift = 33;
+                exp_shift = 56;
+            } else {
+                prefix = 0xf2;
+                sign_shift = 1;
+                exp_shift = 53;
+            }
+            opcode = (op->type == OP_ADD ? 0x58 : 0x5c);
+
+            // load operand values and compute the result in temp_xmm3
+            pos += buildLaneLoadXMM(pos, in1, temp_xmm1);
+            pos += buildLaneLoadXMM(pos, in2, temp_xmm2);
+            pos += mainGen->buildInstruction(pos, 0, false, true,
+                    0x28, temp_xmm3, temp_xmm1, false, 0);
+            pos += mainGen->buildInstruction(pos, prefix, false, true,
+                    opcode, temp_xmm3, temp_xmm2, false, 0);
+            pos += mainGen->buildMovXmmToGPR64(pos, temp_xmm1, temp_gpr1);
+            pos += mainGen->buildMovXmmToGPR64(pos, temp_xmm2, temp_gpr2);
+            pos += mainGen->buildMovXmmToGPR64(pos, temp_xmm3, temp_gpr3);
+
+            // ignore operations with a zero operand
+            pos += mainGen->buildShiftLeftGPR64(pos, temp_gpr1, sign_shift);
+            pos += mainGen->buildJumpEqualNear32(pos, 0, skip_offset_pos[0]);
+            skip_jmp_pos[0] = pos;
+            pos += mainGen->buildShiftLeftGPR64(pos, temp_gpr2, sign_shift);
+            pos += mainGen->buildJumpEqualNear32(pos, 0, skip_offset_pos[1]);
+            skip_jmp_pos[1] = pos;
+            pos += mainGen->buildShiftRightGPR64(pos, temp_gpr1, exp_shift);
+            pos += mainGen->buildShiftRightGPR64(pos, temp_gpr2, exp_shift);
+
+            // larger operand exponent goes in temp_gpr1
+            pos += mainGen->buildCmpGPR64WithGPR64(pos, temp_gpr1, temp_gpr2);
+            pos += mainGen->buildJumpGreaterEqualNear32(pos, 0, max_offset_pos);
+            max_jmp_pos = pos;
+            pos += mainGen->buildMovGPR64ToGPR64(pos, temp_gpr2, temp_gpr1);
+            *max_offset_pos = (int32_t)(pos-max_jmp_pos);
+
+            // zero (catastrophic cancellation) or denormal result: let the
+            // handler sort it out
+            pos += mainGen->buildShiftLeftGPR64(pos, temp_gpr3, sign_shift);
+            pos += mainGen->buildJumpEqualNear32(pos, 0, hit_offset_pos[0]);
+            hit_jmp_pos[0] = pos;
+            pos += mainGen->buildShiftRightGPR64(pos, temp_gpr3, exp_shift);
+            pos += mainGen->buildJumpEqualNear32(pos, 0, hit_offset_pos[1]);
+            hit_jmp_pos[1] = pos;
+
+            // cancelled bits = max(exp1,exp2) - exp(result) (may be negative)
+            pos += mainGen->buildSubGPR64FromGPR64(pos, temp_gpr3, temp_gpr1);
+            pos += mainGen->buildMovImm64ToGPR64(pos, (uint64_t)minPriority, temp_gpr2);
+            pos += mainGen->buildCmpGPR64WithGPR64(pos, temp_gpr1, temp_gpr2);
+            pos += mainGen->buildJumpSignedLessEqualNear32(pos, 0, skip_offset_pos[2]);
+            skip_jmp_pos[2] = pos;
+
+            // call out to the full check
+            *hit_offset_pos[0] = (int32_t)(pos-hit_jmp_pos[0]);
+            *hit_offset_pos[1] = (int32_t)(pos-hit_jmp_pos[1]);
+            // handler(iidx, opIdx, setIdx, bits1, bits2)
+            args[0] = (uint64_t)inst->getIndex();
+            args[1] = (uint64_t)i;
+            args[2] = (uint64_t)j;
+            pos += buildHandlerCall(pos, handlerPtr, temp_gpr1,
+                    args, 3, xmm_args, 2);
+
+            for (k=0; k<3; k++) {
+                *skip_offset_pos[k] = (int32_t)(pos-skip_jmp_pos[k]);
+            }
+        }
+    }
+
+    // increment count
+    if (shardControl) {
+        pos += buildShardedIncMem64(pos, shardControl,
+                (size_t)instData.count_slot, temp_gpr1, temp_gpr2);
+    } else {
+        // incq (%temp_gpr1) -- the counter may not be 32-bit addressable
+        pos += mainGen->buildMovImm64ToGPR64(pos,
+                (uint64_t)instData.count_addr, temp_gpr1);
+        pos += mainGen->buildInstruction(pos, 0, true, false,
+                0xff, REG_NONE, temp_gpr1, true, 0);
+    }
+
+    pos += buildFakeStackPopXMM(pos, temp_xmm3);
+    pos += buildFakeStackPopXMM(pos, temp_xmm2);
+    pos += buildFakeStackPopXMM(pos, temp_xmm1);
+    pos += buildFakeStackPopGPR64(pos, temp_gpr3);
+    pos += buildFakeStackPopGPR64(pos, temp_gpr2);
+    if (temp_gpr1 != REG_EAX) {
+        pos += buildFakeStackPopGPR64(pos, temp_gpr1);
+    }
+    pos += buildFooter(pos);
+
+    // emit original instruction
+    opos = orig_code;
+    for (i=0; i < origNumBytes; i++) {
+        *pos++ = *opos++;
+    }
+    if (eip_operand) {
+        adjustDisplacement(eip_operand->getDisp(), pos);
+    }
+    free(orig_code);
+
+    finalize();
+    assert((size_t)(pos-getBlobCode()) <= MAX_BLOB_SIZE);
+
+    unsigned char *b;
+    for (b = (unsigned char*)getBlobCode(); b < pos; b++) {
+        buf.push_back(*b);
+    }
+    return true;
 }
 
 string FPAnalysisDCancel::finalInstReport()
@@ -194,8 +489,52 @@ string FPAnalysisDCancel::finalInstReport()
     return ss.str();
 }
 
-void FPAnalysisDCancel::registerInstruction(FPSemantics * /*inst*/)
-{ }
+void FPAnalysisDCancel::reserveInstructions(size_t numInsts)
+{
+    // size the table once up front; every instrumented instruction is
+    // registered before any handler runs, so handlers never need to grow it
+    if (numInsts > instCount) {
+        expandInstData(numInsts);
+    }
+}
+
+void FPAnalysisDCancel::registerInstruction(FPSemantics *inst)
+{
+    size_t idx = inst->getIndex();
+    stringstream ss("");
+    string key;
+    if (idx >= instCount) {
+        expandInstData(idx+1);
+    }
+
+    // inline checks count executions in the mutatee
+    ss.clear(); ss.str(""); ss << "inst" << dec << idx << "_dcancel_count_addr";
+    key = ss.str();
+    if (configuration->hasValue(key)) {
+        ss.clear(); ss.str(configuration->getValue(key));
+        ss >> instData[idx].count_addr;
+        if (instData[idx].count_addr) {
+            *(unsigned long*)(instData[idx].count_addr) = 0;
+        }
+    }
+
+    ss.clear(); ss.str(""); ss << "inst" << dec << idx << "_dcancel_count_slot";
+    key = ss.str();
+    if (configuration->hasValue(key)) {
+        ss.clear(); ss.str(configuration->getValue(key));
+        ss >> instData[idx].count_slot;
+    }
+
+    if (instData[idx].count_addr || instData[idx].count_slot >= 0) {
+        instData[idx].inst = inst;
+    }
+}
+
+bool FPAnalysisDCancel::supportsLazyRegistration()
+{
+    // inline checks need their counters set up before they run
+    return !configuration->hasValue("dcancel_handler_addr");
+}
 
 void FPAnalysisDCancel::handlePreInstruction(FPSemantics *inst)
 {
@@ -235,20 +574,48 @@ void FPAnalysisDCancel::handlePostInstruction(FPSemantics * /*inst*/)
 void FPAnalysisDCancel::handleReplacement(FPSemantics * /*inst*/)
 { }
 
+void FPAnalysisDCancel::handleInlineCancellation(FPSemantics *inst,
+        size_t opIdx, size_t setIdx, unsigned long bits1, unsigned long bits2)
+{
+    FPOperation *op = (*inst)[opIdx];
+    assert(setIdx < op->numOpSets);
+
+    // the blob has already counted this execution
+    if (op->opSets[setIdx].in[0]->getType() == IEEE_Single) {
+        uint32_t b1 = (uint32_t)bits1, b2 = (uint32_t)bits2;
+        float val1, val2;
+        memcpy(&val1, &b1, sizeof(float));
+        memcpy(&val2, &b2, sizeof(float));
+        FPOperand op1(val1), op2(val2);
+        checkOperands(inst, op->type, &op1, &op2);
+    } else {
+        double val1, val2;
+        memcpy(&val1, &bits1, sizeof(double));
+        memcpy(&val2, &bits2, sizeof(double));
+        FPOperand op1(val1), op2(val2);
+        checkOperands(inst, op->type, &op1, &op2);
+    }
+}
+
 void FPAnalysisDCancel::checkForCancellation(FPSemantics *inst, FPOperationType opt, FPOperand *op1, FPOperand *op2)
+{
+    // increment instruction count
+    incrementCount(inst);
+
+    checkOperands(inst, opt, op1, op2);
+}
+
+void FPAnalysisDCancel::checkOperands(FPSemantics *inst, FPOperationType opt, FPOperand *op1, FPOperand *op2)
 {
     static char label_buffer[1024];
     static char details_buffer[1024];
-    static string trace;
+    long trace;
 
     long double num1, num2, numr;
     long exp1, exp2, expr, priority;
     long idx, cancels;
     FPOperandValue result;
 
-    // increment instruction count
-    incrementCount(inst);
-
     // old checks to make sure instruction is a candidate for cancellation
     // (removed for efficiency--all this is now checked in the instrumenter)
     /*
@@ -321,9 +688,9 @@ void FPAnalysisDCancel::checkForCancellation(FPSemantics *inst, FPOperationType
             sprintf(label_buffer, "%Lg %c %Lg = %Lg", num1, (opt == OP_ADD ? '+' : '-'), num2, numr);
             sprintf(details_buffer, "  %.25Lg\n%c %.25Lg\n= %.25Lg", num1, (opt == OP_ADD ? '+' : '-'), num2, numr);
             if (logFile->isStackWalkingEnabled()) {
-                trace = logFile->getStackTrace();
+                trace = logFile->getStackTraceId(inst);
             } else {
-                trace = "";
+                trace = 0;
             }
             logFile->addMessage(CANCELLATION, 999, string(label_buffer), string(details_buffer), trace, inst);
         }
@@ -348,9 +715,9 @@ void FPAnalysisDCancel::checkForCancellation(FPSemantics *inst, FPOperationType
             sprintf(details_buffer, "  %.25Lg [exp=%ld]\n%c %.25Lg [exp=%ld]\n= %.25Lg [exp=%ld]", 
                     num1, exp1, (opt == OP_ADD ? '+' : '-'), num2, exp2, numr, expr);
             if (logFile->isStackWalkingEnabled()) {
-                trace = logFile->getStackTrace();
+                trace = logFile->getStackTraceId(inst);
             } else {
-                trace = "";
+                trace = 0;
             }
             logFile->addMessage(CANCELLATION, priority, string(label_buffer), string(details_buffer), trace, inst);
         }
@@ -369,6 +736,12 @@ void FPAnalysisDCancel::expandInstData(size_t newSize)
 {
     FPAnalysisDCancelInstData *newInstData;
     size_t i = 0;
+    pthread_mutex_lock(&instDataLock);
+    if (newSize <= instCount) {
+        // another thread got here first
+        pthread_mutex_unlock(&instDataLock);
+        return;
+    }
     newSize = newSize > instCount*2 ? newSize : instCount*2;
     //printf("expand_inst_data - old size: %d    new size: %d\n", instCount, newSize);
     newInstData = (FPAnalysisDCancelInstData*)malloc(newSize * sizeof(FPAnalysisDCancelInstData));
@@ -376,12 +749,15 @@ void FPAnalysisDCancel::expandInstData(size_t newSize)
         fprintf(stderr, "OUT OF MEMORY!\n");
         exit(-1);
     }
+    FPSnapshot::beginResize();
     if (instData != NULL) {
         for (; i < instCount; i++) {
             newInstData[i].inst = instData[i].inst;
             newInstData[i].count = instData[i].count;
             newInstData[i].total_cancels = instData[i].total_cancels;
             newInstData[i].total_digits = instData[i].total_digits;
+            newInstData[i].count_addr = instData[i].count_addr;
+            newInstData[i].count_slot = instData[i].count_slot;
         }
         free(instData);
         instData = NULL;
@@ -391,9 +767,14 @@ void FPAnalysisDCancel::expandInstData(size_t newSize)
         newInstData[i].count = 0;
         newInstData[i].total_cancels = 0;
         newInstData[i].total_digits = 0;
+        newInstData[i].count_addr = NULL;
+        newInstData[i].count_slot = -1;
     }
     instData = newInstData;
+    __sync_synchronize();
     instCount = newSize;
+    FPSnapshot::endResize();
+    pthread_mutex_unlock(&instDataLock);
 }
 
 unsigned inline FPAnalysisDCancel::incrementCount(FPSemantics *inst)
@@ -407,7 +788,7 @@ unsigned inline FPAnalysisDCancel::incrementCount(FPSemantics *inst)
     } else {
         assert(instData[idx].inst == inst);
     }
-    instData[idx].count++;
+    __sync_fetch_and_add(&instData[idx].count, 1);
     return idx;
 }
 
@@ -426,11 +807,46 @@ unsigned inline FPAnalysisDCancel::addCancellation(FPSemantics *inst, long digit
      *    assert(instData[idx].inst == inst);
      *}
      */
-    instData[idx].total_cancels += 1;
-    instData[idx].total_digits += (unsigned)digits;
+    __sync_fetch_and_add(&instData[idx].total_cancels, 1);
+    __sync_fetch_and_add(&instData[idx].total_digits, (unsigned long)digits);
     return idx;
 }
 
+unsigned long FPAnalysisDCancel::getCount(size_t idx)
+{
+    unsigned long cnt = instData[idx].count;
+    if (instData[idx].count_slot >= 0) {
+        cnt += FPCounterShards::getInstance()->getCount(
+                (size_t)instData[idx].count_slot);
+    } else if (instData[idx].count_addr) {
+        cnt += *(unsigned long*)(instData[idx].count_addr);
+    }
+    return cnt;
+}
+
+size_t FPAnalysisDCancel::snapshotCounters(FPSnapshotEntry *entries, size_t maxEntries)
+{
+    unsigned long cnt;
+    size_t i, n = 0;
+    for (i = 0; i < instCount && n < maxEntries; i++) {
+        if (instData[i].inst == NULL) {
+            continue;
+        }
+        cnt = getCount(i);
+        if (cnt > 0) {
+            entries[n].key = FP_SNAPSHOT_KEY(i, 0, SNAPSHOT_COUNT);
+            entries[n].value = cnt;
+            n++;
+        }
+        if (instData[i].total_cancels > 0 && n < maxEntries) {
+            entries[n].key = FP_SNAPSHOT_KEY(i, 0, SNAPSHOT_CANCELS);
+            entries[n].value = instData[i].total_cancels;
+            n++;
+        }
+    }
+    return n;
+}
+
 void FPAnalysisDCancel::finalOutput()
 {
     stringstream ss;
@@ -449,7 +865,7 @@ void FPAnalysisDCancel::finalOutput()
 
             ss.clear(); ss.str("");
             ss << instData[i].inst->getDisassembly();
-            cnt = instData[i].count;
+            cnt = getCount(i);
             logFile->addMessage(ICOUNT, (long)cnt, instData[i].inst->getDisassembly(),
                     ss.str(), "", instData[i].inst);
 
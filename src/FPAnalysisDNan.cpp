@@ -24,6 +24,8 @@ FPAnalysisDNan::FPAnalysisDNan()
 {
     numRangeAddresses = 0;
     insnsInstrumented = 0;
+    inlineChecks = true;
+    handlerPtr = NULL;
 }
 
 string FPAnalysisDNan::getTag()
@@ -40,6 +42,9 @@ void FPAnalysisDNan::configure(FPConfig *config, FPDecoder *decoder,
         FPLog *log, FPContext *context)
 {
     FPAnalysis::configure(config, decoder, log, context);
+    if (config->getValue("dnan_inline") == "no") {
+        inlineChecks = false;
+    }
     configAddresses(config);
     if (isRestrictedByAddress()) {
         //status << "d_nan: addresses=" << listAddresses();
@@ -73,7 +78,7 @@ string FPAnalysisDNan::listAddresses() {
     return ss.str();
 }
 
-bool FPAnalysisDNan::shouldPreInstrument(FPSemantics *inst)
+bool FPAnalysisDNan::isCandidate(FPSemantics *inst)
 {
     bool isOperation = false, handle = false;
     FPOperation *op;
@@ -121,14 +126,50 @@ bool FPAnalysisDNan::shouldPreInstrument(FPSemantics *inst)
     return handle;
 }
 
+bool FPAnalysisDNan::canCheckInline(FPSemantics *inst)
+{
+    FPOperation *op;
+    FPOperand *input;
+    bool found = false;
+    size_t i, j, k;
+
+    if (!inlineChecks) {
+        return false;
+    }
+
+    // the blob only handles single- and double-precision SSE inputs
+    for (i=0; i<inst->numOps; i++) {
+        op = (*inst)[i];
+        for (j=0; j<op->numOpSets; j++) {
+            for (k=0; k<op->opSets[j].nIn; k++) {
+                input = op->opSets[j].in[k];
+                if (input->getType() != IEEE_Single &&
+                    input->getType() != IEEE_Double) {
+                    return false;
+                }
+                if (!input->isRegisterSSE() && !input->isMemory()) {
+                    return false;
+                }
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+bool FPAnalysisDNan::shouldPreInstrument(FPSemantics *inst)
+{
+    return isCandidate(inst) && !canCheckInline(inst);
+}
+
 bool FPAnalysisDNan::shouldPostInstrument(FPSemantics * /*inst*/)
 {
     return false;
 }
 
-bool FPAnalysisDNan::shouldReplace(FPSemantics * /*inst*/)
+bool FPAnalysisDNan::shouldReplace(FPSemantics *inst)
 {
-    return false;
+    return isCandidate(inst) && canCheckInline(inst);
 }
 
 Snippet::Ptr FPAnalysisDNan::buildPreInstrumentation(FPSemantics * /*inst*/,
@@ -145,10 +186,127 @@ Snippet::Ptr FPAnalysisDNan::buildPostInstrumentation(FPSemantics * /*inst*/,
     return Snippet::Ptr();
 }
 
-Snippet::Ptr FPAnalysisDNan::buildReplacementCode(FPSemantics * /*inst*/,
-        BPatch_addressSpace * /*app*/, bool & /*needsRegisters*/)
+Snippet::Ptr FPAnalysisDNan::buildReplacementCode(FPSemantics *inst,
+        BPatch_addressSpace *app, bool & /*needsRegisters*/)
 {
-    return Snippet::Ptr();
+    // the runtime publishes _INST_handle_inline_dnan here
+    if (handlerPtr == NULL) {
+        handlerPtr = allocateHandlerSlot(app, "dnan_handler_addr");
+    }
+
+    insnsInstrumented++;
+    return Snippet::Ptr(new FPBinaryBlobDNan(inst, handlerPtr));
+}
+
+FPBinaryBlobDNan::FPBinaryBlobDNan(FPSemantics *inst, void *handlerPtr)
+    : FPBinaryBlob(inst, MAX_BLOB_SIZE)
+{
+    this->handlerPtr = handlerPtr;
+}
+
+bool FPBinaryBlobDNan::generate(Point * /*pt*/, Buffer &buf)
+{
+    size_t origNumBytes = inst->getNumBytes();
+    unsigned char *orig_code, *pos, *opos;
+    FPRegister temp_gpr1, temp_gpr2, temp_xmm;
+
+    initialize();
+
+    // allocate space for blob code
+    orig_code = (unsigned char*)malloc(origNumBytes);
+    inst->getBytes(orig_code);
+
+    setBlobAddress((void*)buf.curAddr());
+    pos = getBlobCode();
+
+    // set up some class-wide variables
+    temp_gpr1 = getUnusedGPR();
+    temp_gpr2 = getUnusedGPR();
+    temp_xmm = getUnusedSSE();
+
+    FPOperation *op;
+    FPOperand *input;
+    FPOperand *eip_operand = NULL;
+    size_t i, j, k;
+    unsigned char *skip_jmp_pos;
+    int32_t *skip_offset_pos;
+    uint8_t sign_shift;
+    uint64_t nan_min, args[4];
+
+    pos += buildHeader(pos);
+    if (temp_gpr1 != REG_EAX) {
+        pos += buildFakeStackPushGPR64(pos, temp_gpr1);
+    }
+    pos += buildFakeStackPushGPR64(pos, temp_gpr2);
+    pos += buildFakeStackPushXMM(pos, temp_xmm);
+
+    // for each operation, operand set (packed lanes), and input
+    for (i=0; i<inst->numOps; i++) {
+        op = (*inst)[i];
+        for (j=0; j<op->numOpSets; j++) {
+            for (k=0; k<op->opSets[j].nIn; k++) {
+                input = op->opSets[j].in[k];
+                if (input->getBase() == REG_EIP) {
+                    eip_operand = input;
+                }
+
+                // with the sign bit (and for single precision, any stale
+                // upper bits) shifted out, a NaN is anything greater than
+                // an all-ones exponent with a zero significand
+                if (input->getType() == IEEE_Single) {
+                    sign_shift = 33;
+                    nan_min = 0xff00000000000000UL;
+                } else {
+                    sign_shift = 1;
+                    nan_min = 0xffe0000000000000UL;
+                }
+
+                pos += buildLaneLoadXMM(pos, input, temp_xmm);
+                pos += mainGen->buildMovXmmToGPR64(pos, temp_xmm, temp_gpr1);
+                pos += mainGen->buildShiftLeftGPR64(pos, temp_gpr1, sign_shift);
+                pos += mainGen->buildMovImm64ToGPR64(pos, nan_min, temp_gpr2);
+                pos += mainGen->buildCmpGPR64WithGPR64(pos, temp_gpr1, temp_gpr2);
+                pos += mainGen->buildJumpLessEqualNear32(pos, 0, skip_offset_pos);
+                skip_jmp_pos = pos;
+
+                // handler(iidx, opIdx, setIdx, inIdx, bits)
+                args[0] = (uint64_t)inst->getIndex();
+                args[1] = (uint64_t)i;
+                args[2] = (uint64_t)j;
+                args[3] = (uint64_t)k;
+                pos += buildHandlerCall(pos, handlerPtr, temp_gpr1,
+                        args, 4, &temp_xmm, 1);
+
+                *skip_offset_pos = (int32_t)(pos-skip_jmp_pos);
+            }
+        }
+    }
+
+    pos += buildFakeStackPopXMM(pos, temp_xmm);
+    pos += buildFakeStackPopGPR64(pos, temp_gpr2);
+    if (temp_gpr1 != REG_EAX) {
+        pos += buildFakeStackPopGPR64(pos, temp_gpr1);
+    }
+    pos += buildFooter(pos);
+
+    // emit original instruction
+    opos = orig_code;
+    for (i=0; i < origNumBytes; i++) {
+        *pos++ = *opos++;
+    }
+    if (eip_operand) {
+        adjustDisplacement(eip_operand->getDisp(), pos);
+    }
+    free(orig_code);
+
+    finalize();
+    assert((size_t)(pos-getBlobCode()) <= MAX_BLOB_SIZE);
+
+    unsigned char *b;
+    for (b = (unsigned char*)getBlobCode(); b < pos; b++) {
+        buf.push_back(*b);
+    }
+    return true;
 }
 
 string FPAnalysisDNan::finalInstReport()
@@ -161,6 +319,11 @@ string FPAnalysisDNan::finalInstReport()
 void FPAnalysisDNan::registerInstruction(FPSemantics * /*inst*/)
 { }
 
+bool FPAnalysisDNan::supportsLazyRegistration()
+{
+    return true;
+}
+
 void FPAnalysisDNan::handlePreInstruction(FPSemantics *inst)
 {
     FPOperation *op;
@@ -189,6 +352,30 @@ void FPAnalysisDNan::handlePreInstruction(FPSemantics *inst)
     }
 }
 
+void FPAnalysisDNan::handleInlineNaN(FPSemantics *inst, size_t opIdx,
+        size_t setIdx, size_t inIdx, unsigned long bits)
+{
+    FPOperation *op = (*inst)[opIdx];
+    assert(setIdx < op->numOpSets && inIdx < op->opSets[setIdx].nIn);
+    FPOperand *input = op->opSets[setIdx].in[inIdx];
+
+    stringstream ss;
+    ss.clear(); ss.str("");
+    ss << "NaN detected: " << input->toString();
+    if (input->getType() == IEEE_Single) {
+        uint32_t b = (uint32_t)bits;
+        float val;
+        memcpy(&val, &b, sizeof(float));
+        ss << "  float=" << val;
+    } else {
+        double val;
+        memcpy(&val, &bits, sizeof(double));
+        ss << "  double=" << val;
+    }
+    string lbl = ss.str();
+    logFile->addMessage(WARNING, 999, lbl, lbl, "", inst);
+}
+
 void FPAnalysisDNan::handlePostInstruction(FPSemantics * /*inst*/)
 { }
 
@@ -97,6 +97,11 @@ string FPAnalysisExample::finalInstReport()
 void FPAnalysisExample::registerInstruction(FPSemantics * /*inst*/)
 { }
 
+bool FPAnalysisExample::supportsLazyRegistration()
+{
+    return true;
+}
+
 void FPAnalysisExample::handlePreInstruction(FPSemantics *inst)
 {
     insnsExecuted++;
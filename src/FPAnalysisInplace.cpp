@@ -69,6 +69,8 @@ FPAnalysisInplace* FPAnalysisInplace::getInstance()
 FPAnalysisInplace::FPAnalysisInplace()
 {
     useLockPrefix = false;
+    useShardedCounters = false;
+    useRuntimeTags = false;
     instCountSize = 0;
     instCountSingle = NULL;
     instCountDouble = NULL;
@@ -91,8 +93,11 @@ void FPAnalysisInplace::configure(FPConfig *config, FPDecoder *decoder,
         FPLog *log, FPContext *context)
 {
     FPAnalysis::configure(config, decoder, log, context);
+    if (config->getValue("runtime_tags") == "yes") {
+        useRuntimeTags = true;
+    }
     if (config->hasReplaceTagTree()) {
-        mainPolicy = new FPSVConfigPolicy(config);
+        mainPolicy = new FPSVConfigPolicy(config, useRuntimeTags);
     } else if (config->hasValue("sv_inp_type")) {
         string type = config->getValue("sv_inp_type");
         if (type == "single") {
@@ -123,6 +128,9 @@ void FPAnalysisInplace::configure(FPConfig *config, FPDecoder *decoder,
     if (config->getValue("use_lock_prefix") == "yes") {
         enableLockPrefix();
     }
+    if (config->getValue("use_sharded_counters") == "yes") {
+        useShardedCounters = true;
+    }
     if (config->hasValue("svinp_icount_ptr_sgl")) {
         const char *ptr = config->getValueC("svinp_icount_ptr_sgl");
         _INST_svinp_inst_count_ptr_sgl = (size_t**)strtoul(ptr, NULL, 16);
@@ -226,6 +234,31 @@ void FPAnalysisInplace::registerInstruction(FPSemantics *inst)
     if (inst->getIndex() >= instCountSize) {
         expandInstCount(inst->getIndex());
     }
+
+    // run-time tag slot for a binary blob (see buildReplacementCode)
+    stringstream ss;    ss.clear();     ss.str("");
+    ss << "svinp_" << inst->getIndex() << "_tag_addr";
+    if (configuration->hasValue(ss.str())) {
+        const char *ptr = configuration->getValueC(ss.str());
+        uint64_t *slot = (uint64_t*)strtoul(ptr, NULL, 16);
+        runtimeTagSlots.push_back(make_pair(inst, slot));
+        writeRuntimeTag(inst, slot);
+    }
+}
+
+void FPAnalysisInplace::reloadConfiguration(FPConfig * /*runConfig*/)
+{
+    // the main configuration already has this run's replacement tags
+    vector<pair<FPSemantics*, uint64_t*> >::iterator i;
+    for (i = runtimeTagSlots.begin(); i != runtimeTagSlots.end(); i++) {
+        writeRuntimeTag(i->first, i->second);
+    }
+}
+
+void FPAnalysisInplace::writeRuntimeTag(FPSemantics *inst, uint64_t *slot)
+{
+    // the blob runs the single-precision version if the slot is nonzero
+    *slot = (mainPolicy->getSVType(inst) == SVT_IEEE_Single ? 1 : 0);
 }
 
 void FPAnalysisInplace::handlePreInstruction(FPSemantics * /*inst*/)
@@ -355,11 +388,16 @@ void FPAnalysisInplace::handleReplacement(FPSemantics *inst)
 #endif
 }
 
-FPBinaryBlobInplace::FPBinaryBlobInplace(FPSemantics *inst, FPSVPolicy *policy)
-    : FPBinaryBlob(inst)
+FPBinaryBlobInplace::FPBinaryBlobInplace(FPSemantics *inst, FPSVPolicy *policy,
+        void *tagAddr)
+    // blobs with a run-time tag hold both versions of the operation
+    : FPBinaryBlob(inst, (tagAddr ? 2048 : 1024))
 {
     this->mainPolicy = policy;
     this->useLockPrefix = false;
+    this->shardControl = NULL;
+    this->shardSlot = 0;
+    this->tagAddr = tagAddr;
 }
 
 void FPBinaryBlobInplace::enableLockPrefix()
@@ -372,6 +410,12 @@ void FPBinaryBlobInplace::disableLockPrefix()
     useLockPrefix = false;
 }
 
+void FPBinaryBlobInplace::enableShardedCounters(void *ctl_addr, size_t slot)
+{
+    shardControl = ctl_addr;
+    shardSlot = slot;
+}
+
 void FPAnalysisInplace::enableLockPrefix()
 {
     useLockPrefix = true;
@@ -1173,7 +1217,12 @@ size_t FPBinaryBlobInplace::buildReplacedOperation(unsigned char *pos,
     if (useLockPrefix) {
         prefix = 0xf0;  // add LOCK prefix if requested
     }
-    if (count_ptr != NULL) {
+    if (shardControl != NULL && (replacementType == SVT_IEEE_Single ||
+                                 replacementType == SVT_IEEE_Double)) {
+        // increment this thread's copy of the counter
+        pos += buildShardedIncMem64(pos, shardControl, shardSlot,
+                temp_gpr1, temp_gpr2);
+    } else if (count_ptr != NULL) {
         // grab the array pointer
         pos += mainGen->buildMovImm64ToGPR64(pos, 
                 (uint64_t)count_ptr, temp_gpr1);
@@ -1384,8 +1433,53 @@ bool FPBinaryBlobInplace::generate(Point * /*pt*/, Buffer &buf)
         
         pos += buildHeader(pos);
 
+        if (tagAddr != NULL) {
+
+            // precision is chosen at run time: test the tag slot and run
+            // either the double- or the single-precision version (the
+            // special/replaced flags only depend on the instruction, so both
+            // versions leave them the same)
+            bool dbl_special = special, dbl_replaced = replaced;
+            unsigned char *sgl_jmp_pos = 0, *done_jmp_pos = 0;
+            int32_t *sgl_offset_pos = 0, *done_offset_pos = 0;
+
+            // mov $tagAddr, %temp_gpr1; mov (%temp_gpr1), %temp_gpr1
+            // test %temp_gpr1, %temp_gpr1
+            // (the fake stack moves don't touch the flags)
+            if (temp_gpr1 != REG_EAX) {
+                pos += buildFakeStackPushGPR64(pos, temp_gpr1);
+            }
+            pos += mainGen->buildMovImm64ToGPR64(pos, (uint64_t)tagAddr, temp_gpr1);
+            pos += mainGen->buildInstruction(pos, 0, true, false,
+                    0x8b, temp_gpr1, temp_gpr1, true, 0);
+            pos += mainGen->buildInstruction(pos, 0, true, false,
+                    0x85, temp_gpr1, temp_gpr1, false, 0);
+            if (temp_gpr1 != REG_EAX) {
+                pos += buildFakeStackPopGPR64(pos, temp_gpr1);
+            }
+            pos += mainGen->buildJumpNotEqualNear32(pos, 0, sgl_offset_pos);
+            sgl_jmp_pos = pos;
+
+            pos += buildReplacedOperation(pos,
+                    op, SVT_IEEE_Double,
+                    orig_code, origNumBytes,
+                    inputEntries, replacementRM, 
+                    packed, only_movement, mem_output, xmm_output,
+                    dbl_special, dbl_replaced);
+            pos += mainGen->buildJumpNear32(pos, 0, done_offset_pos);
+            done_jmp_pos = pos;
+
+            *sgl_offset_pos = (int32_t)(pos - sgl_jmp_pos);
+            pos += buildReplacedOperation(pos,
+                    op, SVT_IEEE_Single,
+                    orig_code, origNumBytes,
+                    inputEntries, replacementRM, 
+                    packed, only_movement, mem_output, xmm_output,
+                    special, replaced);
+            *done_offset_pos = (int32_t)(pos - done_jmp_pos);
+
         // handle simple single- or double-precision replacements
-        if (replacementType == SVT_IEEE_Single ||
+        } else if (replacementType == SVT_IEEE_Single ||
             replacementType == SVT_IEEE_Double) {
 
             pos += buildReplacedOperation(pos,
@@ -1472,28 +1566,50 @@ Snippet::Ptr FPAnalysisInplace::buildReplacementCode(FPSemantics *inst,
     } else /* if (mainPolicy->getSVType(inst) == SVT_IEEE_Double)*/ {
         insnsInstrumentedDouble++;
     }
+
     if (canBuildBinaryBlob(inst)) {
 
         // add a setting for the instruction counter array
         // comment this if-statement out to disable instruction counting
-        if (_INST_svinp_inst_count_ptr_sgl == NULL) {
+        if (useShardedCounters) {
+            // counters live in per-thread shards instead
+        } else if (_INST_svinp_inst_count_ptr_sgl == NULL) {
             _INST_svinp_inst_count_ptr_sgl = (size_t**)app->malloc(sizeof(unsigned long*))->getBaseAddr();
             stringstream ss;    ss.clear();     ss.str("");
             ss << "svinp_icount_ptr_sgl=" << hex << _INST_svinp_inst_count_ptr_sgl << dec;
             configuration->addSetting(ss.str());
         }
-        if (_INST_svinp_inst_count_ptr_dbl == NULL) {
+        if (!useShardedCounters && _INST_svinp_inst_count_ptr_dbl == NULL) {
             _INST_svinp_inst_count_ptr_dbl = (size_t**)app->malloc(sizeof(unsigned long*))->getBaseAddr();
             stringstream ss;    ss.clear();     ss.str("");
             ss << "svinp_icount_ptr_dbl=" << hex << _INST_svinp_inst_count_ptr_dbl << dec;
             configuration->addSetting(ss.str());
         }
 
+        // the precision might change after instrumentation, so the blob reads
+        // it from a tag slot that the runtime fills in (see writeRuntimeTag)
+        void *tag_addr = NULL;
+        if (useRuntimeTags) {
+            tag_addr = app->malloc(sizeof(uint64_t))->getBaseAddr();
+            stringstream ss;    ss.clear();     ss.str("");
+            ss << "svinp_" << inst->getIndex() << "_tag_addr=" << hex << tag_addr << dec;
+            configuration->addSetting(ss.str());
+        }
+
         //printf("binary blob replacement: %s\n", inst->getDisassembly().c_str());
-        FPBinaryBlobInplace *blob = new FPBinaryBlobInplace(inst, mainPolicy);
+        FPBinaryBlobInplace *blob = new FPBinaryBlobInplace(inst, mainPolicy, tag_addr);
         if (useLockPrefix) {
             blob->enableLockPrefix();
         }
+        if (useShardedCounters) {
+            size_t slot = FPCounterShards::getInstance()->allocateSlot(configuration);
+            stringstream ss;    ss.clear();     ss.str("");
+            ss << "svinp_" << inst->getIndex() << "_count_slot=" << slot;
+            configuration->addSetting(ss.str());
+            blob->enableShardedCounters(
+                    FPCounterShards::getInstance()->getControlAddress(app, configuration),
+                    slot);
+        }
         return Snippet::Ptr(blob);
 
     } else {
@@ -2492,8 +2608,29 @@ void FPAnalysisInplace::finalOutput()
     // instruction counts
     FPSemantics *inst;
     stringstream ss2;
-    if (_INST_svinp_inst_count_ptr_sgl != NULL &&
-        _INST_svinp_inst_count_ptr_dbl != NULL) {
+    bool haveCounts = (_INST_svinp_inst_count_ptr_sgl != NULL &&
+                       _INST_svinp_inst_count_ptr_dbl != NULL);
+    if (FPCounterShards::getInstance()->isInitialized()) {
+        // fold sharded counters into the per-type count arrays
+        size_t slot;
+        for (i=0; i<instCountSize; i++) {
+            inst = decoder->lookup(i);
+            ss2.clear(); ss2.str("");
+            ss2 << "svinp_" << i << "_count_slot";
+            if (inst == NULL || !configuration->hasValue(ss2.str())) {
+                continue;
+            }
+            ss2.clear(); ss2.str(configuration->getValue(ss2.str()));
+            ss2 >> slot;
+            if (mainPolicy->getSVType(inst) == SVT_IEEE_Single) {
+                instCountSingle[i] += FPCounterShards::getInstance()->getCount(slot);
+            } else {
+                instCountDouble[i] += FPCounterShards::getInstance()->getCount(slot);
+            }
+        }
+        haveCounts = true;
+    }
+    if (haveCounts) {
         for (i=0; i<instCountSize; i++) {
             inst = decoder->lookup(i);
             if (inst != NULL) {
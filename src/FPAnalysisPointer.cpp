@@ -54,7 +54,7 @@ void * fpinst_malloc (size_t size, const void *)
 {
     void *result;
     RESTORE_GC_HOOKS;
-    if (_INST_status == _INST_ACTIVE) {
+    if (_INST_thread_status == _INST_ACTIVE) {
         result = malloc(size);
         //printf("internal malloc (%lu) = %p\n", size, result);
         /*
@@ -100,7 +100,7 @@ void * fpinst_realloc (void *ptr, size_t size, const void *)
 {
     void *result;
     RESTORE_GC_HOOKS;
-    if (_INST_status == _INST_ACTIVE) {
+    if (_INST_thread_status == _INST_ACTIVE) {
         result = realloc(ptr, size);
         //printf("internal realloc (%u) = %p\n", (unsigned int) size, result);
     } else {
@@ -123,7 +123,7 @@ void fpinst_free (void *ptr, const void *)
 {
     RESTORE_GC_HOOKS;
     SAVE_GC_HOOKS;
-    if (_INST_status == _INST_ACTIVE) {
+    if (_INST_thread_status == _INST_ACTIVE) {
         free(ptr);
         //printf ("internal free (%p)\n", ptr);
     } /*else {
@@ -336,6 +336,11 @@ string FPAnalysisPointer::finalInstReport()
 void FPAnalysisPointer::registerInstruction(FPSemantics * /*inst*/)
 { }
 
+bool FPAnalysisPointer::supportsLazyRegistration()
+{
+    return true;
+}
+
 void FPAnalysisPointer::handlePreInstruction(FPSemantics * /*inst*/)
 { }
 
@@ -1849,47 +1854,50 @@ void FPAnalysisPointer::finalOutput()
         // }}}
     }
 
+FPContext* _INST_get_context(long tidx);
+
 unsigned long _INST_fast_handle_pointer(long iidx,
-        unsigned long eflags)
+        unsigned long eflags, long tidx)
 {
+    FPContext *context = _INST_get_context(tidx);
     //cout << hex << "esp: 0x" << esp << "  ebp: 0x" << ebp << "  flags: 0x" << eflags << dec << endl;
-    __asm__ ("fxsave %0;" : : "m" (*mainContext->fxsave_state));
-    //__asm__ ("movups %%xmm0, %0;" : : "m" (mainContext->fxsave_state->xmm_space[0]));
-    //__asm__ ("movups %%xmm1, %0;" : : "m" (mainContext->fxsave_state->xmm_space[4]));
-    //__asm__ ("movups %%xmm2, %0;" : : "m" (mainContext->fxsave_state->xmm_space[8]));
+    __asm__ ("fxsave %0;" : : "m" (*context->fxsave_state));
+    //__asm__ ("movups %%xmm0, %0;" : : "m" (context->fxsave_state->xmm_space[0]));
+    //__asm__ ("movups %%xmm1, %0;" : : "m" (context->fxsave_state->xmm_space[4]));
+    //__asm__ ("movups %%xmm2, %0;" : : "m" (context->fxsave_state->xmm_space[8]));
     CHECK_FPSTSW
-    //mainContext->fxsave_state->fsw &= 0x3800; // TODO: re-enable?
+    //context->fxsave_state->fsw &= 0x3800; // TODO: re-enable?
     //__asm__ ("emms;");
-    //_INST_print_flags("saved", mainContext->flags);
+    //_INST_print_flags("saved", context->flags);
 #if 0
-    mainContext->reg_eax = eax; mainContext->reg_ebx = ebx;
-    mainContext->reg_ecx = ecx; mainContext->reg_edx = edx;
-    mainContext->reg_esp = esp /*+sizeof(unsigned long)*/; mainContext->reg_ebp = ebp;
-    mainContext->reg_esi = esi; mainContext->reg_edi = edi;
+    context->reg_eax = eax; context->reg_ebx = ebx;
+    context->reg_ecx = ecx; context->reg_edx = edx;
+    context->reg_esp = esp /*+sizeof(unsigned long)*/; context->reg_ebp = ebp;
+    context->reg_esi = esi; context->reg_edi = edi;
 #endif
-    mainContext->flags = eflags;
-    _INST_status = _INST_ACTIVE;
+    context->flags = eflags;
+    _INST_enter_library();
 
     // BEGIN INST
     FPSemantics *inst = mainDecoder->lookup(iidx);
 #if 0
-    mainContext->reg_eip = (unsigned long)inst->getAddress() + (unsigned long)inst->getNumBytes();
+    context->reg_eip = (unsigned long)inst->getAddress() + (unsigned long)inst->getNumBytes();
 #endif
     //printf("zf: %lx  pf: %lx  cf: %lx\n", zf, pf, cf);
-    //cout << "reg_eip = " << hex << mainContext->reg_eip << dec << endl;
+    //cout << "reg_eip = " << hex << context->reg_eip << dec << endl;
     if (_INST_Main_PointerAnalysis) {
         _INST_Main_PointerAnalysis->handleInstruction(inst);
     }
     _INST_fast_count++;
     // END INST
 
-    _INST_status = _INST_INACTIVE;
-    //_INST_print_flags("restoring", mainContext->flags);
-    __asm__ ("fxrstor %0;" : : "m" (*mainContext->fxsave_state));
-    //__asm__ ("movups %0, %%xmm0;" : : "m" (mainContext->fxsave_state->xmm_space[0]));
-    //__asm__ ("movups %0, %%xmm1;" : : "m" (mainContext->fxsave_state->xmm_space[4]));
-    //__asm__ ("movups %0, %%xmm2;" : : "m" (mainContext->fxsave_state->xmm_space[8]));
-    return mainContext->flags;
+    _INST_leave_library();
+    //_INST_print_flags("restoring", context->flags);
+    __asm__ ("fxrstor %0;" : : "m" (*context->fxsave_state));
+    //__asm__ ("movups %0, %%xmm0;" : : "m" (context->fxsave_state->xmm_space[0]));
+    //__asm__ ("movups %0, %%xmm1;" : : "m" (context->fxsave_state->xmm_space[4]));
+    //__asm__ ("movups %0, %%xmm2;" : : "m" (context->fxsave_state->xmm_space[8]));
+    return context->flags;
 }
 #endif
 
@@ -1,4 +1,5 @@
 #include "FPAnalysisRPrec.h"
+#include "FPSnapshot.h"
 
 namespace FPInst {
 
@@ -23,6 +24,9 @@ FPAnalysisRPrec::FPAnalysisRPrec()
     : FPAnalysis()
 {
     useLockPrefix = false;
+    useShardedCounters = false;
+    useRuntimePrecision = false;
+    precisionConfig = NULL;
     instData = NULL;
     instCount = 0;
     expandInstData(4096);
@@ -47,6 +51,13 @@ void FPAnalysisRPrec::configure(FPConfig *config, FPDecoder *decoder,
     if (config->getValue("use_lock_prefix") == "yes") {
         enableLockPrefix();
     }
+    if (config->getValue("use_sharded_counters") == "yes") {
+        useShardedCounters = true;
+    }
+    if (config->getValue("r_prec_runtime_precision") == "yes" ||
+        config->getValue("runtime_tags") == "yes") {
+        useRuntimePrecision = true;
+    }
     if (config->hasValue("r_prec_default_precision")) {
         const char *prec = config->getValueC("r_prec_default_precision");
         defaultPrecision = strtoul(prec, NULL, 10);
@@ -148,13 +159,33 @@ Snippet::Ptr FPAnalysisRPrec::buildReplacementCode(FPSemantics *inst,
     }
     //cout << endl;
 
-    instData[idx].count_addr = app->malloc(sizeof(unsigned long))->getBaseAddr();
+    if (useShardedCounters) {
+        instData[idx].count_slot = (long)FPCounterShards::getInstance()->allocateSlot(configuration);
+
+        ss.clear(); ss.str(""); ss << "INSN_" << dec << idx << "_count_slot";
+        key = ss.str(); ss.str("");
+        ss << dec << instData[idx].count_slot;
+        value = ss.str(); ss.str("");
+        configuration->setValue(key, value);
+    } else {
+        instData[idx].count_addr = app->malloc(sizeof(unsigned long))->getBaseAddr();
+
+        ss.clear(); ss.str(""); ss << "INSN_" << dec << idx << "_count_addr";
+        key = ss.str(); ss.str("");
+        ss << hex << instData[idx].count_addr;
+        value = ss.str(); ss.str("");
+        configuration->setValue(key, value);
+    }
 
-    ss.clear(); ss.str(""); ss << "INSN_" << dec << idx << "_count_addr";
-    key = ss.str(); ss.str("");
-    ss << hex << instData[idx].count_addr;
-    value = ss.str(); ss.str("");
-    configuration->setValue(key, value);
+    if (useRuntimePrecision) {
+        instData[idx].mask_addr = app->malloc(16)->getBaseAddr();
+
+        ss.clear(); ss.str(""); ss << "INSN_" << dec << idx << "_mask_addr";
+        key = ss.str(); ss.str("");
+        ss << hex << instData[idx].mask_addr;
+        value = ss.str(); ss.str("");
+        configuration->setValue(key, value);
+    }
 
     insnsInstrumented++;
 
@@ -168,6 +199,10 @@ Snippet::Ptr FPAnalysisRPrec::buildReplacementCode(FPSemantics *inst,
     if (useLockPrefix) {
         blob->enableLockPrefix();
     }
+    if (useShardedCounters) {
+        blob->enableShardedCounters(
+                FPCounterShards::getInstance()->getControlAddress(app, configuration));
+    }
     return Snippet::Ptr(blob);
 }
 
@@ -178,6 +213,7 @@ FPBinaryBlobRPrec::FPBinaryBlobRPrec(FPSemantics *inst,
     this->instData = instData;
     this->doTruncation = true;
     this->useLockPrefix = false;
+    this->shardControl = NULL;
 
     // set up bit masks for truncations
     //
@@ -205,6 +241,11 @@ void FPBinaryBlobRPrec::disableLockPrefix()
     useLockPrefix = false;
 }
 
+void FPBinaryBlobRPrec::enableShardedCounters(void *ctl_addr)
+{
+    shardControl = ctl_addr;
+}
+
 void FPAnalysisRPrec::enableLockPrefix()
 {
     useLockPrefix = true;
@@ -231,7 +272,7 @@ bool FPBinaryBlobRPrec::generate(Point * /*pt*/, Buffer &buf)
     unsigned char *orig_code, *pos, *opos;
     FPOperation *op;
     FPOperand *input, *output, *eip_operand = NULL;
-    FPRegister temp_gpr1, temp_xmm1;
+    FPRegister temp_gpr1, temp_gpr2, temp_xmm1;
     bool packed = false;
     size_t i;
 
@@ -285,9 +326,15 @@ bool FPBinaryBlobRPrec::generate(Point * /*pt*/, Buffer &buf)
     // grab the output operand
     output = op->opSets[0].out[0];
 
-    // make sure we actually need to truncate
-    if (!((output->getType() == IEEE_Double && precision < 52) ||
-          (output->getType() == IEEE_Single && precision < 23))) {
+    // make sure we actually need to truncate (a run-time mask might be set to
+    // any precision, so we always need the code in that case)
+    if (instData.mask_addr) {
+        if (output->getType() != IEEE_Double &&
+            output->getType() != IEEE_Single) {
+            doTruncation = false;
+        }
+    } else if (!((output->getType() == IEEE_Double && precision < 52) ||
+                 (output->getType() == IEEE_Single && precision < 23))) {
         doTruncation = false;
     }
 
@@ -306,7 +353,13 @@ bool FPBinaryBlobRPrec::generate(Point * /*pt*/, Buffer &buf)
 
         // load temporary XMM register with truncating constants
         //
-        if (output->getType() == IEEE_Double) {
+        if (instData.mask_addr) {
+            // movdqu (mask_addr), temp_xmm1
+            // (the runtime writes all four lanes; see writeTruncationMask)
+            pos += mainGen->buildMovImm64ToGPR64(pos, (uint64_t)instData.mask_addr, temp_gpr1);
+            pos += mainGen->buildInstruction(pos, 0xf3, false, true, 0x6f,
+                    temp_xmm1, temp_gpr1, true, 0);
+        } else if (output->getType() == IEEE_Double) {
             if (precision < 52) {
                 pos += mainGen->buildMovImm64ToGPR64(pos, rprecConst64[precision], temp_gpr1);
                 pos += mainGen->buildInsertGPR64IntoXMM(pos, temp_gpr1, temp_xmm1, 0);
@@ -338,8 +391,16 @@ bool FPBinaryBlobRPrec::generate(Point * /*pt*/, Buffer &buf)
         pos += mainGen->buildAndXMMWithXMM(pos, output->getRegister(), temp_xmm1);
     
         // increment instruction count
-        pos += mainGen->buildIncMem64(pos,
-                (int32_t)(unsigned long)instData.count_addr, useLockPrefix);
+        if (shardControl) {
+            temp_gpr2 = getUnusedGPR();
+            pos += buildFakeStackPushGPR64(pos, temp_gpr2);
+            pos += buildShardedIncMem64(pos, shardControl,
+                    (size_t)instData.count_slot, temp_gpr1, temp_gpr2);
+            pos += buildFakeStackPopGPR64(pos, temp_gpr2);
+        } else {
+            pos += mainGen->buildIncMem64(pos,
+                    (int32_t)(unsigned long)instData.count_addr, useLockPrefix);
+        }
 
         // binary blob state restore and footer
         pos += buildFakeStackPopXMM(pos, temp_xmm1);
@@ -383,17 +444,9 @@ void FPAnalysisRPrec::registerInstruction(FPSemantics *inst)
         expandInstData(inst->getIndex());
     }
     instData[idx].inst = inst;
-    instData[idx].precision = defaultPrecision;
+    instData[idx].precision = getConfiguredPrecision(idx);
     instData[idx].count = 0;
 
-    ss.clear(); ss.str(""); ss << "INSN_" << dec << idx << "_precision";
-    key = ss.str();
-    //cout << "key=" << key << " ";
-    if (configuration->hasValue(key)) {
-        ss.clear(); ss.str(configuration->getValue(key));
-        ss >> instData[idx].precision;
-    }
-
     ss.clear(); ss.str(""); ss << "INSN_" << dec << idx << "_count_addr";
     key = ss.str();
     ss.clear(); ss.str(configuration->getValue(key));
@@ -402,6 +455,103 @@ void FPAnalysisRPrec::registerInstruction(FPSemantics *inst)
     if (instData[idx].count_addr) {
         *(unsigned long*)(instData[idx].count_addr) = 0;
     }
+
+    ss.clear(); ss.str(""); ss << "INSN_" << dec << idx << "_mask_addr";
+    key = ss.str();
+    if (configuration->hasValue(key)) {
+        ss.clear(); ss.str(configuration->getValue(key));
+        ss >> instData[idx].mask_addr;
+        writeTruncationMask(inst, instData[idx]);
+    }
+
+    ss.clear(); ss.str(""); ss << "INSN_" << dec << idx << "_count_slot";
+    key = ss.str();
+    if (configuration->hasValue(key)) {
+        ss.clear(); ss.str(configuration->getValue(key));
+        ss >> instData[idx].count_slot;
+    }
+}
+
+FPConfig* FPAnalysisRPrec::getPrecisionConfig()
+{
+    // with run-time masks, the precisions may come from the current search
+    // configuration instead of the one embedded at instrumentation time
+    if (!precisionConfig) {
+        const char *fn = (useRuntimePrecision ? getenv("CRAFT_CONFIG") : NULL);
+        if (fn) {
+            precisionConfig = new FPConfig(fn);
+            if (precisionConfig->hasValue("r_prec_default_precision")) {
+                const char *prec = precisionConfig->getValueC("r_prec_default_precision");
+                defaultPrecision = strtoul(prec, NULL, 10);
+            }
+        } else {
+            precisionConfig = configuration;
+        }
+    }
+    return precisionConfig;
+}
+
+unsigned long FPAnalysisRPrec::getConfiguredPrecision(size_t idx)
+{
+    FPConfig *precConfig = getPrecisionConfig();
+    unsigned long precision = defaultPrecision;
+    stringstream ss("");
+    string key;
+
+    ss.clear(); ss.str(""); ss << "INSN_" << dec << idx << "_precision";
+    key = ss.str();
+    if (precConfig->hasValue(key)) {
+        ss.clear(); ss.str(precConfig->getValue(key));
+        ss >> precision;
+    }
+    return precision;
+}
+
+void FPAnalysisRPrec::reloadConfiguration(FPConfig *runConfig)
+{
+    size_t i;
+
+    // only run-time masks can change without re-instrumenting
+    if (!useRuntimePrecision) {
+        return;
+    }
+    precisionConfig = runConfig;
+    if (runConfig->hasValue("r_prec_default_precision")) {
+        const char *prec = runConfig->getValueC("r_prec_default_precision");
+        defaultPrecision = strtoul(prec, NULL, 10);
+    }
+    for (i=0; i<instCount; i++) {
+        if (instData[i].inst && instData[i].mask_addr) {
+            instData[i].precision = getConfiguredPrecision(i);
+            writeTruncationMask(instData[i].inst, instData[i]);
+        }
+    }
+}
+
+void FPAnalysisRPrec::writeTruncationMask(FPSemantics *inst,
+        FPAnalysisRPrecInstData &data)
+{
+    // lane layout matches the immediate masks in FPBinaryBlobRPrec::generate:
+    // packed instructions truncate every lane, scalar ones only the lowest
+    FPOperation *op = (*inst)[0];
+    FPOperand *output = op->opSets[0].out[0];
+    bool packed = (op->numOpSets > 1);
+    unsigned long precision = data.precision;
+    size_t i;
+
+    if (output->getType() == IEEE_Double) {
+        uint64_t *mask = (uint64_t*)data.mask_addr;
+        uint64_t m = (precision < 52 ? ~((1UL << (52-precision)) - 1UL) : ~0UL);
+        mask[0] = m;
+        mask[1] = (packed ? m : ~0UL);
+    } else {
+        uint32_t *mask = (uint32_t*)data.mask_addr;
+        uint32_t m = (precision < 23 ? ~((1U << (23-precision)) - 1U) : ~0U);
+        mask[0] = m;
+        for (i=1; i<4; i++) {
+            mask[i] = (packed ? m : ~0U);
+        }
+    }
 }
 
 void FPAnalysisRPrec::handlePreInstruction(FPSemantics * /*inst*/)
@@ -429,12 +579,15 @@ void FPAnalysisRPrec::expandInstData(size_t newSize)
         fprintf(stderr, "OUT OF MEMORY!\n");
         exit(-1);
     }
+    FPSnapshot::beginResize();
     if (instData != NULL) {
         for (; i < instCount; i++) {
             newInstData[i].inst = instData[i].inst;
             newInstData[i].precision = instData[i].precision;
             newInstData[i].count = instData[i].count;
             newInstData[i].count_addr = instData[i].count_addr;
+            newInstData[i].count_slot = instData[i].count_slot;
+            newInstData[i].mask_addr = instData[i].mask_addr;
         }
         free(instData);
         instData = NULL;
@@ -444,9 +597,41 @@ void FPAnalysisRPrec::expandInstData(size_t newSize)
         newInstData[i].precision = 0;
         newInstData[i].count = 0;
         newInstData[i].count_addr = NULL;
+        newInstData[i].count_slot = -1;
+        newInstData[i].mask_addr = NULL;
     }
     instData = newInstData;
     instCount = newSize;
+    FPSnapshot::endResize();
+}
+
+unsigned long FPAnalysisRPrec::getCount(size_t idx)
+{
+    if (instData[idx].count_slot >= 0) {
+        return FPCounterShards::getInstance()->getCount(
+                (size_t)instData[idx].count_slot);
+    } else if (instData[idx].count_addr) {
+        return *(unsigned long*)(instData[idx].count_addr);
+    } else {
+        return instData[idx].count;
+    }
+}
+
+size_t FPAnalysisRPrec::snapshotCounters(FPSnapshotEntry *entries, size_t maxEntries)
+{
+    unsigned long cnt;
+    size_t i, n = 0;
+    for (i = 0; i < instCount && n < maxEntries; i++) {
+        if (instData[i].inst) {
+            cnt = getCount(i);
+            if (cnt > 0) {
+                entries[n].key = FP_SNAPSHOT_KEY(i, 0, SNAPSHOT_COUNT);
+                entries[n].value = cnt;
+                n++;
+            }
+        }
+    }
+    return n;
 }
 
 void FPAnalysisRPrec::finalOutput()
@@ -460,11 +645,7 @@ void FPAnalysisRPrec::finalOutput()
         if (instData[i].inst) {
 
             // overall count
-            if (instData[i].count_addr) {
-                icount = *(unsigned long*)(instData[i].count_addr);
-            } else {
-                icount = instData[i].count;
-            }
+            icount = getCount(i);
 
             // output individual count
             ss2.clear();
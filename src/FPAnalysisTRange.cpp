@@ -1,4 +1,5 @@
 #include "FPAnalysisTRange.h"
+#include "FPSnapshot.h"
 
 namespace FPInst {
 
@@ -27,6 +28,7 @@ FPAnalysisTRange::FPAnalysisTRange()
     instData = NULL;
     expandInstData(4096);
     insnsInstrumented = 0;
+    useShardedCounters = false;
 }
 
 string FPAnalysisTRange::getTag()
@@ -44,6 +46,9 @@ void FPAnalysisTRange::configure(FPConfig *config, FPDecoder *decoder,
 {
     FPAnalysis::configure(config, decoder, log, context);
     configAddresses(config);
+    if (config->getValue("use_sharded_counters") == "yes") {
+        useShardedCounters = true;
+    }
     if (isRestrictedByAddress()) {
         //status << "t_range: addresses=" << listAddresses();
     }
@@ -154,7 +159,9 @@ Snippet::Ptr FPAnalysisTRange::buildReplacementCode(FPSemantics *inst,
 
     instData[idx].min_addr   = app->malloc(sizeof(double))->getBaseAddr();
     instData[idx].max_addr   = app->malloc(sizeof(double))->getBaseAddr();
-    instData[idx].count_addr = app->malloc(sizeof(unsigned long))->getBaseAddr();
+    if (!useShardedCounters) {
+        instData[idx].count_addr = app->malloc(sizeof(unsigned long))->getBaseAddr();
+    }
     //printf("  min_addr=%p  max_addr=%p\n",
             //instData[idx].min_addr, instData[idx].max_addr);
 
@@ -173,15 +180,30 @@ Snippet::Ptr FPAnalysisTRange::buildReplacementCode(FPSemantics *inst,
     value = ss.str(); ss.str("");
     configuration->setValue(key, value);
 
-    ss << "inst" << dec << idx << "_count_addr";
-    key = ss.str(); ss.str("");
-    ss << hex << instData[idx].count_addr;
-    value = ss.str(); ss.str("");
-    configuration->setValue(key, value);
+    if (useShardedCounters) {
+        instData[idx].count_slot = (long)FPCounterShards::getInstance()->allocateSlot(configuration);
+
+        ss << "inst" << dec << idx << "_count_slot";
+        key = ss.str(); ss.str("");
+        ss << dec << instData[idx].count_slot;
+        value = ss.str(); ss.str("");
+        configuration->setValue(key, value);
+    } else {
+        ss << "inst" << dec << idx << "_count_addr";
+        key = ss.str(); ss.str("");
+        ss << hex << instData[idx].count_addr;
+        value = ss.str(); ss.str("");
+        configuration->setValue(key, value);
+    }
 
     insnsInstrumented++;
 
-    return Snippet::Ptr(new FPBinaryBlobTRange(inst, instData[idx]));
+    FPBinaryBlobTRange *blob = new FPBinaryBlobTRange(inst, instData[idx]);
+    if (useShardedCounters) {
+        blob->enableShardedCounters(
+                FPCounterShards::getInstance()->getControlAddress(app, configuration));
+    }
+    return Snippet::Ptr(blob);
 }
 
 FPBinaryBlobTRange::FPBinaryBlobTRange(FPSemantics *inst, 
@@ -189,13 +211,19 @@ FPBinaryBlobTRange::FPBinaryBlobTRange(FPSemantics *inst,
     : FPBinaryBlob(inst)
 {
     this->instData = instData;
+    this->shardControl = NULL;
+}
+
+void FPBinaryBlobTRange::enableShardedCounters(void *ctl_addr)
+{
+    shardControl = ctl_addr;
 }
 
 bool FPBinaryBlobTRange::generate(Point * /*pt*/, Buffer &buf)
 {
     size_t origNumBytes = inst->getNumBytes();
     unsigned char *orig_code, *pos, *opos;
-    FPRegister temp_gpr1, temp_xmm1, temp_xmm2;
+    FPRegister temp_gpr1, temp_gpr2, temp_xmm1, temp_xmm2;
 
     initialize();
 
@@ -391,8 +419,16 @@ bool FPBinaryBlobTRange::generate(Point * /*pt*/, Buffer &buf)
         }
     }
     
-    // TODO: increment count
-    pos += mainGen->buildIncMem64(pos, (int32_t)(unsigned long)instData.count_addr);
+    // increment count
+    if (shardControl) {
+        temp_gpr2 = getUnusedGPR();
+        pos += buildFakeStackPushGPR64(pos, temp_gpr2);
+        pos += buildShardedIncMem64(pos, shardControl,
+                (size_t)instData.count_slot, temp_gpr1, temp_gpr2);
+        pos += buildFakeStackPopGPR64(pos, temp_gpr2);
+    } else {
+        pos += mainGen->buildIncMem64(pos, (int32_t)(unsigned long)instData.count_addr);
+    }
 
     pos += buildFakeStackPopXMM(pos, temp_xmm2);
     pos += buildFakeStackPopXMM(pos, temp_xmm1);
@@ -468,6 +504,13 @@ void FPAnalysisTRange::registerInstruction(FPSemantics *inst)
         *(unsigned long*)(instData[idx].count_addr) = 0;
     }
 
+    ss.clear(); ss.str(""); ss << "inst" << dec << idx << "_count_slot";
+    key = ss.str();
+    if (configuration->hasValue(key)) {
+        ss.clear(); ss.str(configuration->getValue(key));
+        ss >> instData[idx].count_slot;
+    }
+
     //cout << inst->getDisassembly()
          //<< " min=" << hex << instData[idx].min_addr
          //<< " max=" << hex << instData[idx].max_addr
@@ -546,6 +589,7 @@ void FPAnalysisTRange::expandInstData(size_t newSize)
         fprintf(stderr, "OUT OF MEMORY!\n");
         exit(-1);
     }
+    FPSnapshot::beginResize();
     if (instData != NULL) {
         for (; i < instCount; i++) {
             newInstData[i].inst = instData[i].inst;
@@ -555,6 +599,7 @@ void FPAnalysisTRange::expandInstData(size_t newSize)
             newInstData[i].min_addr = instData[i].min_addr;
             newInstData[i].max_addr = instData[i].max_addr;
             newInstData[i].count_addr = instData[i].count_addr;
+            newInstData[i].count_slot = instData[i].count_slot;
         }
         free(instData);
         instData = NULL;
@@ -567,9 +612,40 @@ void FPAnalysisTRange::expandInstData(size_t newSize)
         newInstData[i].min_addr = NULL;
         newInstData[i].max_addr = NULL;
         newInstData[i].count_addr = NULL;
+        newInstData[i].count_slot = -1;
     }
     instData = newInstData;
     instCount = newSize;
+    FPSnapshot::endResize();
+}
+
+unsigned long FPAnalysisTRange::getCount(size_t idx)
+{
+    if (instData[idx].count_slot >= 0) {
+        return FPCounterShards::getInstance()->getCount(
+                (size_t)instData[idx].count_slot);
+    } else if (instData[idx].count_addr) {
+        return *(unsigned long*)(instData[idx].count_addr);
+    } else {
+        return instData[idx].count;
+    }
+}
+
+size_t FPAnalysisTRange::snapshotCounters(FPSnapshotEntry *entries, size_t maxEntries)
+{
+    unsigned long cnt;
+    size_t i, n = 0;
+    for (i = 0; i < instCount && n < maxEntries; i++) {
+        if (instData[i].inst) {
+            cnt = getCount(i);
+            if (cnt > 0) {
+                entries[n].key = FP_SNAPSHOT_KEY(i, 0, SNAPSHOT_COUNT);
+                entries[n].value = cnt;
+                n++;
+            }
+        }
+    }
+    return n;
 }
 
 void FPAnalysisTRange::finalOutput()
@@ -603,13 +679,8 @@ void FPAnalysisTRange::finalOutput()
 
             ss.clear(); ss.str("");
             ss << instData[i].inst->getDisassembly();
-            if (instData[i].count_addr) {
-                cnt = *(unsigned long*)(instData[i].count_addr);
-                ss << "instruction #" << i << ": count=" << cnt;
-            } else {
-                cnt = instData[i].count;
-                ss << "instruction #" << i << ": count=" << cnt;
-            }
+            cnt = getCount(i);
+            ss << "instruction #" << i << ": count=" << cnt;
             logFile->addMessage(ICOUNT, (long)cnt, instData[i].inst->getDisassembly(),
                     ss.str(), "", instData[i].inst);
         }
@@ -2,12 +2,12 @@
 
 namespace FPInst {
 
-FPBinaryBlob::FPBinaryBlob(FPSemantics *inst)
+FPBinaryBlob::FPBinaryBlob(FPSemantics *inst, size_t maxBytes)
 {
     this->mainGen = new FPCodeGen();
     this->inst = inst;
     this->blobAddress = NULL;
-    blobCode = (unsigned char*)malloc(1024);
+    blobCode = (unsigned char*)malloc(maxBytes);
     assert(blobCode);
     fake_stack_offset = -0xb0;
     //fake_stack_offset = -0x10;
@@ -155,6 +155,183 @@ size_t FPBinaryBlob::buildFakeStackPopXMM(unsigned char *pos, FPRegister xmm)
     return (size_t)(pos - old_pos);
 }
 
+size_t FPBinaryBlob::buildShardedIncMem64(unsigned char *pos, void *ctl_addr,
+        size_t slot, FPRegister ctl_gpr, FPRegister shard_gpr)
+{
+    // see FPCounterShards.h for a description of the layout; clobbers flags
+    unsigned char *old_pos = pos;
+    unsigned char *done_jmp_pos1, *done_jmp_pos2, *slow_jmp_pos;
+    unsigned char *overflow_jmp_pos, *fast_jmp_pos, *fast_pos, *cached_jmp_pos;
+    int32_t *done_offset_pos1, *done_offset_pos2, *slow_offset_pos;
+    int32_t *overflow_offset_pos, *fast_offset_pos, *cached_offset_pos;
+    int32_t slot_disp = (int32_t)(slot * sizeof(unsigned long));
+
+    assert(isGPR(ctl_gpr) && isGPR(shard_gpr) && ctl_gpr != shard_gpr);
+
+    // grab the control block pointer
+    pos += mainGen->buildMovImm64ToGPR64(pos, (uint64_t)ctl_addr, ctl_gpr);
+
+    // skip counting if the runtime hasn't set up the shards yet
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x8b, shard_gpr, ctl_gpr, true, FPCounterShards::CTL_TLS_OFFSET);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x85, shard_gpr, shard_gpr, false, 0);
+    pos += mainGen->buildJumpEqualNear32(pos, 0, done_offset_pos1);
+    done_jmp_pos1 = pos;
+
+    // load this thread's shard pointer (%fs-relative TLS access)
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x8b, shard_gpr, shard_gpr, true, FPCounterShards::TLS_SHARD, REG_FS);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x85, shard_gpr, shard_gpr, false, 0);
+    pos += mainGen->buildJumpEqualNear32(pos, 0, slow_offset_pos);
+    slow_jmp_pos = pos;
+
+    // fast path: plain increment of the slot in this thread's shard
+    fast_pos = pos;
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0xff, REG_NONE, shard_gpr, true, slot_disp);
+    pos += mainGen->buildJumpNear32(pos, 0, done_offset_pos2);
+    done_jmp_pos2 = pos;
+
+    // slow path: threads that already overflowed have the overflow shard
+    // cached in their second TLS slot
+    *slow_offset_pos = (int32_t)(pos-slow_jmp_pos);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x8b, shard_gpr, ctl_gpr, true, FPCounterShards::CTL_TLS_OFFSET);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x8b, shard_gpr, shard_gpr, true, FPCounterShards::TLS_OVERFLOW, REG_FS);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x85, shard_gpr, shard_gpr, false, 0);
+    pos += mainGen->buildJumpNotEqualNear32(pos, 0, cached_offset_pos);
+    cached_jmp_pos = pos;
+
+    // first count in this thread: claim the next shard
+    pos += mainGen->buildMovImm64ToGPR64(pos, 1, shard_gpr);
+    pos += mainGen->buildInstruction(pos, 0xf0, true, true,
+            0xc1, shard_gpr, ctl_gpr, true, FPCounterShards::CTL_NEXT_SHARD);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x3b, shard_gpr, ctl_gpr, true, FPCounterShards::CTL_MAX_SHARDS);
+    pos += mainGen->buildJumpGreaterEqualNear32(pos, 0, overflow_offset_pos);
+    overflow_jmp_pos = pos;
+    pos += mainGen->buildInstruction(pos, 0, true, true,
+            0xaf, shard_gpr, ctl_gpr, true, FPCounterShards::CTL_STRIDE);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x03, shard_gpr, ctl_gpr, true, FPCounterShards::CTL_BASE);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x8b, ctl_gpr, ctl_gpr, true, FPCounterShards::CTL_TLS_OFFSET);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x89, shard_gpr, ctl_gpr, true, FPCounterShards::TLS_SHARD, REG_FS);
+    pos += mainGen->buildJumpNear32(pos, 0, fast_offset_pos);
+    fast_jmp_pos = pos;
+    *fast_offset_pos = (int32_t)(fast_pos-fast_jmp_pos);
+
+    // out of shards: cache the shared overflow shard for this thread
+    *overflow_offset_pos = (int32_t)(pos-overflow_jmp_pos);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x8b, shard_gpr, ctl_gpr, true, FPCounterShards::CTL_OVERFLOW);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x8b, ctl_gpr, ctl_gpr, true, FPCounterShards::CTL_TLS_OFFSET);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x89, shard_gpr, ctl_gpr, true, FPCounterShards::TLS_OVERFLOW, REG_FS);
+
+    // atomic increment in the shared overflow shard
+    *cached_offset_pos = (int32_t)(pos-cached_jmp_pos);
+    pos += mainGen->buildInstruction(pos, 0xf0, true, false,
+            0xff, REG_NONE, shard_gpr, true, slot_disp);
+
+    *done_offset_pos1 = (int32_t)(pos-done_jmp_pos1);
+    *done_offset_pos2 = (int32_t)(pos-done_jmp_pos2);
+    return (size_t)(pos - old_pos);
+}
+
+size_t FPBinaryBlob::buildHandlerCall(unsigned char *pos, void *handlerPtr,
+        FPRegister temp_gpr, const uint64_t *immArgs, size_t numImmArgs,
+        const FPRegister *xmmArgs, size_t numXmmArgs)
+{
+    // calls *handlerPtr with the immediate arguments followed by the raw bits
+    // of the given XMM registers (low 64 bits); the call is skipped if the
+    // runtime hasn't filled in the handler yet. Clobbers temp_gpr and flags.
+
+    // registers that the handler may clobber (%rax is saved by the header,
+    // and %rbx holds the original stack pointer during the call)
+    static const FPRegister savedRegs[] = { REG_EBX, REG_ECX, REG_EDX,
+        REG_ESI, REG_EDI, REG_E8, REG_E9, REG_E10, REG_E11 };
+    static const size_t numSavedRegs = sizeof(savedRegs) / sizeof(FPRegister);
+    static const FPRegister argRegs[] = { REG_EDI, REG_ESI, REG_EDX,
+        REG_ECX, REG_E8, REG_E9 };
+    static const int32_t FXSAVE_SIZE = 512;
+
+    unsigned char *old_pos = pos;
+    unsigned char *skip_jmp_pos;
+    int32_t *skip_offset_pos;
+    size_t i;
+
+    assert(numImmArgs + numXmmArgs <= sizeof(argRegs) / sizeof(FPRegister));
+
+    pos += mainGen->buildMovImm64ToGPR64(pos, (uint64_t)handlerPtr, temp_gpr);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x8b, temp_gpr, temp_gpr, true, 0);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x85, temp_gpr, temp_gpr, false, 0);
+    pos += mainGen->buildJumpEqualNear32(pos, 0, skip_offset_pos);
+    skip_jmp_pos = pos;
+
+    for (i=0; i<numSavedRegs; i++) {
+        pos += buildFakeStackPushGPR64(pos, savedRegs[i]);
+    }
+    if (temp_gpr != REG_EAX) {
+        pos += mainGen->buildMovGPR64ToGPR64(pos, temp_gpr, REG_EAX);
+    }
+    for (i=0; i<numImmArgs; i++) {
+        pos += mainGen->buildMovImm64ToGPR64(pos, immArgs[i], argRegs[i]);
+    }
+    for (i=0; i<numXmmArgs; i++) {
+        pos += mainGen->buildMovXmmToGPR64(pos, xmmArgs[i], argRegs[numImmArgs+i]);
+    }
+
+    // move to an aligned stack below the fake stack, save the x87/SSE state
+    // there, and make the call
+    pos += mainGen->buildMovGPR64ToGPR64(pos, REG_ESP, REG_EBX);
+    pos += mainGen->buildSPAdjustment(pos, (int32_t)(getFakeStackOffset() - FXSAVE_SIZE));
+    pos += mainGen->buildSPAlignment(pos, 16);
+    pos += mainGen->buildFxsaveSP(pos);
+    pos += mainGen->buildCallGPR64(pos, REG_EAX);
+    pos += mainGen->buildFxrstorSP(pos);
+    pos += mainGen->buildInstruction(pos, 0, true, false,
+            0x8b, REG_ESP, REG_EBX, false, 0);
+
+    for (i=numSavedRegs; i>0; i--) {
+        pos += buildFakeStackPopGPR64(pos, savedRegs[i-1]);
+    }
+
+    *skip_offset_pos = (int32_t)(pos-skip_jmp_pos);
+    return (size_t)(pos - old_pos);
+}
+
+size_t FPBinaryBlob::buildLaneLoadXMM(unsigned char *pos,
+        FPOperand *src, FPRegister dest_xmm)
+{
+    unsigned char *old_pos = pos;
+    long tag = src->getTag();
+
+    if (tag == 0) {
+        pos += buildOperandLoadXMM(pos, src, dest_xmm, false);
+    } else if (src->isRegisterSSE()) {
+        // pshufd $imm, %src, %dest (moves the lane to the bottom)
+        pos += mainGen->buildInstruction(pos, 0x66, false, true,
+                0x70, dest_xmm, src->getRegister(), false, 0);
+        (*pos++) = (unsigned char)(tag | (((tag+1) & 0x3) << 2));
+    } else {
+        // memory lanes are at four-byte offsets (see FPOperand::refresh)
+        FPOperand lane(src->getType(), src->getBase(), src->getIndex(),
+                src->getDisp() + tag*4, src->getScale(), src->getSegment(), 0);
+        pos += buildOperandLoadXMM(pos, &lane, dest_xmm, false);
+    }
+
+    return (size_t)(pos - old_pos);
+}
+
 size_t FPBinaryBlob::buildOperandLoadGPR(unsigned char *pos,
         FPOperand *src, FPRegister dest_gpr)
 {
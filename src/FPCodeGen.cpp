@@ -513,6 +513,37 @@ size_t FPCodeGen::buildAddGPR64ToGPR64(unsigned char *pos, FPRegister reg, FPReg
             0x01, reg, rm, false, 0);
 }
 
+size_t FPCodeGen::buildSubGPR64FromGPR64(unsigned char *pos, FPRegister reg, FPRegister rm)
+{
+    // sub %reg, %rm   (%rm = %rm - %reg)
+    assert(rm >= REG_EAX && rm <= REG_E15);
+    assert(reg >= REG_EAX && reg <= REG_E15);
+    return buildInstruction(pos, 0, true, false,
+            0x29, reg, rm, false, 0);
+}
+
+size_t FPCodeGen::buildShiftLeftGPR64(unsigned char *pos, FPRegister gpr, uint8_t bits)
+{
+    assert(gpr >= REG_EAX && gpr <= REG_E15);
+    unsigned char *old_pos = pos;
+    pos += buildREX(pos, true, REG_NONE, REG_NONE, gpr);
+    (*pos++) = 0xc1;            // shl $bits, %gpr
+    (*pos++) = 0xe0 | (getRegModRMId(gpr) & 0x7);
+    (*pos++) = bits;
+    return (size_t)(pos-old_pos);
+}
+
+size_t FPCodeGen::buildShiftRightGPR64(unsigned char *pos, FPRegister gpr, uint8_t bits)
+{
+    assert(gpr >= REG_EAX && gpr <= REG_E15);
+    unsigned char *old_pos = pos;
+    pos += buildREX(pos, true, REG_NONE, REG_NONE, gpr);
+    (*pos++) = 0xc1;            // shr $bits, %gpr
+    (*pos++) = 0xe8 | (getRegModRMId(gpr) & 0x7);
+    (*pos++) = bits;
+    return (size_t)(pos-old_pos);
+}
+
 size_t FPCodeGen::buildIncMem64(unsigned char *pos, int32_t offset, bool lock)
 {
     unsigned char prefix = (lock ? 0xf0 : 0x0);
@@ -585,6 +616,17 @@ size_t FPCodeGen::buildJumpLessEqualNear32(unsigned char *pos,
     return 6;
 }
 
+size_t FPCodeGen::buildJumpSignedLessEqualNear32(unsigned char *pos,
+        int32_t offset, int32_t* &offset_pos)
+{
+    (*pos++) = 0x0f;            // jle offset(%rip)
+    (*pos++) = 0x8e;
+    offset_pos = (int32_t*)pos;
+    *offset_pos = offset;
+    pos += 1;
+    return 6;
+}
+
 size_t FPCodeGen::buildNop(unsigned char *pos)
 {
     (*pos++) = 0x90;            // nop
@@ -666,6 +708,46 @@ size_t FPCodeGen::buildSPAdjustment(unsigned char *pos,
     return 8;
 }
 
+size_t FPCodeGen::buildSPAlignment(unsigned char *pos,
+        uint8_t alignment)
+{
+    (*pos++) = 0x48;            // and $-alignment, %rsp
+    (*pos++) = 0x83;
+    (*pos++) = 0xe4;
+    *(int8_t*)pos = -(int8_t)alignment; pos += 1;
+    return 4;
+}
+
+size_t FPCodeGen::buildCallGPR64(unsigned char *pos, FPRegister gpr)
+{
+    assert(gpr >= REG_EAX && gpr <= REG_E15);
+    unsigned char *old_pos = pos;
+    pos += buildREX(pos, false, REG_NONE, REG_NONE, gpr);
+    (*pos++) = 0xff;            // call *%gpr
+    (*pos++) = 0xd0 | (getRegModRMId(gpr) & 0x7);
+    return (size_t)(pos-old_pos);
+}
+
+size_t FPCodeGen::buildFxsaveSP(unsigned char *pos)
+{
+    (*pos++) = 0x48;            // fxsave64 (%rsp)
+    (*pos++) = 0x0f;
+    (*pos++) = 0xae;
+    (*pos++) = 0x04;
+    (*pos++) = 0x24;
+    return 5;
+}
+
+size_t FPCodeGen::buildFxrstorSP(unsigned char *pos)
+{
+    (*pos++) = 0x48;            // fxrstor64 (%rsp)
+    (*pos++) = 0x0f;
+    (*pos++) = 0xae;
+    (*pos++) = 0x0c;
+    (*pos++) = 0x24;
+    return 5;
+}
+
 size_t FPCodeGen::buildDie(unsigned char *pos)
 {
     (*pos++) = 0xcd;            // int 0x3
@@ -1,7 +1,17 @@
 #include "FPConfig.h"
 
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 namespace FPInst {
 
+static const char CONFIG_FILE_MAGIC[8] = { 'F','P','C','O','N','F','I','G' };
+
 const string FPConfig::RE_APP = "APPLICATION";
 const string FPConfig::RE_MODULE = "MODULE";
 const string FPConfig::RE_FUNCTION = "FUNC";
@@ -23,6 +33,15 @@ FPConfig::FPConfig()
     currentModule = NULL;
     currentFunction = NULL;
     currentBasicBlock = NULL;
+    tagTableValid = false;
+    tagTableOverride = false;
+    mapBase = NULL;
+    mapSize = 0;
+    mappedEntries = NULL;
+    numMappedEntries = 0;
+    mappedTags = NULL;
+    numMappedTags = 0;
+    mappedStrings = NULL;
 }
 
 FPConfig::FPConfig(string filename)
@@ -31,6 +50,22 @@ FPConfig::FPConfig(string filename)
     currentModule = NULL;
     currentFunction = NULL;
     currentBasicBlock = NULL;
+    tagTableValid = false;
+    tagTableOverride = false;
+    mapBase = NULL;
+    mapSize = 0;
+    mappedEntries = NULL;
+    numMappedEntries = 0;
+    mappedTags = NULL;
+    numMappedTags = 0;
+    mappedStrings = NULL;
+    if (isBinaryFile(filename)) {
+        if (!loadBinaryFile(filename)) {
+            fprintf(stderr, "WARNING: Invalid binary configuration file %s\n",
+                    filename.c_str());
+        }
+        return;
+    }
     ifstream fin(filename.c_str());
     string line, key, value, type;
     while (!fin.fail() && getline(fin, line)) {
@@ -39,6 +74,11 @@ FPConfig::FPConfig(string filename)
     fin.close();
 }
 
+FPConfig::~FPConfig()
+{
+    unloadBinaryFile();
+}
+
 void FPConfig::addSetting(char* line) {
     addSetting(string(line));
 }
@@ -142,6 +182,9 @@ void FPConfig::addReplaceEntry(string line)
     FPReplaceEntry *entry = new FPReplaceEntry();
     size_t pos, len;
 
+    // new entries may refer to mapped ones as parents
+    loadMappedReplaceEntries();
+
     // parse tag
     if (line.length() >= 2) {
         switch (line[1]) {
@@ -224,10 +267,11 @@ void FPConfig::addReplaceEntry(string line)
 
 void FPConfig::addReplaceEntry(FPReplaceEntry *entry)
 {
+    loadMappedReplaceEntries();
     replaceEntries.push_back(entry);
     //replaceEntries.insert(replaceEntries.begin(), entry);
     if (entry->type == RETYPE_INSTRUCTION) {
-        instructionEntries[entry->address] = entry;
+        tagTableValid = false;
     }
 }
 
@@ -279,21 +323,149 @@ void FPConfig::getAllSettings(vector<string> &vals)
 
 bool FPConfig::hasReplaceTagTree()
 {
-    return replaceEntries.size() > 0;
+    return getNumReplaceEntries() > 0 || numMappedTags > 0;
+}
+
+size_t FPConfig::getNumReplaceEntries()
+{
+    return replaceEntries.size() + numMappedEntries;
+}
+
+static bool tagTableAddrLess(const pair<void*, FPReplaceEntryTag> &a,
+                             const pair<void*, FPReplaceEntryTag> &b)
+{
+    return a.first < b.first;
+}
+
+void FPConfig::buildReplaceTagTable()
+{
+    vector<FPReplaceEntry*>::iterator i;
+    size_t j, n;
+
+    // mapped binary configurations already contain a resolved table
+    if (mappedTags != NULL) {
+        return;
+    }
+
+    // so do overridden tags (see loadReplaceTags)
+    if (tagTableOverride) {
+        tagTableValid = true;
+        return;
+    }
+
+    tagTable.clear();
+    for (i=replaceEntries.begin(); i!=replaceEntries.end(); i++) {
+        if ((*i)->type == RETYPE_INSTRUCTION) {
+            tagTable.push_back(make_pair((*i)->address, (*i)->getEffectiveTag()));
+        }
+    }
+
+    // stable sort and keep the last entry for each address (later entries
+    // override earlier ones)
+    stable_sort(tagTable.begin(), tagTable.end(), tagTableAddrLess);
+    n = 0;
+    for (j=0; j<tagTable.size(); j++) {
+        if (n > 0 && tagTable[n-1].first == tagTable[j].first) {
+            tagTable[n-1] = tagTable[j];
+        } else {
+            tagTable[n++] = tagTable[j];
+        }
+    }
+    tagTable.resize(n);
+    vector<pair<void*, FPReplaceEntryTag> >(tagTable).swap(tagTable);
+    tagTableValid = true;
+}
+
+bool FPConfig::loadReplaceTags(string filename)
+{
+    FPConfig tags(filename);
+    size_t i;
+
+    if (!tags.hasReplaceTagTree()) {
+        return false;
+    }
+    tags.buildReplaceTagTable();
+
+    // our own tree (and any mapped or embedded table) no longer determines
+    // the tags
+    loadMappedReplaceEntries();
+    mappedTags = NULL;
+    numMappedTags = 0;
+    tagTable.clear();
+    if (tags.mappedTags != NULL) {
+        tagTable.reserve(tags.numMappedTags);
+        for (i=0; i<tags.numMappedTags; i++) {
+            tagTable.push_back(make_pair((void*)tags.mappedTags[i].address,
+                        (FPReplaceEntryTag)tags.mappedTags[i].tag));
+        }
+    } else {
+        tagTable = tags.tagTable;
+    }
+    tagTableValid = true;
+    tagTableOverride = true;
+    return true;
 }
 
 FPReplaceEntryTag FPConfig::getReplaceTag(void *address)
 {
     FPReplaceEntryTag tag = RETAG_NONE;
-    FPReplaceEntry *ientry = instructionEntries[address];
-    if (ientry != NULL) {
-        tag = ientry->getEffectiveTag();
+    vector<pair<void*, FPReplaceEntryTag> >::const_iterator i;
+    if (mappedTags != NULL) {
+        size_t lo = 0, hi = numMappedTags, mid;
+        while (lo < hi) {
+            mid = lo + (hi-lo)/2;
+            if (mappedTags[mid].address < (uint64_t)address) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < numMappedTags && mappedTags[lo].address == (uint64_t)address) {
+            tag = (FPReplaceEntryTag)mappedTags[lo].tag;
+        }
+        return tag;
     }
-    //printf("FPConfig::getReplaceTag(%p) = %s  (ientry=%p)\n",
-            //address, (tag == RETAG_NONE ? "none" : "other"), ientry);
+    if (!tagTableValid) {
+        buildReplaceTagTable();
+    }
+    i = lower_bound(tagTable.begin(), tagTable.end(),
+            make_pair(address, RETAG_NONE), tagTableAddrLess);
+    if (i != tagTable.end() && i->first == address) {
+        tag = i->second;
+    }
+    //printf("FPConfig::getReplaceTag(%p) = %s\n",
+            //address, (tag == RETAG_NONE ? "none" : "other"));
     return tag;
 }
 
+void FPConfig::getReplaceTagTable(vector<FPConfigFileTag> &tags)
+{
+    FPConfigFileTag ft;
+    size_t i;
+    if (mappedTags != NULL) {
+        tags.assign(mappedTags, mappedTags + numMappedTags);
+        return;
+    }
+    if (!tagTableValid) {
+        buildReplaceTagTable();
+    }
+    for (i=0; i<tagTable.size(); i++) {
+        ft.address = (uint64_t)tagTable[i].first;
+        ft.tag = (uint64_t)tagTable[i].second;
+        tags.push_back(ft);
+    }
+}
+
+void FPConfig::useReplaceTagTable(FPConfigFileTag *tags, size_t count)
+{
+    // the table is not ours; drop any mapping but never free it
+    unloadBinaryFile();
+    mappedTags = tags;
+    numMappedTags = count;
+    tagTableValid = false;
+    tagTableOverride = false;
+}
+
 void FPConfig::getAllShadowEntries(vector<FPShadowEntry*> &entries)
 {
     vector<FPShadowEntry*>::iterator i;
@@ -303,6 +475,7 @@ void FPConfig::getAllShadowEntries(vector<FPShadowEntry*> &entries)
 
 void FPConfig::getAllReplaceEntries(vector<FPReplaceEntry*> &entries)
 {
+    loadMappedReplaceEntries();
     vector<FPReplaceEntry*>::iterator i;
     for (i=replaceEntries.begin(); i!=replaceEntries.end(); i++)
         entries.push_back(*i);
@@ -390,6 +563,7 @@ string FPConfig::getReplaceEntryLine(FPReplaceEntry *rentry)
 
 void FPConfig::buildFile(ostream &out)
 {
+    loadMappedReplaceEntries();
     map<string,string>::iterator i;
     for (i=settings.begin(); i!=settings.end(); i++) {
         out << i->first << "=" << i->second << endl;
@@ -418,8 +592,9 @@ void FPConfig::buildSummary(ostream &out, bool includeReplace)
     for (j=shadowEntries.begin(); j!=shadowEntries.end(); j++) {
         out << getShadowEntryLine(*j) << endl;
     }
-    out << "  " << replaceEntries.size() << " config tree entries" << endl;
+    out << "  " << getNumReplaceEntries() << " config tree entries" << endl;
     if (includeReplace) {
+        loadMappedReplaceEntries();
         vector<FPReplaceEntry*>::iterator jj;
         for (jj=replaceEntries.begin(); jj!=replaceEntries.end(); jj++) {
             out << getReplaceEntryLine(*jj) << endl;
@@ -448,4 +623,294 @@ void FPConfig::saveFile(string filename)
     fout.close();
 }
 
+// {{{ binary configuration files
+
+static uint32_t addString(string &strings, const string &str)
+{
+    uint32_t offset = (uint32_t)strings.size();
+    strings.append(str);
+    strings.push_back('\0');
+    return offset;
+}
+
+bool FPConfig::isBinaryFile(string filename)
+{
+    char magic[sizeof(CONFIG_FILE_MAGIC)];
+    bool isBinary = false;
+    FILE *fin = fopen(filename.c_str(), "rb");
+    if (fin) {
+        isBinary = (fread(magic, sizeof(magic), 1, fin) == 1 &&
+                memcmp(magic, CONFIG_FILE_MAGIC, sizeof(magic)) == 0);
+        fclose(fin);
+    }
+    return isBinary;
+}
+
+// advance a running table offset past a table of count entries, as long as the
+// whole table fits below limit
+static bool addTableSize(size_t &offset, size_t limit, uint64_t count, size_t entrySize)
+{
+    if (offset > limit || count > (uint64_t)((limit - offset) / entrySize)) {
+        return false;
+    }
+    offset += (size_t)count * entrySize;
+    return true;
+}
+
+bool FPConfig::loadBinaryFile(string filename)
+{
+    struct stat st;
+    FPConfigFileHeader *header;
+    FPConfigFileSetting *fsettings;
+    uint32_t *shadowLines;
+    size_t tablesSize, stringsSize, i;
+
+    unloadBinaryFile();
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FPConfigFileHeader)) {
+        close(fd);
+        return false;
+    }
+    mapSize = (size_t)st.st_size;
+    mapBase = (char*)mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapBase == MAP_FAILED) {
+        mapBase = NULL;
+        mapSize = 0;
+        return false;
+    }
+
+    // validate header (each table must fit in what is left of the file; the
+    // counts come straight from the file, so check before multiplying)
+    header = (FPConfigFileHeader*)mapBase;
+    tablesSize = sizeof(FPConfigFileHeader);
+    if (memcmp(header->magic, CONFIG_FILE_MAGIC, sizeof(CONFIG_FILE_MAGIC)) != 0 ||
+            header->version != CONFIG_FILE_VERSION ||
+            header->fileSize != mapSize ||
+            !addTableSize(tablesSize, mapSize, header->numSettings,
+                sizeof(FPConfigFileSetting)) ||
+            !addTableSize(tablesSize, mapSize,
+                (uint64_t)header->numShadowLines + header->numShadowLines % 2,
+                sizeof(uint32_t)) ||
+            !addTableSize(tablesSize, mapSize, header->numReplaceEntries,
+                sizeof(FPConfigFileReplaceEntry)) ||
+            !addTableSize(tablesSize, mapSize, header->numTags,
+                sizeof(FPConfigFileTag)) ||
+            header->stringsOffset != tablesSize ||
+            header->stringsOffset >= mapSize ||
+            mapBase[mapSize-1] != '\0') {
+        unloadBinaryFile();
+        return false;
+    }
+    stringsSize = mapSize - header->stringsOffset;
+
+    fsettings = (FPConfigFileSetting*)(mapBase + sizeof(FPConfigFileHeader));
+    shadowLines = (uint32_t*)(fsettings + header->numSettings);
+    mappedEntries = (FPConfigFileReplaceEntry*)(shadowLines +
+            header->numShadowLines + header->numShadowLines % 2);
+    numMappedEntries = (size_t)header->numReplaceEntries;
+    mappedTags = (FPConfigFileTag*)(mappedEntries + numMappedEntries);
+    numMappedTags = (size_t)header->numTags;
+    mappedStrings = mapBase + header->stringsOffset;
+
+    for (i=0; i<header->numSettings; i++) {
+        if (fsettings[i].key >= stringsSize || fsettings[i].value >= stringsSize) {
+            unloadBinaryFile();
+            return false;
+        }
+    }
+    for (i=0; i<header->numShadowLines; i++) {
+        if (shadowLines[i] >= stringsSize) {
+            unloadBinaryFile();
+            return false;
+        }
+    }
+    for (i=0; i<numMappedEntries; i++) {
+        if (mappedEntries[i].name >= stringsSize ||
+                mappedEntries[i].parent >= (int64_t)i) {
+            unloadBinaryFile();
+            return false;
+        }
+    }
+
+    // settings and shadow value entries are few, so just copy them
+    for (i=0; i<header->numSettings; i++) {
+        settings[string(mappedStrings + fsettings[i].key)] =
+            string(mappedStrings + fsettings[i].value);
+    }
+    for (i=0; i<header->numShadowLines; i++) {
+        addSetting(string(mappedStrings + shadowLines[i]));
+    }
+    if (numMappedEntries == 0) {
+        unloadBinaryFile();
+    }
+    return true;
+}
+
+void FPConfig::unloadBinaryFile()
+{
+    if (mapBase) {
+        munmap(mapBase, mapSize);
+    }
+    mapBase = NULL;
+    mapSize = 0;
+    mappedEntries = NULL;
+    numMappedEntries = 0;
+    mappedTags = NULL;
+    numMappedTags = 0;
+    mappedStrings = NULL;
+}
+
+void FPConfig::loadMappedReplaceEntries()
+{
+    vector<FPReplaceEntry*> entries;
+    FPReplaceEntry *entry;
+    size_t i;
+
+    if (mappedEntries == NULL) {
+        return;
+    }
+    for (i=0; i<numMappedEntries; i++) {
+        entry = new FPReplaceEntry((FPReplaceEntryType)mappedEntries[i].type,
+                (size_t)mappedEntries[i].idx);
+        entry->address = (void*)mappedEntries[i].address;
+        entry->tag = (FPReplaceEntryTag)mappedEntries[i].tag;
+        entry->name = string(mappedStrings + mappedEntries[i].name);
+        if (mappedEntries[i].parent >= 0) {
+            entry->parent = entries[(size_t)mappedEntries[i].parent];
+        }
+        switch (entry->type) {
+            case RETYPE_APP:        currentApp = entry;         break;
+            case RETYPE_MODULE:     currentModule = entry;      break;
+            case RETYPE_FUNCTION:   currentFunction = entry;    break;
+            case RETYPE_BASICBLOCK: currentBasicBlock = entry;  break;
+            default:                                            break;
+        }
+        entries.push_back(entry);
+    }
+    replaceEntries.insert(replaceEntries.begin(), entries.begin(), entries.end());
+
+    // everything has been copied out of the mapping now
+    unloadBinaryFile();
+    tagTableValid = false;
+}
+
+bool FPConfig::saveBinaryFile(string filename)
+{
+    FPConfigFileHeader header;
+    vector<FPConfigFileSetting> fsettings;
+    vector<uint32_t> shadowLines;
+    vector<FPConfigFileReplaceEntry> fentries;
+    vector<FPConfigFileTag> ftags;
+    map<FPReplaceEntry*, int64_t> entryIndex;
+    string strings, line;
+    size_t numShadowLines, i;
+
+    loadMappedReplaceEntries();
+    buildReplaceTagTable();
+
+    map<string,string>::iterator si;
+    for (si=settings.begin(); si!=settings.end(); si++) {
+        FPConfigFileSetting fs;
+        fs.key = addString(strings, si->first);
+        fs.value = addString(strings, si->second);
+        fsettings.push_back(fs);
+    }
+    vector<FPShadowEntry*>::iterator shi;
+    for (shi=shadowEntries.begin(); shi!=shadowEntries.end(); shi++) {
+        line = getShadowEntryLine(*shi);
+        line.erase(0, line.find_first_not_of(' '));
+        shadowLines.push_back(addString(strings, line));
+    }
+    for (i=0; i<replaceEntries.size(); i++) {
+        FPReplaceEntry *rentry = replaceEntries[i];
+        FPConfigFileReplaceEntry fe;
+        memset(&fe, 0, sizeof(FPConfigFileReplaceEntry));
+        fe.idx = (uint64_t)rentry->idx;
+        fe.address = (uint64_t)rentry->address;
+        fe.parent = -1;
+        if (rentry->parent && entryIndex.find(rentry->parent) != entryIndex.end()) {
+            fe.parent = entryIndex[rentry->parent];
+        }
+        fe.name = addString(strings, rentry->name);
+        fe.type = (uint8_t)rentry->type;
+        fe.tag = (uint8_t)rentry->tag;
+        fentries.push_back(fe);
+        entryIndex[rentry] = (int64_t)i;
+    }
+    getReplaceTagTable(ftags);
+    numShadowLines = shadowLines.size();
+    if (numShadowLines % 2 != 0) {
+        // keep the 64-bit tables below 8-byte aligned
+        shadowLines.push_back(0);
+    }
+    if (strings.size() == 0) {
+        strings.push_back('\0');
+    }
+
+    memset(&header, 0, sizeof(FPConfigFileHeader));
+    memcpy(header.magic, CONFIG_FILE_MAGIC, sizeof(CONFIG_FILE_MAGIC));
+    header.version = CONFIG_FILE_VERSION;
+    header.numSettings = (uint32_t)fsettings.size();
+    header.numShadowLines = (uint32_t)numShadowLines;
+    header.numReplaceEntries = fentries.size();
+    header.numTags = ftags.size();
+    header.stringsOffset = sizeof(FPConfigFileHeader) +
+        fsettings.size() * sizeof(FPConfigFileSetting) +
+        shadowLines.size() * sizeof(uint32_t) +
+        fentries.size() * sizeof(FPConfigFileReplaceEntry) +
+        ftags.size() * sizeof(FPConfigFileTag);
+    header.fileSize = header.stringsOffset + strings.size();
+
+    // write to a unique temporary file next to the target and move it into
+    // place (searches may be running mutatees that are reading the old file,
+    // or saving the same configuration concurrently)
+    string tmpPath = filename + ".XXXXXX";
+    vector<char> tmpName(tmpPath.begin(), tmpPath.end());
+    tmpName.push_back('\0');
+    int fd = mkstemp(&tmpName[0]);
+    if (fd < 0) {
+        return false;
+    }
+    tmpPath = string(&tmpName[0]);
+    fchmod(fd, 0644);
+    FILE *fout = fdopen(fd, "wb");
+    if (!fout) {
+        close(fd);
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    bool ok = (fwrite(&header, sizeof(FPConfigFileHeader), 1, fout) == 1);
+    if (ok && fsettings.size() > 0) {
+        ok = (fwrite(&fsettings[0], sizeof(FPConfigFileSetting),
+                    fsettings.size(), fout) == fsettings.size());
+    }
+    if (ok && shadowLines.size() > 0) {
+        ok = (fwrite(&shadowLines[0], sizeof(uint32_t),
+                    shadowLines.size(), fout) == shadowLines.size());
+    }
+    if (ok && fentries.size() > 0) {
+        ok = (fwrite(&fentries[0], sizeof(FPConfigFileReplaceEntry),
+                    fentries.size(), fout) == fentries.size());
+    }
+    if (ok && ftags.size() > 0) {
+        ok = (fwrite(&ftags[0], sizeof(FPConfigFileTag),
+                    ftags.size(), fout) == ftags.size());
+    }
+    if (ok) {
+        ok = (fwrite(strings.data(), 1, strings.size(), fout) == strings.size());
+    }
+    ok = (fclose(fout) == 0) && ok;
+    if (!ok || rename(tmpPath.c_str(), filename.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// }}}
+
 }
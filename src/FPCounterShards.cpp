@@ -0,0 +1,128 @@
+#include "FPCounterShards.h"
+
+#include <sys/mman.h>
+
+// per-thread shard pointers; located by binary blobs using an FS-relative
+// access, so they must use the static (initial-exec) TLS model
+__thread FPInst::FPCounterShardTLS _INST_counter_shard
+    __attribute__((tls_model("initial-exec"))) = { NULL, NULL };
+
+namespace FPInst {
+
+FPCounterShards* FPCounterShards::singletonShards = NULL;
+
+FPCounterShards* FPCounterShards::getInstance()
+{
+    if (!singletonShards) {
+        singletonShards = new FPCounterShards();
+    }
+    return singletonShards;
+}
+
+FPCounterShards::FPCounterShards()
+{
+    control = NULL;
+    numSlots = 0;
+}
+
+void* FPCounterShards::getControlAddress(BPatch_addressSpace *app, FPConfig *config)
+{
+    if (control == NULL) {
+        FPCounterShardControl empty;
+        memset(&empty, 0, sizeof(FPCounterShardControl));
+        BPatch_variableExpr *var = app->malloc(sizeof(FPCounterShardControl));
+        var->writeValue(&empty, sizeof(FPCounterShardControl), false);
+        control = (FPCounterShardControl*)var->getBaseAddr();
+
+        stringstream ss;
+        ss.clear(); ss.str("");
+        ss << hex << (void*)control;
+        config->setValue("counter_shard_control_addr", ss.str());
+    }
+    return (void*)control;
+}
+
+size_t FPCounterShards::allocateSlot(FPConfig *config)
+{
+    size_t slot = numSlots++;
+    stringstream ss;
+    ss.clear(); ss.str("");
+    ss << numSlots;
+    config->setValue("counter_shard_slots", ss.str());
+    return slot;
+}
+
+void FPCounterShards::initialize(FPConfig *config, size_t maxShards)
+{
+    stringstream ss;
+    void *addr = NULL;
+    size_t stride;
+    char *tp;
+
+    if (!config->hasValue("counter_shard_control_addr")) {
+        return;
+    }
+    ss.clear(); ss.str(config->getValue("counter_shard_control_addr"));
+    ss >> addr;
+    control = (FPCounterShardControl*)addr;
+    ss.clear(); ss.str(config->getValue("counter_shard_slots"));
+    ss >> dec >> numSlots;
+    if (control == NULL || numSlots == 0) {
+        control = NULL;
+        return;
+    }
+
+    // pad each shard out to a whole number of cache lines
+    stride = numSlots * sizeof(unsigned long);
+    stride = (stride + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+
+    // anonymous mappings are zero-filled on first touch, so only the pages of
+    // shards that are actually claimed are ever backed by memory
+    control->base = (char*)mmap(NULL, maxShards * stride, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    control->overflow = (char*)mmap(NULL, stride, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (control->base == MAP_FAILED || control->overflow == MAP_FAILED) {
+        fprintf(stderr, "OUT OF MEMORY!\n");
+        exit(-1);
+    }
+    control->next_shard = 0;
+    control->max_shards = (int64_t)maxShards;
+    control->stride = (int64_t)stride;
+
+    // this enables the blobs, so it must be done last
+    __asm__ ("mov %%fs:0, %0" : "=r" (tp));
+    control->tls_offset = (int64_t)((char*)&_INST_counter_shard - tp);
+}
+
+bool FPCounterShards::isInitialized()
+{
+    return (control != NULL && control->tls_offset != 0);
+}
+
+unsigned long FPCounterShards::getCount(size_t slot)
+{
+    unsigned long count = 0;
+    int64_t i, shards;
+    if (!isInitialized() || slot >= numSlots) {
+        return 0;
+    }
+    shards = control->next_shard;
+    if (shards > control->max_shards) {
+        shards = control->max_shards;
+    }
+    for (i = 0; i < shards; i++) {
+        count += *(unsigned long*)(control->base + i*control->stride +
+                slot*sizeof(unsigned long));
+    }
+    count += *(unsigned long*)(control->overflow + slot*sizeof(unsigned long));
+    return count;
+}
+
+size_t FPCounterShards::getNumSlots()
+{
+    return numSlots;
+}
+
+}
+
@@ -0,0 +1,476 @@
+#include "FPDecodeCache.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+namespace FPInst {
+
+static const char DECODE_CACHE_MAGIC[8] = { 'F','P','D','C','A','C','H','E' };
+
+static void appendBytes(string &data, const void *src, size_t nbytes)
+{
+    data.append((const char*)src, nbytes);
+}
+
+static int16_t findOperand(vector<FPOperand*> &operands, FPOperand *op)
+{
+    size_t i;
+    for (i=0; i<operands.size(); i++) {
+        if (operands[i] == op) {
+            return (int16_t)i;
+        }
+    }
+    operands.push_back(op);
+    return (int16_t)(operands.size()-1);
+}
+
+// {{{ binary identification
+
+static bool findBuildIdInNotes(char *notes, size_t size, string &id)
+{
+    stringstream ss;
+    size_t pos = 0, i;
+    while (pos + sizeof(Elf64_Nhdr) <= size) {
+        Elf64_Nhdr *nhdr = (Elf64_Nhdr*)(notes + pos);
+        size_t nameOff = pos + sizeof(Elf64_Nhdr);
+        size_t descOff = nameOff + ((nhdr->n_namesz + 3) & ~3);
+        size_t next    = descOff + ((nhdr->n_descsz + 3) & ~3);
+        if (next > size) {
+            break;
+        }
+        if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+                memcmp(notes + nameOff, "GNU", 4) == 0) {
+            ss.clear(); ss.str("");
+            ss << "buildid:" << hex << setfill('0');
+            for (i=0; i<nhdr->n_descsz; i++) {
+                ss << setw(2) << (unsigned)(unsigned char)notes[descOff+i];
+            }
+            id = ss.str();
+            return true;
+        }
+        pos = next;
+    }
+    return false;
+}
+
+string FPDecodeCache::computeBinaryKey(const char *path)
+{
+    struct stat st;
+    string key = "";
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return key;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return key;
+    }
+    size_t size = (size_t)st.st_size;
+    char *base = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return key;
+    }
+
+    // look for a GNU build-id note
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr*)base;
+    if (size >= sizeof(Elf64_Ehdr) && memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0 &&
+            ehdr->e_ident[EI_CLASS] == ELFCLASS64 &&
+            ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof(Elf64_Shdr) <= size) {
+        Elf64_Shdr *shdrs = (Elf64_Shdr*)(base + ehdr->e_shoff);
+        for (size_t i=0; i<ehdr->e_shnum && key == ""; i++) {
+            if (shdrs[i].sh_type == SHT_NOTE &&
+                    shdrs[i].sh_offset + shdrs[i].sh_size <= size) {
+                findBuildIdInNotes(base + shdrs[i].sh_offset,
+                        shdrs[i].sh_size, key);
+            }
+        }
+    }
+
+    // otherwise, hash the entire file (64-bit FNV-1a)
+    if (key == "") {
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i=0; i<size; i++) {
+            hash ^= (unsigned char)base[i];
+            hash *= 1099511628211ULL;
+        }
+        stringstream ss;
+        ss.clear(); ss.str("");
+        ss << "fnv:" << hex << hash << ":" << dec << size;
+        key = ss.str();
+    }
+
+    munmap(base, size);
+    return key;
+}
+
+// }}}
+
+FPDecodeCache::FPDecodeCache(string path, string key, bool writable)
+{
+    this->path = path;
+    this->key = key.substr(0, sizeof(((FPDecodeCacheHeader*)0)->key)-1);
+    this->writable = writable;
+    mapBase = NULL;
+    mapSize = 0;
+    entries = NULL;
+    numEntries = 0;
+    numHits = 0;
+    numMisses = 0;
+}
+
+FPDecodeCache::~FPDecodeCache()
+{
+    unload();
+}
+
+uint32_t FPDecodeCache::getRecordSizes()
+{
+    return (uint32_t)(sizeof(FPDecodeCacheHeader)  * 1000003 +
+                      sizeof(FPDecodeCacheEntry)   * 10007 +
+                      sizeof(FPDecodeCacheOp)      * 101 +
+                      sizeof(FPDecodeCacheOperand));
+}
+
+bool FPDecodeCache::load()
+{
+    struct stat st;
+    FPDecodeCacheHeader *header;
+
+    unload();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FPDecodeCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    mapSize = (size_t)st.st_size;
+    mapBase = (char*)mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapBase == MAP_FAILED) {
+        mapBase = NULL;
+        mapSize = 0;
+        return false;
+    }
+
+    // validate header
+    header = (FPDecodeCacheHeader*)mapBase;
+    if (memcmp(header->magic, DECODE_CACHE_MAGIC, sizeof(DECODE_CACHE_MAGIC)) != 0 ||
+            header->version != DECODE_CACHE_VERSION ||
+            header->recordSizes != getRecordSizes() ||
+            header->fileSize != mapSize ||
+            strncmp(header->key, key.c_str(), sizeof(header->key)) != 0 ||
+            sizeof(FPDecodeCacheHeader) + header->numEntries *
+                sizeof(FPDecodeCacheEntry) > mapSize) {
+        unload();
+        return false;
+    }
+    entries = (FPDecodeCacheEntry*)(mapBase + sizeof(FPDecodeCacheHeader));
+    numEntries = (size_t)header->numEntries;
+    return true;
+}
+
+void FPDecodeCache::unload()
+{
+    if (mapBase) {
+        munmap(mapBase, mapSize);
+    }
+    mapBase = NULL;
+    mapSize = 0;
+    entries = NULL;
+    numEntries = 0;
+}
+
+FPDecodeCacheEntry* FPDecodeCache::findEntry(uint64_t addr)
+{
+    size_t lo = 0, hi = numEntries, mid;
+    while (lo < hi) {
+        mid = lo + (hi-lo)/2;
+        if (entries[mid].addr < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < numEntries && entries[lo].addr == addr) {
+        return &entries[lo];
+    }
+    return NULL;
+}
+
+FPSemantics* FPDecodeCache::lookup(unsigned long iidx, void *addr,
+        unsigned char *bytes, size_t nbytes)
+{
+    FPDecodeCacheEntry *entry = findEntry((uint64_t)addr);
+    FPDecodeCacheOp *ops;
+    FPDecodeCacheOperand *oprs;
+    FPOperand **operands;
+    FPOperation *operation;
+    FPSemantics *inst;
+    size_t i, j, k;
+
+    // bytes must match exactly (and the data must be in-bounds)
+    if (entry == NULL || entry->nbytes != nbytes ||
+            memcmp(entry->bytes, bytes, nbytes) != 0 ||
+            entry->dataOffset + entry->numOps * sizeof(FPDecodeCacheOp) +
+                entry->numOperands * sizeof(FPDecodeCacheOperand) +
+                entry->asmLength > mapSize) {
+        numMisses++;
+        return NULL;
+    }
+    ops  = (FPDecodeCacheOp*)(mapBase + entry->dataOffset);
+    oprs = (FPDecodeCacheOperand*)(ops + entry->numOps);
+
+    // rebuild operands
+    operands = (FPOperand**)malloc((entry->numOperands+1) * sizeof(FPOperand*));
+    if (!operands) {
+        fprintf(stderr, "OUT OF MEMORY!\n");
+        exit(-1);
+    }
+    for (i=0; i<entry->numOperands; i++) {
+        FPOperand *op = new FPOperand();
+        op->type = (FPOperandType)oprs[i].type;
+        op->reg = (FPRegister)oprs[i].reg;
+        op->base = (FPRegister)oprs[i].base;
+        op->index = (FPRegister)oprs[i].index;
+        op->segment = (FPRegister)oprs[i].segment;
+        op->immediate = (oprs[i].immediate != 0);
+        op->inverted = (oprs[i].inverted != 0);
+        op->tag = (long)oprs[i].tag;
+        op->disp = (long)oprs[i].disp;
+        op->scale = (long)oprs[i].scale;
+        op->currentAddress = 0;
+        op->currentValue = oprs[i].value;
+        op->updateAttributes();
+        operands[i] = op;
+    }
+
+    // rebuild operations
+    inst = new FPSemantics();
+    inst->setIndex(iidx);
+    inst->setAddress(addr);
+    inst->setBytes(bytes, nbytes);
+    inst->setDisassembly(string((char*)(oprs + entry->numOperands), entry->asmLength));
+    for (i=0; i<entry->numOps; i++) {
+        operation = new FPOperation((FPOperationType)ops[i].type);
+        operation->numInputs = ops[i].numInputs;
+        operation->numOutputs = ops[i].numOutputs;
+        operation->numOpSets = ops[i].numOpSets;
+        for (j=0; j<ops[i].numInputs; j++) {
+            operation->inputs[j] = operands[ops[i].inputs[j]];
+        }
+        for (j=0; j<ops[i].numOutputs; j++) {
+            operation->outputs[j] = operands[ops[i].outputs[j]];
+        }
+        for (j=0; j<ops[i].numOpSets; j++) {
+            operation->opSets[j].nIn = ops[i].setNumIn[j];
+            operation->opSets[j].nOut = ops[i].setNumOut[j];
+            for (k=0; k<ops[i].setNumIn[j]; k++) {
+                operation->opSets[j].in[k] = operands[ops[i].setIn[j][k]];
+            }
+            for (k=0; k<ops[i].setNumOut[j]; k++) {
+                operation->opSets[j].out[k] = operands[ops[i].setOut[j][k]];
+            }
+        }
+        inst->add(operation);
+    }
+    free(operands);
+
+    numHits++;
+    return inst;
+}
+
+void FPDecodeCache::serialize(FPSemantics *inst, FPDecodeCacheEntry &entry, string &data)
+{
+    vector<FPOperand*> operands;
+    vector<FPDecodeCacheOp> ops;
+    FPDecodeCacheOperand opr;
+    FPOperation *operation;
+    size_t i, j, k;
+
+    // operations (and unique operand list)
+    for (i=0; i<inst->numOps; i++) {
+        FPDecodeCacheOp op;
+        memset(&op, 0, sizeof(FPDecodeCacheOp));
+        operation = (*inst)[i];
+        op.type = (int32_t)operation->type;
+        op.numInputs = (uint32_t)operation->numInputs;
+        op.numOutputs = (uint32_t)operation->numOutputs;
+        op.numOpSets = (uint32_t)operation->numOpSets;
+        for (j=0; j<operation->numInputs; j++) {
+            op.inputs[j] = findOperand(operands, operation->inputs[j]);
+        }
+        for (j=0; j<operation->numOutputs; j++) {
+            op.outputs[j] = findOperand(operands, operation->outputs[j]);
+        }
+        for (j=0; j<operation->numOpSets; j++) {
+            op.setNumIn[j] = (uint32_t)operation->opSets[j].nIn;
+            op.setNumOut[j] = (uint32_t)operation->opSets[j].nOut;
+            for (k=0; k<operation->opSets[j].nIn; k++) {
+                op.setIn[j][k] = findOperand(operands, operation->opSets[j].in[k]);
+            }
+            for (k=0; k<operation->opSets[j].nOut; k++) {
+                op.setOut[j][k] = findOperand(operands, operation->opSets[j].out[k]);
+            }
+        }
+        ops.push_back(op);
+    }
+
+    data.clear();
+    for (i=0; i<ops.size(); i++) {
+        appendBytes(data, &ops[i], sizeof(FPDecodeCacheOp));
+    }
+    for (i=0; i<operands.size(); i++) {
+        memset(&opr, 0, sizeof(FPDecodeCacheOperand));
+        opr.type = (int32_t)operands[i]->type;
+        opr.reg = (int32_t)operands[i]->reg;
+        opr.base = (int32_t)operands[i]->base;
+        opr.index = (int32_t)operands[i]->index;
+        opr.segment = (int32_t)operands[i]->segment;
+        opr.immediate = operands[i]->immediate ? 1 : 0;
+        opr.inverted = operands[i]->inverted ? 1 : 0;
+        opr.tag = (int64_t)operands[i]->tag;
+        opr.disp = (int64_t)operands[i]->disp;
+        opr.scale = (int64_t)operands[i]->scale;
+        opr.value = operands[i]->currentValue;
+        appendBytes(data, &opr, sizeof(FPDecodeCacheOperand));
+    }
+    string assembly = inst->getDisassembly();
+    data.append(assembly);
+
+    memset(&entry, 0, sizeof(FPDecodeCacheEntry));
+    entry.addr = (uint64_t)inst->getAddress();
+    entry.numOps = (uint32_t)ops.size();
+    entry.numOperands = (uint32_t)operands.size();
+    entry.asmLength = (uint32_t)assembly.size();
+    entry.nbytes = (uint8_t)inst->getNumBytes();
+    inst->getBytes(entry.bytes);
+}
+
+void FPDecodeCache::add(FPSemantics *inst)
+{
+    if (!writable || inst == NULL || inst->getNumBytes() > sizeof(entries->bytes)) {
+        return;
+    }
+    FPDecodeCacheEntry entry;
+    string data;
+    serialize(inst, entry, data);
+    pending[entry.addr] = make_pair(entry, data);
+}
+
+bool FPDecodeCache::isModified()
+{
+    return !pending.empty();
+}
+
+bool FPDecodeCache::save()
+{
+    FPDecodeCacheHeader header;
+    vector<FPDecodeCacheEntry> allEntries;
+    string data;
+    map<uint64_t, pair<FPDecodeCacheEntry, string> >::iterator p;
+    size_t i, dataStart;
+
+    if (!writable || pending.empty()) {
+        return true;
+    }
+
+    // merge existing and new entries (new entries take precedence), keeping
+    // them sorted by address
+    for (i=0; i<numEntries; i++) {
+        if (pending.find(entries[i].addr) == pending.end()) {
+            FPDecodeCacheEntry entry = entries[i];
+            size_t len = entry.numOps * sizeof(FPDecodeCacheOp) +
+                         entry.numOperands * sizeof(FPDecodeCacheOperand) +
+                         entry.asmLength;
+            if (entry.dataOffset + len > mapSize) {
+                continue;
+            }
+            pending[entry.addr] = make_pair(entry,
+                    string(mapBase + entry.dataOffset, len));
+        }
+    }
+    dataStart = sizeof(FPDecodeCacheHeader) + pending.size() * sizeof(FPDecodeCacheEntry);
+    for (p = pending.begin(); p != pending.end(); p++) {
+        FPDecodeCacheEntry entry = p->second.first;
+        while ((dataStart + data.size()) % 16 != 0) {
+            data.push_back('\0');
+        }
+        entry.dataOffset = dataStart + data.size();
+        data.append(p->second.second);
+        allEntries.push_back(entry);
+    }
+
+    memset(&header, 0, sizeof(FPDecodeCacheHeader));
+    memcpy(header.magic, DECODE_CACHE_MAGIC, sizeof(DECODE_CACHE_MAGIC));
+    header.version = DECODE_CACHE_VERSION;
+    header.recordSizes = getRecordSizes();
+    strncpy(header.key, key.c_str(), sizeof(header.key)-1);
+    header.numEntries = allEntries.size();
+    header.fileSize = dataStart + data.size();
+
+    // write to a unique temporary file next to the cache and move it into
+    // place (concurrent fpinst runs may be saving the same cache)
+    string tmpPath = path + ".XXXXXX";
+    vector<char> tmpName(tmpPath.begin(), tmpPath.end());
+    tmpName.push_back('\0');
+    int fd = mkstemp(&tmpName[0]);
+    if (fd < 0) {
+        return false;
+    }
+    tmpPath = string(&tmpName[0]);
+    fchmod(fd, 0644);
+    FILE *fout = fdopen(fd, "wb");
+    if (!fout) {
+        close(fd);
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    bool ok = (fwrite(&header, sizeof(FPDecodeCacheHeader), 1, fout) == 1);
+    if (ok && allEntries.size() > 0) {
+        ok = (fwrite(&allEntries[0], sizeof(FPDecodeCacheEntry),
+                    allEntries.size(), fout) == allEntries.size());
+    }
+    if (ok && data.size() > 0) {
+        ok = (fwrite(data.data(), 1, data.size(), fout) == data.size());
+    }
+    ok = (fclose(fout) == 0) && ok;
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    pending.clear();
+    load();
+    return true;
+}
+
+string FPDecodeCache::getPath()
+{
+    return path;
+}
+
+string FPDecodeCache::getKey()
+{
+    return key;
+}
+
+size_t FPDecodeCache::getNumHits()
+{
+    return numHits;
+}
+
+size_t FPDecodeCache::getNumMisses()
+{
+    return numMisses;
+}
+
+}
+
@@ -1,5 +1,8 @@
 #include "FPDecoderXED.h"
 
+#include <algorithm>
+#include <pthread.h>
+
 namespace FPInst {
 
 xed_state_t dstate;
@@ -22,6 +25,13 @@ FPDecoderXED::FPDecoderXED()
     // initialize decoded instruction cache
     instCacheSize = 0;
     instCacheArray = NULL;
+    deferredArray = NULL;
+    numDecoded = 0;
+    decodeCallback = NULL;
+    cache = NULL;
+    deferredLock = 0;
+    addrIndexSorted = true;
+    addrIndexBuilt = false;
     expandInstCache(2000);
 }
 
@@ -33,6 +43,9 @@ FPDecoderXED::~FPDecoderXED()
             delete instCacheArray[i];
     }
     delete instCacheArray;
+    if (deferredArray) {
+        free(deferredArray);
+    }
 }
 
 string FPDecoderXED::Bytes2Str(unsigned char *bytes, size_t nbytes)
@@ -122,25 +135,34 @@ FPRegister FPDecoderXED::xedReg2FPReg(xed_reg_enum_t reg)
 
 void FPDecoderXED::expandInstCache(size_t newSize) {
     FPSemantics **instCacheTemp;
+    FPDeferredInst *deferredTemp;
     unsigned i = 0;
     newSize = newSize > instCacheSize*2 ? newSize : instCacheSize*2;
     //printf("expand_inst_cache - old size: %d    new size: %d\n", instCacheSize, newSize);
     instCacheTemp = (FPSemantics**)malloc(newSize * sizeof(FPSemantics*));
-    if (!instCacheTemp) {
+    deferredTemp = (FPDeferredInst*)malloc(newSize * sizeof(FPDeferredInst));
+    if (!instCacheTemp || !deferredTemp) {
         fprintf(stderr, "OUT OF MEMORY!\n");
         exit(-1);
     }
     if (instCacheArray != NULL) {
         for (; i < instCacheSize; i++) {
             instCacheTemp[i] = instCacheArray[i];
+            deferredTemp[i] = deferredArray[i];
         }
         free(instCacheArray);
+        free(deferredArray);
         instCacheArray = NULL;
+        deferredArray = NULL;
     }
     for (; i < newSize; i++) {
         instCacheTemp[i] = NULL;
+        deferredTemp[i].addr = NULL;
+        deferredTemp[i].bytes = NULL;
+        deferredTemp[i].nbytes = 0;
     }
     instCacheArray = instCacheTemp;
+    deferredArray = deferredTemp;
     instCacheSize = newSize;
 }
 
@@ -196,34 +218,255 @@ FPSemantics* FPDecoderXED::decode(unsigned long iidx, void *addr, unsigned char
     FPSemantics *inst;
     if (instCacheSize <= iidx) {
         expandInstCache(iidx >= instCacheSize*2 ? iidx+1 : instCacheSize*2);
-        inst = build(iidx, addr, bytes, nbytes);
+        inst = buildCached(iidx, addr, bytes, nbytes);
         instCacheArray[iidx] = inst;
-        iidxByAddr[addr] = iidx;
+        addAddress(addr, iidx);
+        numDecoded++;
     } else {
         inst = instCacheArray[iidx];
         if (inst == NULL) {
-            inst = build(iidx, addr, bytes, nbytes);
+            inst = buildCached(iidx, addr, bytes, nbytes);
             instCacheArray[iidx] = inst;
-            iidxByAddr[addr] = iidx;
+            addAddress(addr, iidx);
+            numDecoded++;
         }
     }
     return inst;
 }
 
-FPSemantics* FPDecoderXED::lookup(unsigned long iidx)
+void FPDecoderXED::defer(unsigned long iidx, void *addr, unsigned char *bytes, size_t nbytes)
 {
-    return (iidx < instCacheSize) ? instCacheArray[iidx] : NULL;
+    if (instCacheSize <= iidx) {
+        expandInstCache(iidx >= instCacheSize*2 ? iidx+1 : instCacheSize*2);
+    }
+    if (instCacheArray[iidx] == NULL) {
+        deferredArray[iidx].addr = addr;
+        deferredArray[iidx].bytes = bytes;
+        deferredArray[iidx].nbytes = nbytes;
+        addAddress(addr, iidx);
+    }
 }
 
-FPSemantics* FPDecoderXED::lookupByAddr(void* addr)
+struct FPDecodeBatch {
+    FPDecoderXED *decoder;
+    vector<unsigned long> *pending;
+    volatile size_t next;
+};
+
+void* FPDecoderXED::decodeWorker(void *arg)
+{
+    FPDecodeBatch *batch = (FPDecodeBatch*)arg;
+    FPDecoderXED *decoder = batch->decoder;
+    size_t n = batch->pending->size();
+    size_t i;
+    unsigned long iidx;
+
+    // each slot is written by exactly one worker; build() only reads shared
+    // decoder state
+    while ((i = __sync_fetch_and_add(&batch->next, 1)) < n) {
+        iidx = batch->pending->at(i);
+        decoder->instCacheArray[iidx] = decoder->build(iidx,
+                decoder->deferredArray[iidx].addr,
+                decoder->deferredArray[iidx].bytes,
+                decoder->deferredArray[iidx].nbytes);
+    }
+    return NULL;
+}
+
+void FPDecoderXED::decodeDeferred(unsigned nthreads)
+{
+    vector<unsigned long> deferred;
+    vector<unsigned long> pending;
+    vector<pthread_t> workers;
+    FPDecodeBatch batch;
+    FPSemantics *inst;
+    pthread_t tid;
+    unsigned long iidx;
+    size_t i;
+
+    // gather deferred instructions and consult the decode cache (serially)
+    for (iidx = 0; iidx < instCacheSize; iidx++) {
+        if (instCacheArray[iidx] != NULL || deferredArray[iidx].bytes == NULL) {
+            continue;
+        }
+        deferred.push_back(iidx);
+        inst = NULL;
+        if (cache) {
+            inst = cache->lookup(iidx, deferredArray[iidx].addr,
+                    deferredArray[iidx].bytes, deferredArray[iidx].nbytes);
+        }
+        if (inst) {
+            instCacheArray[iidx] = inst;
+        } else {
+            pending.push_back(iidx);
+        }
+    }
+
+    // decode everything else in parallel (the calling thread helps out)
+    batch.decoder = this;
+    batch.pending = &pending;
+    batch.next = 0;
+    if (nthreads > pending.size()) {
+        nthreads = (unsigned)pending.size();
+    }
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&tid, NULL, decodeWorker, &batch) != 0) {
+            break;
+        }
+        workers.push_back(tid);
+    }
+    decodeWorker(&batch);
+    for (i = 0; i < workers.size(); i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // bookkeeping in index order so results don't depend on scheduling
+    if (cache) {
+        for (i = 0; i < pending.size(); i++) {
+            cache->add(instCacheArray[pending[i]]);
+        }
+    }
+    for (i = 0; i < deferred.size(); i++) {
+        iidx = deferred[i];
+        numDecoded++;
+        deferredArray[iidx].addr = NULL;
+        deferredArray[iidx].bytes = NULL;
+        deferredArray[iidx].nbytes = 0;
+        if (decodeCallback) {
+            decodeCallback(instCacheArray[iidx]);
+        }
+    }
+}
+
+void FPDecoderXED::setDecodeCallback(FPDecodeCallback callback)
+{
+    decodeCallback = callback;
+}
+
+size_t FPDecoderXED::getNumDecoded()
+{
+    return numDecoded;
+}
+
+void FPDecoderXED::setCache(FPDecodeCache *cache)
+{
+    this->cache = cache;
+}
+
+FPDecodeCache* FPDecoderXED::getCache()
+{
+    return cache;
+}
+
+FPSemantics* FPDecoderXED::buildCached(unsigned long index, void *addr, unsigned char *bytes, size_t nbytes)
 {
     FPSemantics *inst = NULL;
-    if (iidxByAddr.find(addr) != iidxByAddr.end()) {
-        inst = lookup(iidxByAddr[addr]);
+    if (cache) {
+        inst = cache->lookup(index, addr, bytes, nbytes);
+    }
+    if (inst == NULL) {
+        inst = build(index, addr, bytes, nbytes);
+        if (cache) {
+            cache->add(inst);
+        }
     }
     return inst;
 }
 
+FPSemantics* FPDecoderXED::lookup(unsigned long iidx)
+{
+    FPSemantics *inst;
+    if (iidx >= instCacheSize) {
+        return NULL;
+    }
+    inst = instCacheArray[iidx];
+    if (inst == NULL && deferredArray[iidx].bytes != NULL) {
+
+        // first execution of a deferred instruction; decode it now (other
+        // threads may be trying to do the same thing)
+        while (__sync_lock_test_and_set(&deferredLock, 1)) { }
+        inst = instCacheArray[iidx];
+        if (inst == NULL) {
+            inst = buildCached(iidx, deferredArray[iidx].addr,
+                    deferredArray[iidx].bytes, deferredArray[iidx].nbytes);
+            numDecoded++;
+            if (decodeCallback) {
+                decodeCallback(inst);
+            }
+            __sync_synchronize();
+            instCacheArray[iidx] = inst;
+        }
+        __sync_lock_release(&deferredLock);
+    }
+    return inst;
+}
+
+static bool addrIndexLess(const pair<void*, unsigned long> &a,
+                          const pair<void*, unsigned long> &b)
+{
+    return a.first < b.first;
+}
+
+void FPDecoderXED::addAddress(void *addr, unsigned long iidx)
+{
+    vector<pair<void*, unsigned long> >::iterator it;
+
+    // once the index has been built, keep it sorted by inserting in place
+    // (later entries replace earlier ones for the same address) instead of
+    // forcing a full re-sort on the next lookup
+    if (addrIndexBuilt && addrIndexSorted) {
+        it = lower_bound(addrIndex.begin(), addrIndex.end(),
+                make_pair(addr, 0UL), addrIndexLess);
+        if (it != addrIndex.end() && it->first == addr) {
+            it->second = iidx;
+        } else {
+            addrIndex.insert(it, make_pair(addr, iidx));
+        }
+        return;
+    }
+
+    if (!addrIndex.empty() && addr <= addrIndex.back().first) {
+        addrIndexSorted = false;
+    }
+    addrIndex.push_back(make_pair(addr, iidx));
+}
+
+void FPDecoderXED::buildAddressIndex()
+{
+    size_t i, n;
+    if (addrIndexSorted) {
+        return;
+    }
+
+    // stable sort, then keep only the most recent entry for each address
+    stable_sort(addrIndex.begin(), addrIndex.end(), addrIndexLess);
+    n = 0;
+    for (i = 0; i < addrIndex.size(); i++) {
+        if (n > 0 && addrIndex[n-1].first == addrIndex[i].first) {
+            addrIndex[n-1] = addrIndex[i];
+        } else {
+            addrIndex[n++] = addrIndex[i];
+        }
+    }
+    addrIndex.resize(n);
+    addrIndexSorted = true;
+    addrIndexBuilt = true;
+}
+
+FPSemantics* FPDecoderXED::lookupByAddr(void* addr)
+{
+    vector<pair<void*, unsigned long> >::iterator it;
+    if (!addrIndexSorted) {
+        buildAddressIndex();
+    }
+    it = lower_bound(addrIndex.begin(), addrIndex.end(),
+            make_pair(addr, 0UL), addrIndexLess);
+    if (it != addrIndex.end() && it->first == addr) {
+        return lookup(it->second);
+    }
+    return NULL;
+}
+
 FPSemantics* FPDecoderXED::build(unsigned long index, void *addr, unsigned char *bytes, size_t nbytes)
 {
     // {{{ decoder data
@@ -16,22 +16,228 @@ string FPLog::msgType2Str(FPLogMsgType type)
     }
 }
 
+FPLogWriteMode FPLog::str2WriteMode(string mode)
+{
+    if (mode == "crashsafe") {
+        return LOG_CRASHSAFE;
+    } else if (mode == "thread") {
+        return LOG_BUFFERED_THREAD;
+    } else {
+        return LOG_BUFFERED;
+    }
+}
+
 FPLog::FPLog(string filename)
 {
     logfile.open(filename.c_str(), ios::out);
-    logfile << "<log>" << endl;
+    buffer << "<log>\n";
     fileOpen = true;
+    format = LOG_XML;
+    numMessages = 0;
+    dataWritten = false;
+    binOffset = 0;
+    nextTraceId = 1;
+    writeMode = LOG_BUFFERED;
+    writerRunning = false;
+    writerStop = false;
+    initLock();
+    pthread_mutex_init(&writerLock, NULL);
+    pthread_cond_init(&writerCond, NULL);
     stwalk_enabled = false;
     debug_symtab = NULL;
+    funcRangesLoaded = false;
+    lastLine = lineRanges.end();
+    traceMaxPerInst = DEFAULT_TRACE_MAX_PER_INST;
+    traceSampleRate = DEFAULT_TRACE_SAMPLE_RATE;
+    traceRandState = 88172645463325252ULL;
 }
 
 FPLog::FPLog(string filename, string appname)
 {
     logfile.open(filename.c_str(), ios::out);
-    logfile << "<log appname=\"" << appname << "\">" << endl;
+    buffer << "<log appname=\"" << appname << "\">\n";
+    this->appname = appname;
     fileOpen = true;
+    format = LOG_XML;
+    numMessages = 0;
+    dataWritten = false;
+    binOffset = 0;
+    nextTraceId = 1;
+    writeMode = LOG_BUFFERED;
+    writerRunning = false;
+    writerStop = false;
+    initLock();
+    pthread_mutex_init(&writerLock, NULL);
+    pthread_cond_init(&writerCond, NULL);
     stwalk_enabled = false;
     debug_symtab = NULL;
+    funcRangesLoaded = false;
+    lastLine = lineRanges.end();
+    traceMaxPerInst = DEFAULT_TRACE_MAX_PER_INST;
+    traceSampleRate = DEFAULT_TRACE_SAMPLE_RATE;
+    traceRandState = 88172645463325252ULL;
+}
+
+void FPLog::initLock()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&logLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void FPLog::setWriteMode(FPLogWriteMode mode)
+{
+    if (!fileOpen || mode == writeMode) return;
+    if (writeMode == LOG_BUFFERED_THREAD) {
+        stopWriterThread();
+    }
+    writeMode = mode;
+    if (writeMode == LOG_BUFFERED_THREAD) {
+        writerStop = false;
+        if (pthread_create(&writerThread, NULL, writerThreadMain, this) == 0) {
+            writerRunning = true;
+        } else {
+            writeMode = LOG_BUFFERED;
+        }
+    }
+    if (writeMode == LOG_CRASHSAFE) {
+        flush();
+    }
+}
+
+FPLogWriteMode FPLog::getWriteMode()
+{
+    return writeMode;
+}
+
+void FPLog::setFormat(FPLogFormat fmt)
+{
+    // the format can only be changed before anything is logged
+    if (!fileOpen || fmt == format || numMessages > 0 || dataWritten) return;
+    format = fmt;
+
+    // the buffer only contains the opening tag; replace it with a
+    // placeholder header (see close())
+    writeHeader();
+}
+
+void FPLog::writeHeader()
+{
+    buffer.clear(); buffer.str("");
+    if (format == LOG_BINARY) {
+        FPLogBinaryHeader header;
+        memset(&header, 0, sizeof(FPLogBinaryHeader));
+        memcpy(header.magic, FP_LOG_BINARY_MAGIC, sizeof(header.magic));
+        header.version = FP_LOG_BINARY_VERSION;
+        header.recordsOffset = sizeof(FPLogBinaryHeader);
+        buffer.write((const char*)&header, sizeof(FPLogBinaryHeader));
+        binOffset = sizeof(FPLogBinaryHeader);
+        binStringIds.clear();
+    } else if (appname != "") {
+        buffer << "<log appname=\"" << appname << "\">\n";
+    } else {
+        buffer << "<log>\n";
+    }
+}
+
+FPLogFormat FPLog::getFormat()
+{
+    return format;
+}
+
+void FPLog::reopen(string filename)
+{
+    // only meant for a freshly forked child (see _INST_enable_analysis); the
+    // parent must have flushed everything and stopped the writer thread, so
+    // closing our copy of the stream writes nothing to the parent's log
+    if (!fileOpen || writerRunning) return;
+    pthread_mutex_lock(&logLock);
+    logfile.close();
+    logfile.clear();
+    logfile.open(filename.c_str(), ios::out);
+
+    // start over with an empty log in the same format
+    numMessages = 0;
+    dataWritten = false;
+    binStringIds.clear();
+    traces.clear();
+    rawTraceIndex.clear();
+    rawTraces.clear();
+    nextTraceId = 1;
+    traceCounts.clear();
+    instructions.clear();
+    writeHeader();
+    pthread_mutex_unlock(&logLock);
+}
+
+void* FPLog::writerThreadMain(void *arg)
+{
+    FPLog *log = (FPLog*)arg;
+    string data;
+    bool done = false;
+    while (!done) {
+        pthread_mutex_lock(&log->writerLock);
+        while (log->writerPending.length() == 0 && !log->writerStop) {
+            pthread_cond_wait(&log->writerCond, &log->writerLock);
+        }
+        data.swap(log->writerPending);
+        done = log->writerStop;
+        pthread_mutex_unlock(&log->writerLock);
+        if (data.length() > 0) {
+            log->logfile.write(data.data(), data.length());
+            data.clear();
+        }
+    }
+    return NULL;
+}
+
+void FPLog::stopWriterThread()
+{
+    if (!writerRunning) return;
+    pthread_mutex_lock(&writerLock);
+    writerStop = true;
+    pthread_cond_signal(&writerCond);
+    pthread_mutex_unlock(&writerLock);
+    pthread_join(writerThread, NULL);
+    writerRunning = false;
+}
+
+void FPLog::writeBuffer()
+{
+    string data = buffer.str();
+    buffer.clear(); buffer.str("");
+    if (data.length() == 0) return;
+    dataWritten = true;
+    if (writerRunning) {
+        pthread_mutex_lock(&writerLock);
+        writerPending.append(data);
+        pthread_cond_signal(&writerCond);
+        pthread_mutex_unlock(&writerLock);
+    } else {
+        logfile.write(data.data(), data.length());
+    }
+}
+
+void FPLog::messageFinished()
+{
+    if (writeMode == LOG_CRASHSAFE) {
+        flush();
+    } else if ((size_t)buffer.tellp() >= LOG_BUFFER_SIZE) {
+        writeBuffer();
+    }
+}
+
+void FPLog::flush()
+{
+    if (!fileOpen) return;
+    pthread_mutex_lock(&logLock);
+    writeBuffer();
+    if (!writerRunning) {
+        logfile.flush();
+    }
+    pthread_mutex_unlock(&logLock);
 }
 
 void FPLog::enableStackWalks()
@@ -59,87 +265,328 @@ bool FPLog::isStackWalkingEnabled()
 void FPLog::setDebugFile(string filename)
 {
     Symtab::openFile(debug_symtab, filename);
+    funcRanges.clear();
+    funcRangesLoaded = false;
+    lineRanges.clear();
+    lastLine = lineRanges.end();
 }
 
-void FPLog::addMessage(FPLogMsgType type, long priority, 
-        string label, string details, string trace, FPSemantics *inst)
+void FPLog::loadFunctionRanges()
 {
-    if (!fileOpen) return;
+    vector<Function*> funcs;
+    vector<Function*>::iterator f;
 
-    long tid;
-    long timestamp = (long)clock();
+    funcRangesLoaded = true;
+    if (!debug_symtab || !debug_symtab->getAllFunctions(funcs)) {
+        return;
+    }
+    for (f = funcs.begin(); f != funcs.end(); f++) {
+        FPLogSourceRange range;
+        range.start = (*f)->getOffset();
+        range.end = range.start + (*f)->getSize();
+        range.line = -1;
+        Aggregate::name_iter it = (*f)->pretty_names_begin();
+        if (range.end > range.start && it != (*f)->pretty_names_end()) {
+            range.name = sanitize(*it);
+            funcRanges.push_back(range);
+        }
+    }
+    stable_sort(funcRanges.begin(), funcRanges.end());
+}
 
-    logfile << "<message time=\"" << timestamp;
-    logfile << "\" priority=\"" << priority;
-    logfile << "\" type=\"" << msgType2Str(type) << "\">" << endl;
+string FPLog::lookupFunction(Offset addr)
+{
+    vector<FPLogSourceRange>::iterator r;
+    FPLogSourceRange key;
+    string name = "";
 
-    if (label.length() > 0)
-        logfile << "<label>" << label << "</label>" << endl;
+    if (!debug_symtab) {
+        return name;
+    }
+    if (!funcRangesLoaded) {
+        loadFunctionRanges();
+    }
 
-    if (details.length() > 0)
-        logfile << "<details>" << details << "</details>" << endl;
+    // last function starting at or before the address
+    key.start = addr;
+    r = upper_bound(funcRanges.begin(), funcRanges.end(), key);
+    if (r != funcRanges.begin() && addr < (r-1)->end) {
+        return (r-1)->name;
+    }
+
+    // not covered by the table (e.g., zero-sized symbols); ask Symtab
+    Function *func = NULL;
+    debug_symtab->getContainingFunction(addr, func);
+    if (func) {
+        Aggregate::name_iter it = func->pretty_names_begin();
+        if (it != func->pretty_names_end()) {
+            name = sanitize(*it);
+        }
+    }
+    return name;
+}
+
+bool FPLog::lookupSourceLine(Offset addr, string &file, long &line)
+{
+    map<Offset, FPLogSourceRange>::iterator r;
+
+    if (!debug_symtab) {
+        return false;
+    }
 
+    // callers usually ask for increasing addresses, so check the last range
+    // (and the one after it) before searching
+    r = lastLine;
+    if (r != lineRanges.end() && addr >= r->second.start && addr >= r->second.end) {
+        r++;
+    }
+    if (r == lineRanges.end() || addr < r->second.start || addr >= r->second.end) {
+        r = lineRanges.upper_bound(addr);
+        if (r != lineRanges.begin()) {
+            r--;
+        }
+    }
+    if (r != lineRanges.end() && addr >= r->second.start && addr < r->second.end) {
+        lastLine = r;
+        file = r->second.name;
+        line = r->second.line;
+        return true;
+    }
+
+    stwalk_lines.clear();
+    debug_symtab->getSourceLines(stwalk_lines, addr);
+    if (stwalk_lines.size() == 0) {
+        return false;
+    }
+    file = stwalk_lines[0]->getFile();
+    line = (long)stwalk_lines[0]->getLine();
+    if (stwalk_lines[0]->startAddr() <= addr && addr < stwalk_lines[0]->endAddr()) {
+        FPLogSourceRange range;
+        range.start = stwalk_lines[0]->startAddr();
+        range.end = stwalk_lines[0]->endAddr();
+        range.name = file;
+        range.line = line;
+        lastLine = lineRanges.insert(make_pair(range.start, range)).first;
+    }
+    return true;
+}
+
+long FPLog::addTrace(const string &trace)
+{
+    long tid = 0;
     if (trace.length() > 0) {
         map<string, unsigned>::iterator i = traces.find(trace);
         if (i == traces.end()) {
-            tid = traces.size()+1;
+            tid = nextTraceId++;
             traces[trace] = tid;
         } else {
             tid = i->second;
         }
-        logfile << "<trace_id>" << tid << "</trace_id>" << endl;
     }
+    return tid;
+}
+
+void FPLog::addMessage(FPLogMsgType type, long priority, 
+        const string &label, const string &details, const string &trace,
+        FPSemantics *inst)
+{
+    if (!fileOpen) return;
+    pthread_mutex_lock(&logLock);
+    addMessage(type, priority, label, details, addTrace(trace), inst);
+    pthread_mutex_unlock(&logLock);
+}
+
+void FPLog::addMessage(FPLogMsgType type, long priority, 
+        const string &label, const string &details, long tid,
+        FPSemantics *inst)
+{
+    if (!fileOpen) return;
+    pthread_mutex_lock(&logLock);
+
+    long timestamp = (long)clock();
 
     if (inst != NULL) {
         instructions[inst] = inst->getIndex();
-        logfile << "<inst_id>" << inst->getIndex() << "</inst_id>" << endl;
     }
 
-    logfile << "</message>" << endl;
+    if (format == LOG_BINARY) {
+        FPLogBinaryMessage msg;
+        msg.time = timestamp;
+        msg.priority = priority;
+        msg.label = internString(label);
+        msg.details = addString(details);
+        msg.inst = (inst != NULL ? (int64_t)inst->getIndex() : -1);
+        msg.type = (uint32_t)type;
+        msg.trace = (uint32_t)tid;
+        writeRecord(FP_LOG_RECORD_MESSAGE, &msg, sizeof(FPLogBinaryMessage));
+        numMessages++;
+        messageFinished();
+        pthread_mutex_unlock(&logLock);
+        return;
+    }
+
+    buffer << "<message time=\"" << timestamp;
+    buffer << "\" priority=\"" << priority;
+    buffer << "\" type=\"" << msgType2Str(type) << "\">\n";
+
+    if (label.length() > 0)
+        buffer << "<label>" << label << "</label>\n";
+
+    if (details.length() > 0)
+        buffer << "<details>" << details << "</details>\n";
+
+    if (tid > 0)
+        buffer << "<trace_id>" << tid << "</trace_id>\n";
+
+    if (inst != NULL)
+        buffer << "<inst_id>" << inst->getIndex() << "</inst_id>\n";
+
+    buffer << "</message>\n";
+    numMessages++;
+    messageFinished();
+    pthread_mutex_unlock(&logLock);
+}
+
+long FPLog::getStackTraceId(unsigned skipFrames)
+{
+    FPLogRawTrace trace;
+    multimap<uint64_t, size_t>::iterator i;
+    pair<multimap<uint64_t, size_t>::iterator,
+         multimap<uint64_t, size_t>::iterator> range;
+    uint64_t hash = 14695981039346656037ULL;
+    unsigned f;
+    size_t b;
+    long id = 0;
+
+    if (!stwalk_enabled) {
+        return 0;
+    }
+    pthread_mutex_lock(&logLock);
+    stackwalk.clear();
+    walker->walkStack(stackwalk);
+    for (f=skipFrames; f < stackwalk.size(); f++) {
+        Address ra = stackwalk[f].getRA();
+        trace.addrs.push_back(ra);
+        for (b=0; b < sizeof(Address); b++) {
+            hash ^= (uint64_t)((ra >> (b*8)) & 0xff);
+            hash *= 1099511628211ULL;
+        }
+    }
+    if (trace.addrs.size() > 0) {
+
+        // look for an existing trace with the same frames
+        range = rawTraceIndex.equal_range(hash);
+        for (i = range.first; i != range.second && id == 0; i++) {
+            if (rawTraces[i->second].addrs == trace.addrs) {
+                id = rawTraces[i->second].id;
+            }
+        }
+
+        // new trace; keep the frames so that it can be symbolized later
+        if (id == 0) {
+            trace.id = nextTraceId++;
+            trace.frames.assign(stackwalk.begin() + skipFrames, stackwalk.end());
+            rawTraceIndex.insert(make_pair(hash, rawTraces.size()));
+            rawTraces.push_back(trace);
+            id = trace.id;
+        }
+    }
+    pthread_mutex_unlock(&logLock);
+    return id;
+}
+
+void FPLog::setTraceSampling(unsigned long maxPerInst, double rate)
+{
+    traceMaxPerInst = maxPerInst;
+    traceSampleRate = rate;
+}
+
+long FPLog::getStackTraceId(FPSemantics *inst, unsigned skipFrames)
+{
+    unsigned long idx;
+
+    if (!stwalk_enabled) {
+        return 0;
+    }
+    if (inst != NULL) {
+        bool skip = false;
+        idx = inst->getIndex();
+        pthread_mutex_lock(&logLock);
+        if (idx >= traceCounts.size()) {
+            traceCounts.resize(idx+1, 0);
+        }
+        if (traceCounts[idx]++ >= traceMaxPerInst) {
+            traceRandState ^= traceRandState << 13;
+            traceRandState ^= traceRandState >> 7;
+            traceRandState ^= traceRandState << 17;
+            if ((double)(traceRandState >> 11) * (1.0/9007199254740992.0) >= traceSampleRate) {
+                skip = true;
+            }
+        }
+        pthread_mutex_unlock(&logLock);
+        if (skip) {
+            return 0;
+        }
+    }
+    // (one more frame to skip for this call)
+    return getStackTraceId(skipFrames+1);
 }
 
 string FPLog::getStackTrace(unsigned skipFrames)
+{
+    vector<Frame> frames;
+
+    string text;
+
+    if (!stwalk_enabled) {
+        return "";
+    }
+    pthread_mutex_lock(&logLock);
+    stackwalk.clear();
+    walker->walkStack(stackwalk); 
+    if (stackwalk.size() > skipFrames) {
+        frames.assign(stackwalk.begin() + skipFrames, stackwalk.end());
+    }
+    text = symbolizeFrames(frames);
+    pthread_mutex_unlock(&logLock);
+    return text;
+}
+
+string FPLog::symbolizeFrames(vector<Frame> &frames)
 {
     stringstream ss;
     void *ptr;
     ss.clear();
     ss.str("");
 
-    if (stwalk_enabled) {
-        stackwalk.clear();
-        walker->walkStack(stackwalk); 
-        for (unsigned i=0; i < stackwalk.size(); i++) { 
-            // skip first few frames
-            if (i >= skipFrames) {
-                stackwalk[i].getName(stwalk_func); 
-                stackwalk[i].getLibOffset(stwalk_lib, stwalk_offset, ptr); 
-                ss << "<frame level=\"" << i-skipFrames << "\" address=\"0x";
-                if (stwalk_func == "") {
-                    Function *func;
-                    debug_symtab->getContainingFunction((Offset)stwalk_offset, func);
-                    if (func) {
-                        Aggregate::name_iter it = func->pretty_names_begin();
-                        if (it != func->pretty_names_end()) {
-                            ss << " function=\"" << sanitize(*it) << "\"";
-                        }
-                    }
-                } else {
-                    ss << hex << stwalk_offset << dec << "\" function=\"" << stwalk_func << "\"";
-                }
-                stwalk_symtab = (Symtab*)ptr;
-                stwalk_lines.clear();
-                stwalk_symtab->getSourceLines(stwalk_lines, stwalk_offset);
-                if (stwalk_lines.size() > 0) {
-                    ss << " file=\"" << stwalk_lines[0]->getFile() << "\" lineno=\"" << stwalk_lines[0]->getLine() << "\"";
+    for (unsigned i=0; i < frames.size(); i++) { 
+        frames[i].getName(stwalk_func); 
+        frames[i].getLibOffset(stwalk_lib, stwalk_offset, ptr); 
+        ss << "<frame level=\"" << i << "\" address=\"0x";
+        if (stwalk_func == "") {
+            Function *func;
+            debug_symtab->getContainingFunction((Offset)stwalk_offset, func);
+            if (func) {
+                Aggregate::name_iter it = func->pretty_names_begin();
+                if (it != func->pretty_names_end()) {
+                    ss << " function=\"" << sanitize(*it) << "\"";
                 }
-                //Module *mod;
-                //debug_symtab->findModuleByOffset(mod, stwalk_offset);
-                //if (mod) {
-                    //ss << " module=\"" << mod->fileName() << "\"";
-                //}
-                ss << " />" << endl;
             }
+        } else {
+            ss << hex << stwalk_offset << dec << "\" function=\"" << stwalk_func << "\"";
+        }
+        stwalk_symtab = (Symtab*)ptr;
+        stwalk_lines.clear();
+        stwalk_symtab->getSourceLines(stwalk_lines, stwalk_offset);
+        if (stwalk_lines.size() > 0) {
+            ss << " file=\"" << stwalk_lines[0]->getFile() << "\" lineno=\"" << stwalk_lines[0]->getLine() << "\"";
         }
+        //Module *mod;
+        //debug_symtab->findModuleByOffset(mod, stwalk_offset);
+        //if (mod) {
+            //ss << " module=\"" << mod->fileName() << "\"";
+        //}
+        ss << " />" << endl;
     }
 
     return ss.str();
@@ -151,14 +598,15 @@ string FPLog::getFakeStackTrace(void *addr)
     ss.clear();
     ss.str("");
 
+    string file;
+    long line;
+
     ss << "<frame level=\"0\" address=\"" << hex << addr << dec << "\"";
-    if (debug_symtab) {
-        stwalk_lines.clear();
-        debug_symtab->getSourceLines(stwalk_lines, (Offset)addr);
-        if (stwalk_lines.size() > 0) {
-            ss << " file=\"" << stwalk_lines[0]->getFile() << "\" lineno=\"" << stwalk_lines[0]->getLine() << "\"";
-        }
+    pthread_mutex_lock(&logLock);
+    if (lookupSourceLine((Offset)addr, file, line)) {
+        ss << " file=\"" << file << "\" lineno=\"" << line << "\"";
     }
+    pthread_mutex_unlock(&logLock);
     ss << " />" << endl;
 
     return ss.str();
@@ -167,34 +615,25 @@ string FPLog::getFakeStackTrace(void *addr)
 string FPLog::getSourceLineInfo(void *addr)
 {
     stringstream ss;
+    string file;
+    long line;
     ss.clear();
     ss.str("");
-    if (debug_symtab) {
-        stwalk_lines.clear();
-        debug_symtab->getSourceLines(stwalk_lines, (Offset)addr);
-        if (stwalk_lines.size() > 0) {
-            ss << stwalk_lines[0]->getFile() << ":" << stwalk_lines[0]->getLine();
-        }
+    pthread_mutex_lock(&logLock);
+    if (lookupSourceLine((Offset)addr, file, line)) {
+        ss << file << ":" << line;
     }
+    pthread_mutex_unlock(&logLock);
     return ss.str();
 }
 
 string FPLog::getSourceFunction(void *addr)
 {
-    stringstream ss;
-    ss.clear();
-    ss.str("");
-    if (debug_symtab) {
-        Function *func;
-        debug_symtab->getContainingFunction((Offset)addr, func);
-        if (func) {
-            Aggregate::name_iter it = func->pretty_names_begin();
-            if (it != func->pretty_names_end()) {
-                ss << sanitize(*it);
-            }
-        }
-    }
-    return ss.str();
+    string name;
+    pthread_mutex_lock(&logLock);
+    name = lookupFunction((Offset)addr);
+    pthread_mutex_unlock(&logLock);
+    return name;
 }
 
 void FPLog::getGlobalVars(vector<Variable *> &gvars)
@@ -439,46 +878,122 @@ string FPLog::sanitize(const string &text)
 
 void FPLog::writeTraces()
 {
+    vector<pair<unsigned, string> > all;
+
     map<string, unsigned>::iterator i;
     for (i = traces.begin(); i != traces.end(); i++) {
-        logfile << "<trace id=\"" << (i->second) << "\">" << endl;
-        logfile << (i->first) << "</trace>" << endl;
+        all.push_back(make_pair(i->second, i->first));
+    }
+
+    // symbolize captured traces (once per unique trace)
+    vector<FPLogRawTrace>::iterator r;
+    for (r = rawTraces.begin(); r != rawTraces.end(); r++) {
+        all.push_back(make_pair(r->id, symbolizeFrames(r->frames)));
+    }
+
+    vector<pair<unsigned, string> >::iterator t;
+    for (t = all.begin(); t != all.end(); t++) {
+        if (format == LOG_BINARY) {
+            FPLogBinaryTrace bt;
+            bt.id = t->first;
+            bt.text = addString(t->second);
+            writeRecord(FP_LOG_RECORD_TRACE, &bt, sizeof(FPLogBinaryTrace));
+            messageFinished();
+            continue;
+        }
+        buffer << "<trace id=\"" << (t->first) << "\">\n";
+        buffer << (t->second) << "</trace>\n";
+        messageFinished();
     }
 }
 
 void FPLog::writeInstructions()
 {
-    map<FPSemantics *, unsigned>::iterator i;
-    for (i = instructions.begin(); i != instructions.end(); i++) {
-        logfile << "<instruction id=\"" << (i->second) << "\"";
-        logfile << " address=\"" << hex << i->first->getAddress() << dec << "\"";
-        if (debug_symtab) {
-            stwalk_lines.clear();
-            debug_symtab->getSourceLines(stwalk_lines, (Offset)i->first->getAddress());
-            Function *func;
-            debug_symtab->getContainingFunction((Offset)i->first->getAddress(), func);
-            if (func) {
-                Aggregate::name_iter it = func->pretty_names_begin();
-                if (it != func->pretty_names_end()) {
-                    logfile << " function=\"" << sanitize(*it) << "\"";
-                }
-            }
-            if (stwalk_lines.size() > 0) {
-                logfile << " file=\"" << stwalk_lines[0]->getFile() << "\" lineno=\"" << stwalk_lines[0]->getLine() << "\"";
-                //Module *mod;
-                //debug_symtab->findModuleByOffset(mod, (Offset)i->first->getAddress());
-                //if (mod) {
-                    //logfile << " module=\"" << mod->fileName() << "\"" << endl;
-                //}
-            }
+    vector<pair<void*, pair<FPSemantics*, unsigned> > > sorted;
+    vector<pair<void*, pair<FPSemantics*, unsigned> > >::iterator i;
+    map<FPSemantics *, unsigned>::iterator j;
+    FPSemantics *inst;
+    unsigned id;
+    string function, file;
+    long lineno;
+
+    // emit in address order so that the symbolization caches are hit
+    // sequentially
+    for (j = instructions.begin(); j != instructions.end(); j++) {
+        sorted.push_back(make_pair(j->first->getAddress(), *j));
+    }
+    sort(sorted.begin(), sorted.end());
+
+    for (i = sorted.begin(); i != sorted.end(); i++) {
+        inst = i->second.first;
+        id = i->second.second;
+        function = lookupFunction((Offset)inst->getAddress());
+        if (!lookupSourceLine((Offset)inst->getAddress(), file, lineno)) {
+            file = "";
+            lineno = -1;
+        }
+        if (format == LOG_BINARY) {
+            FPLogBinaryInst bi;
+            bi.id = id;
+            bi.address = (uint64_t)inst->getAddress();
+            bi.function = internString(function);
+            bi.file = internString(file);
+            bi.lineno = lineno;
+            bi.disassembly = addString(inst->getDisassembly());
+            bi.text = addString(inst->toString());
+            writeRecord(FP_LOG_RECORD_INST, &bi, sizeof(FPLogBinaryInst));
+            messageFinished();
+            continue;
+        }
+        buffer << "<instruction id=\"" << id << "\"";
+        buffer << " address=\"" << hex << inst->getAddress() << dec << "\"";
+        if (function != "") {
+            buffer << " function=\"" << function << "\"";
         }
-        logfile << ">" << endl;
-        logfile << "<disassembly>" << endl << (i->first->getDisassembly()) << endl << "</disassembly>" << endl;
-        logfile << "<text>" << endl << (i->first->toString()) << endl << "</text>" << endl;
-        logfile << "</instruction>" << endl;
+        if (lineno >= 0) {
+            buffer << " file=\"" << file << "\" lineno=\"" << lineno << "\"";
+        }
+        buffer << ">\n";
+        buffer << "<disassembly>\n" << (inst->getDisassembly()) << "\n</disassembly>\n";
+        buffer << "<text>\n" << (inst->toString()) << "\n</text>\n";
+        buffer << "</instruction>\n";
+        messageFinished();
     }
 }
 
+void FPLog::writeRecord(uint32_t kind, const void *data, size_t size)
+{
+    static const char padding[8] = { 0 };
+    FPLogBinaryRecord rec;
+    rec.kind = kind;
+    rec.size = (uint32_t)((size + 7) & ~(size_t)7);
+    buffer.write((const char*)&rec, sizeof(FPLogBinaryRecord));
+    buffer.write((const char*)data, size);
+    buffer.write(padding, rec.size - size);
+    binOffset += sizeof(FPLogBinaryRecord) + rec.size;
+}
+
+uint64_t FPLog::addString(const string &str)
+{
+    if (str.length() == 0) {
+        return 0;
+    }
+    uint64_t offset = binOffset + sizeof(FPLogBinaryRecord);
+    writeRecord(FP_LOG_RECORD_STRING, str.c_str(), str.length() + 1);
+    return offset;
+}
+
+uint64_t FPLog::internString(const string &str)
+{
+    map<string, uint64_t>::iterator i = binStringIds.find(str);
+    if (i != binStringIds.end()) {
+        return i->second;
+    }
+    uint64_t offset = addString(str);
+    binStringIds[str] = offset;
+    return offset;
+}
+
 string FPLog::formatLargeCount(size_t val)
 {
     stringstream ss;
@@ -511,11 +1026,32 @@ string FPLog::formatLargeCount(size_t val)
 void FPLog::close()
 {
     if (!fileOpen) return;
+    pthread_mutex_lock(&logLock);
     writeTraces();
     writeInstructions();
-    logfile << "</log>" << endl;
+    if (format == LOG_BINARY) {
+        FPLogBinaryHeader header;
+        memset(&header, 0, sizeof(FPLogBinaryHeader));
+        memcpy(header.magic, FP_LOG_BINARY_MAGIC, sizeof(header.magic));
+        header.version = FP_LOG_BINARY_VERSION;
+        header.appname = internString(appname);
+        header.numMessages = numMessages;
+        header.recordsOffset = sizeof(FPLogBinaryHeader);
+        header.recordsEnd = binOffset;
+        writeBuffer();
+        stopWriterThread();
+
+        // the header goes last so that a complete header means a complete log
+        logfile.seekp(0);
+        logfile.write((const char*)&header, sizeof(FPLogBinaryHeader));
+    } else {
+        buffer << "</log>\n";
+        writeBuffer();
+        stopWriterThread();
+    }
     logfile.close();
     fileOpen = false;
+    pthread_mutex_unlock(&logLock);
 }
 
 }
@@ -2,16 +2,27 @@
 
 namespace FPInst {
 
-FPSVConfigPolicy::FPSVConfigPolicy(FPConfig *config)
+FPSVConfigPolicy::FPSVConfigPolicy(FPConfig *config, bool runtimeTags)
     : FPSVPolicy(SVT_NONE)
 {
     this->config = config;
+    this->runtimeTags = runtimeTags;
+}
+
+FPSVType FPSVConfigPolicy::getTagSVType(FPSemantics *inst)
+{
+    FPReplaceEntryTag tag = config->getReplaceTag(inst->getAddress());
+    if (runtimeTags) {
+        return (tag == RETAG_SINGLE ? SVT_IEEE_Single : SVT_IEEE_Double);
+    }
+    return RETag2SVType(tag);
 }
 
 bool FPSVConfigPolicy::shouldInstrument(FPSemantics *inst)
 {
     FPReplaceEntryTag tag = config->getReplaceTag(inst->getAddress());
-    bool instrument = (tag == RETAG_SINGLE || tag == RETAG_DOUBLE);
+    bool instrument = (tag == RETAG_SINGLE || tag == RETAG_DOUBLE ||
+                       (runtimeTags && tag == RETAG_CANDIDATE));
     //printf("FPSVConfigPolicy::shouldInstrument(%s) = %s\n",
             //inst->getDisassembly().c_str(), (instrument ? "yes" : "no"));
     return instrument;
@@ -33,11 +44,11 @@ FPSVType FPSVConfigPolicy::getSVType(FPSemantics *inst)
      *    printf("none\n");
      *}
      */
-    return RETag2SVType(config->getReplaceTag(inst->getAddress()));
+    return getTagSVType(inst);
 }
 FPSVType FPSVConfigPolicy::getSVType(FPOperand * /*op*/, FPSemantics *inst)
 {
-    return RETag2SVType(config->getReplaceTag(inst->getAddress()));
+    return getTagSVType(inst);
 }
 
 FPReplaceEntryTag FPSVConfigPolicy::getDefaultRETag(FPSemantics * inst)
@@ -0,0 +1,290 @@
+#include "FPSnapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+namespace FPInst {
+
+FPSnapshot* FPSnapshot::singletonSnapshot = NULL;
+volatile long FPSnapshot::resizing = 0;
+volatile int FPSnapshot::reading = 0;
+
+FPSnapshot* FPSnapshot::getInstance()
+{
+    if (!singletonSnapshot) {
+        singletonSnapshot = new FPSnapshot();
+    }
+    return singletonSnapshot;
+}
+
+FPSnapshot::FPSnapshot()
+{
+    analyses = NULL;
+    numAnalyses = 0;
+    numInsts = 0;
+    maxEntries = 0;
+    lastValues = NULL;
+    fd = -1;
+    buffers[0] = buffers[1] = NULL;
+    bufferUsed[0] = bufferUsed[1] = 0;
+    current = 0;
+    pending = -1;
+    busy = 0;
+    stopping = false;
+    seq = 0;
+    dropped = 0;
+}
+
+bool FPSnapshot::open(const char *filename, FPAnalysis **analyses,
+        size_t numAnalyses, size_t numInsts, long interval)
+{
+    FPSnapshotHeader header;
+    sigset_t block, old;
+    size_t i, size;
+
+    if (fd >= 0) {
+        return true;
+    }
+    if (numAnalyses > FP_SNAPSHOT_MAX_ANALYSES) {
+        numAnalyses = FP_SNAPSHOT_MAX_ANALYSES;
+    }
+    this->analyses = analyses;
+    this->numAnalyses = numAnalyses;
+    this->numInsts = numInsts;
+    maxEntries = numInsts * numAnalyses * SNAPSHOT_NUM_KINDS;
+
+    size = sizeof(FPSnapshotRecord) + maxEntries * sizeof(FPSnapshotEntry);
+    for (i = 0; i < 2; i++) {
+        buffers[i] = (char*)malloc(size);
+        if (!buffers[i]) {
+            fprintf(stderr, "OUT OF MEMORY!\n");
+            exit(-1);
+        }
+        bufferUsed[i] = 0;
+    }
+    lastValues = (uint64_t*)calloc(maxEntries, sizeof(uint64_t));
+    if (!lastValues) {
+        fprintf(stderr, "OUT OF MEMORY!\n");
+        exit(-1);
+    }
+
+    fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FP_SNAPSHOT_MAGIC, strlen(FP_SNAPSHOT_MAGIC));
+    header.version = FP_SNAPSHOT_VERSION;
+    header.numAnalyses = (uint32_t)numAnalyses;
+    header.interval = (uint64_t)interval;
+    for (i = 0; i < numAnalyses; i++) {
+        strncpy(header.tags[i], analyses[i]->getTag().c_str(),
+                FP_SNAPSHOT_TAG_LEN-1);
+    }
+    if (!writeAll((char*)&header, sizeof(header))) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    current = 0;
+    pending = -1;
+    busy = 0;
+    stopping = false;
+    seq = 0;
+    dropped = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sem_init(&ready, 0, 0);
+
+    // the writer inherits this mask, which keeps SIGPROF from landing in
+    // (and interrupting) its writes
+    sigemptyset(&block);
+    sigaddset(&block, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    if (pthread_create(&writer, NULL, FPSnapshot::writerMain, this) != 0) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return true;
+}
+
+bool FPSnapshot::isOpen()
+{
+    return fd >= 0;
+}
+
+void FPSnapshot::take()
+{
+    FPSnapshotRecord *rec;
+    FPSnapshotEntry *entries;
+    struct timespec now;
+    uint64_t key, iidx, kind, slot, delta;
+    size_t a, j, n, m, w;
+
+    if (fd < 0 || stopping) {
+        return;
+    }
+    if (__sync_lock_test_and_set(&busy, 1)) {
+        __sync_fetch_and_add(&dropped, 1);
+        return;     // already taking one (in another thread)
+    }
+
+    // pairs with beginResize(); if a resize is in progress (possibly in the
+    // thread we interrupted), the arrays may not be safe to read. Also skip
+    // the work entirely if the writer still has the previous buffer, since
+    // the last values below must only advance for records that get written.
+    reading = 1;
+    __sync_synchronize();
+    if (resizing > 0 || pending >= 0) {
+        reading = 0;
+        __sync_fetch_and_add(&dropped, 1);
+        __sync_lock_release(&busy);
+        return;
+    }
+
+    // collect the cumulative values and compact them (in place) into
+    // increments for the counters that changed
+    rec = (FPSnapshotRecord*)buffers[current];
+    entries = (FPSnapshotEntry*)(buffers[current] + sizeof(FPSnapshotRecord));
+    n = 0;
+    for (a = 0; a < numAnalyses && n < maxEntries; a++) {
+        m = analyses[a]->snapshotCounters(entries + n, maxEntries - n);
+        w = n;
+        for (j = n; j < n + m; j++) {
+            key = entries[j].key | FP_SNAPSHOT_KEY(0, a, 0);
+            iidx = FP_SNAPSHOT_IIDX(key);
+            kind = FP_SNAPSHOT_KIND(key);
+            if (iidx >= numInsts || kind >= SNAPSHOT_NUM_KINDS) {
+                continue;   // registered after the snapshots were set up
+            }
+            slot = (iidx * numAnalyses + a) * SNAPSHOT_NUM_KINDS + kind;
+            delta = entries[j].value - lastValues[slot];
+            if (delta == 0) {
+                continue;
+            }
+            lastValues[slot] = entries[j].value;
+            entries[w].key = key;
+            entries[w].value = delta;
+            w++;
+        }
+        n = w;
+    }
+    reading = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rec->seq = seq;
+    rec->time = (uint64_t)((long)(now.tv_sec - start.tv_sec) * 1000000L +
+                (long)(now.tv_nsec - start.tv_nsec) / 1000L);
+    rec->numEntries = n;
+    rec->dropped = dropped;
+    bufferUsed[current] = sizeof(FPSnapshotRecord) + n * sizeof(FPSnapshotEntry);
+
+    // hand the buffer off and start filling the other one next time
+    __sync_synchronize();
+    pending = current;
+    current = 1 - current;
+    seq++;
+    sem_post(&ready);
+
+    __sync_lock_release(&busy);
+}
+
+void FPSnapshot::beginResize()
+{
+    __sync_fetch_and_add(&resizing, 1);
+    while (reading) {
+        // a snapshot is reading the arrays in another thread
+        sched_yield();
+    }
+}
+
+void FPSnapshot::endResize()
+{
+    __sync_synchronize();
+    __sync_fetch_and_sub(&resizing, 1);
+}
+
+void FPSnapshot::close()
+{
+    if (fd < 0) {
+        return;
+    }
+
+    // wait for any snapshot in progress, then take the last one
+    while (busy || pending >= 0) {
+        usleep(1000);
+    }
+    take();
+
+    stopping = true;
+    sem_post(&ready);
+    pthread_join(writer, NULL);
+    sem_destroy(&ready);
+    ::close(fd);
+    fd = -1;
+
+    free(buffers[0]);
+    free(buffers[1]);
+    free(lastValues);
+    buffers[0] = buffers[1] = NULL;
+    lastValues = NULL;
+}
+
+size_t FPSnapshot::getNumTaken()
+{
+    return seq;
+}
+
+size_t FPSnapshot::getNumDropped()
+{
+    return dropped;
+}
+
+void* FPSnapshot::writerMain(void *arg)
+{
+    ((FPSnapshot*)arg)->writeLoop();
+    return NULL;
+}
+
+void FPSnapshot::writeLoop()
+{
+    int buf;
+    while (true) {
+        while (sem_wait(&ready) != 0 && errno == EINTR);
+        buf = pending;
+        if (buf >= 0) {
+            writeAll(buffers[buf], bufferUsed[buf]);
+            __sync_synchronize();
+            pending = -1;
+        }
+        if (stopping) {
+            break;
+        }
+    }
+}
+
+bool FPSnapshot::writeAll(const char *buf, size_t len)
+{
+    ssize_t n;
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+}
+
@@ -0,0 +1,53 @@
+/*
+ * fpcfg.cpp
+ *
+ * Configuration file conversion utility (text <-> binary)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FPConfig.h"
+
+using namespace FPInst;
+
+void usage()
+{
+    printf("\nUsage:  fpcfg <mode> <input> <output>\n");
+    printf(" Converts a configuration file between the text and binary formats.\n");
+    printf(" The input format is detected automatically.\n");
+    printf("Modes:\n");
+    printf("\n");
+    printf("  -b                   write a binary configuration (for fpinst -c)\n");
+    printf("  -t                   write a text configuration\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4 || (strcmp(argv[1], "-b") != 0 && strcmp(argv[1], "-t") != 0)) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    FPConfig *config = new FPConfig(argv[2]);
+    if (strcmp(argv[1], "-b") == 0) {
+        if (!config->saveBinaryFile(argv[3])) {
+            fprintf(stderr, "ERROR: Unable to write %s\n", argv[3]);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        ofstream fout(argv[3]);
+        config->buildFile(fout);
+        fout.close();
+        if (fout.fail()) {
+            fprintf(stderr, "ERROR: Unable to write %s\n", argv[3]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    delete config;
+
+    return(EXIT_SUCCESS);
+}
+
@@ -47,6 +47,8 @@ long binaryArg = 0;
 bool addAll = false;
 bool outputCandidates = false;
 bool reportOriginal = false;
+char *decodeCacheFile = NULL;
+unsigned configThreads = 1;
 
 // function/instruction indices and counts
 size_t midx = 0, fidx = 0, bbidx = 0, iidx = 0;
@@ -64,6 +66,27 @@ FPReplaceEntry *tempFuncRE = NULL;
 FPReplaceEntry *tempBblkRE = NULL;
 FPReplaceEntry *tempInsnRE = NULL;
 
+/**
+ * Multi-threaded mode (-j): the CFG walk (which uses Dyninst and must stay
+ * serial) records the entries in output order, leaving a slot for each
+ * instruction entry. Worker threads then build the instruction entries one
+ * function at a time, and the items are replayed serially so that the output
+ * is identical to a single-threaded run.
+ */
+struct FPConfigItem {
+    FPReplaceEntry *entry;      // structure entry, or built instruction entry
+    FPReplaceEntry **temp;      // buffer for structure entries (NULL for instructions)
+    unsigned long iidx;
+    void *addr;
+};
+vector<FPConfigItem> configItems;
+vector<size_t> configFuncStarts;            // first item of each function
+vector<unsigned char*> configBytes;         // instruction byte copies
+volatile size_t nextConfigFunc = 0;
+
+// debug info lookups are not thread-safe
+pthread_mutex_t lineInfoLock = PTHREAD_MUTEX_INITIALIZER;
+
 // }}}
 
 // {{{ error handling (boilerplate--no need to touch this!)
@@ -125,20 +148,20 @@ bool fpFilterFunc(Instruction::Ptr inst)
 
 // {{{ application, function, basic block, and instruction configure routines
 
-void configInstruction(void *addr, unsigned char *bytes, size_t nbytes)
+/**
+ * Build the configuration entry for a decoded instruction. Safe to call from
+ * multiple threads (see configFunctionWorker).
+ */
+FPReplaceEntry* buildInstructionEntry(unsigned long idx, void *addr, FPSemantics *inst)
 {
-    iidx++;
-    total_fp_instructions++;
-
-    // decode instruction
-    FPSemantics *inst = mainDecoder->decode(iidx, addr, bytes, nbytes);
-
     // build config entry
-    FPReplaceEntry *entry = new FPReplaceEntry(RETYPE_INSTRUCTION, iidx);
+    FPReplaceEntry *entry = new FPReplaceEntry(RETYPE_INSTRUCTION, idx);
     stringstream ss;
     ss.clear(); ss.str("");
-    ss << inst->getDisassembly() << "  ["
-       << mainLog->getSourceLineInfo(inst->getAddress()) << "]";
+    pthread_mutex_lock(&lineInfoLock);
+    string lineInfo = mainLog->getSourceLineInfo(inst->getAddress());
+    pthread_mutex_unlock(&lineInfoLock);
+    ss << inst->getDisassembly() << "  [" << lineInfo << "]";
     entry->name = ss.str();
     entry->address = addr;
 
@@ -154,8 +177,11 @@ void configInstruction(void *addr, unsigned char *bytes, size_t nbytes)
         }
     }
 
-    // handle pre-instrumentation analysis types
-    if (mainAnalysis && mainAnalysis->shouldPreInstrument(inst)) {
+    // handle pre-instrumentation analysis types (these may also use inline
+    // replacement blobs for some or all instructions)
+    if (mainAnalysis && (mainAnalysis->shouldPreInstrument(inst) ||
+                ((countInst || detectCancel || detectNaN) &&
+                 mainAnalysis->shouldReplace(inst)))) {
         if (outputCandidates) {
             entry->tag = RETAG_CANDIDATE;
         } else if (nullInst) {
@@ -198,6 +224,11 @@ void configInstruction(void *addr, unsigned char *bytes, size_t nbytes)
         }
     }
 
+    return entry;
+}
+
+void addInstructionEntry(FPReplaceEntry *entry)
+{
     // don't report "none" or "ignore" unless explicitly desired
     if (!(entry->tag == RETAG_NONE || entry->tag == RETAG_IGNORE) || addAll) {
 
@@ -218,6 +249,119 @@ void configInstruction(void *addr, unsigned char *bytes, size_t nbytes)
     }
 }
 
+void addStructureEntry(FPReplaceEntry *entry, FPReplaceEntry **temp)
+{
+    if (addAll) {
+        mainConfig->addReplaceEntry(entry);
+    } else {
+        *temp = entry;
+    }
+}
+
+/**
+ * Add a module, function, or basic block entry (buffered in *temp unless all
+ * entries are being output), or queue it in multi-threaded mode.
+ */
+void queueStructureEntry(FPReplaceEntry *entry, FPReplaceEntry **temp)
+{
+    if (configThreads > 1) {
+        FPConfigItem item;
+        item.entry = entry;
+        item.temp = temp;
+        item.iidx = 0;
+        item.addr = entry->address;
+        configItems.push_back(item);
+    } else {
+        addStructureEntry(entry, temp);
+    }
+}
+
+void configInstruction(void *addr, unsigned char *bytes, size_t nbytes)
+{
+    iidx++;
+    total_fp_instructions++;
+
+    // multi-threaded mode: decode and build the entry later
+    if (configThreads > 1) {
+        unsigned char *copy = (unsigned char*)malloc(nbytes);
+        if (!copy) {
+            fprintf(stderr, "OUT OF MEMORY!\n");
+            exit(-1);
+        }
+        memcpy(copy, bytes, nbytes);
+        configBytes.push_back(copy);
+        ((FPDecoderXED*)mainDecoder)->defer(iidx, addr, copy, nbytes);
+        FPConfigItem item;
+        item.entry = NULL;
+        item.temp = NULL;
+        item.iidx = iidx;
+        item.addr = addr;
+        configItems.push_back(item);
+        return;
+    }
+
+    // decode instruction
+    FPSemantics *inst = mainDecoder->decode(iidx, addr, bytes, nbytes);
+
+    addInstructionEntry(buildInstructionEntry(iidx, addr, inst));
+}
+
+void* configFunctionWorker(void * /*arg*/)
+{
+    size_t f, i, end;
+    while ((f = __sync_fetch_and_add(&nextConfigFunc, 1)) < configFuncStarts.size()) {
+        end = (f+1 < configFuncStarts.size() ? configFuncStarts[f+1] : configItems.size());
+        for (i = configFuncStarts[f]; i < end; i++) {
+            FPConfigItem &item = configItems[i];
+            if (item.temp == NULL) {
+                item.entry = buildInstructionEntry(item.iidx, item.addr,
+                        mainDecoder->lookup(item.iidx));
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Finish a multi-threaded configuration: decode the recorded instructions,
+ * build their entries one function at a time, and merge everything in the
+ * original order.
+ */
+void configQueuedEntries()
+{
+    vector<pthread_t> workers;
+    pthread_t tid;
+    size_t i;
+
+    ((FPDecoderXED*)mainDecoder)->decodeDeferred(configThreads);
+    for (i = 0; i < configBytes.size(); i++) {
+        free(configBytes[i]);
+    }
+    configBytes.clear();
+
+    nextConfigFunc = 0;
+    for (i = 1; i < configThreads && i < configFuncStarts.size(); i++) {
+        if (pthread_create(&tid, NULL, configFunctionWorker, NULL) != 0) {
+            break;
+        }
+        workers.push_back(tid);
+    }
+    configFunctionWorker(NULL);
+    for (i = 0; i < workers.size(); i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (i = 0; i < configItems.size(); i++) {
+        if (configItems[i].temp) {
+            addStructureEntry(configItems[i].entry, configItems[i].temp);
+        } else {
+            addInstructionEntry(configItems[i].entry);
+        }
+    }
+    configItems.clear();
+    configFuncStarts.clear();
+}
+
 void configBasicBlock(BPatch_basicBlock *block)
 {
     static size_t MAX_RAW_INSN_SIZE = 16;
@@ -233,11 +377,7 @@ void configBasicBlock(BPatch_basicBlock *block)
     // build config entry
     FPReplaceEntry *entry = new FPReplaceEntry(RETYPE_BASICBLOCK, bbidx);
     entry->address = (void*)block->getStartAddress();
-    if (addAll) {
-        mainConfig->addReplaceEntry(entry);
-    } else {
-        tempBblkRE = entry;
-    }
+    queueStructureEntry(entry, &tempBblkRE);
 
     // get all instructions
     PatchBlock::Insns insns;
@@ -271,15 +411,16 @@ void configFunction(BPatch_function *function, const char *name)
     fidx++;
     total_functions++;
 
+    // mark the start of a new unit of work for multi-threaded mode
+    if (configThreads > 1) {
+        configFuncStarts.push_back(configItems.size());
+    }
+
     // build config entry
     FPReplaceEntry *entry = new FPReplaceEntry(RETYPE_FUNCTION, fidx);
     entry->name = name;
     entry->address = function->getBaseAddr();
-    if (addAll) {
-        mainConfig->addReplaceEntry(entry);
-    } else {
-        tempFuncRE = entry;
-    }
+    queueStructureEntry(entry, &tempFuncRE);
 
     // config all basic blocks
     std::set<BPatch_basicBlock*> blocks;
@@ -318,11 +459,7 @@ void configModule(BPatch_module *mod, const char *name)
     FPReplaceEntry *entry = new FPReplaceEntry(RETYPE_MODULE, midx);
     entry->name = name;
     entry->address = mod->getBaseAddr();
-    if (addAll) {
-        mainConfig->addReplaceEntry(entry);
-    } else {
-        tempModRE = entry;
-    }
+    queueStructureEntry(entry, &tempModRE);
 
 	// get list of all functions
 	std::vector<BPatch_function *>* functions;
@@ -399,6 +536,9 @@ void configApplication(BPatch_addressSpace *app)
 
         configModule(*m, modname);
     }
+    if (configThreads > 1) {
+        configQueuedEntries();
+    }
 
     
     // generate application report
@@ -437,6 +577,8 @@ void usage()
     printf("\n");
     printf("  -a                   output all instructions (including those that would normally be ignored)\n");
     printf("  -c                   output original candidate configuration for automated search\n");
+    printf("  -D <filename>        use (and update) the given decoded instruction cache file\n");
+    printf("  -j <n>               configure functions using <n> threads (default is 1)\n");
     printf("  -s                   configure functions in shared libraries\n");
     printf("\n");
 }
@@ -455,6 +597,13 @@ bool parseCommandLine(unsigned argc, char *argv[])
             addAll = true;
         } else if (strcmp(argv[i], "-c")==0) {
             outputCandidates = true;
+        } else if (strcmp(argv[i], "-D")==0 && i < argc-1) {
+            decodeCacheFile = argv[++i];
+        } else if (strcmp(argv[i], "-j")==0 && i < argc-1) {
+            configThreads = (unsigned)strtoul(argv[++i], NULL, 10);
+            if (configThreads == 0) {
+                configThreads = 1;
+            }
 		} else if (strcmp(argv[i], "-s")==0) {
 			instShared = true;
 		} else if (strcmp(argv[i], "--null")==0) {
@@ -544,6 +693,12 @@ int main(int argc, char *argv[])
     // initialize instruction decoder
     mainDecoder = new FPDecoderXED();       // use Intel's decoder from Pin
     //mainDecoder = new FPDecoderIAPI();    // use Dyninst's InstructionAPI
+    if (decodeCacheFile) {
+        FPDecodeCache *cache = new FPDecodeCache(decodeCacheFile,
+                FPDecodeCache::computeBinaryKey(binary), true);
+        cache->load();
+        ((FPDecoderXED*)mainDecoder)->setCache(cache);
+    }
     
     // set up analysis for decision-making
     initialize_analysis();
@@ -564,6 +719,15 @@ int main(int argc, char *argv[])
     // build configuration
     configApplication(app);
 
+    // update decode cache (don't print anything; the config goes to stdout)
+    if (decodeCacheFile) {
+        FPDecodeCache *cache = ((FPDecoderXED*)mainDecoder)->getCache();
+        if (cache->isModified() && !cache->save()) {
+            fprintf(stderr, "WARNING: Unable to write decode cache to %s\n",
+                    cache->getPath().c_str());
+        }
+    }
+
     // output configuration
     if (inplaceSV) {
         mainConfig->setValue("sv_inp_type", "config");
@@ -4,6 +4,7 @@ long _INST_DISABLED = 0;
 long _INST_INACTIVE = 1;
 long _INST_ACTIVE   = 2;
 long _INST_status   = _INST_DISABLED;
+__thread long _INST_thread_status = 0;    // _INST_DISABLED
 
 void _INST_print_flags(const char *tag, unsigned flags) {
     //bool CF = ((flags & 0x001) != 0);
@@ -0,0 +1,132 @@
+/*
+ * fpforkrun.cpp
+ *
+ * Client for the libfpanalysis fork server (see FPForkServer.h): runs one
+ * configuration in a forked copy of an already-initialized rewritten binary
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "FPForkServer.h"
+
+void usage()
+{
+    printf("\nUsage:  fpforkrun [-c <config>] [-q] <socket>\n");
+    printf(" Runs a rewritten binary that was started with %s=<socket>,\n", FP_FORK_SERVER_ENV);
+    printf(" using the current directory, standard I/O, and configuration.\n");
+    printf(" The run uses the server's command-line arguments and environment.\n");
+    printf(" The exit status is that of the forked run.\n");
+    printf("Options:\n");
+    printf("\n");
+    printf("  -c <config>          configuration to load (default is $CRAFT_CONFIG)\n");
+    printf("  -q                   shut down the server instead\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *config = getenv("CRAFT_CONFIG");
+    const char *socketPath = NULL;
+    bool shutdown = false;
+    char cwd[PATH_MAX] = "";
+    char cfgPath[PATH_MAX] = "";
+    char data[FP_FORK_SERVER_MAX_MSG];
+    char control[CMSG_SPACE(FP_FORK_SERVER_NUM_FDS * sizeof(int))];
+    int fds[FP_FORK_SERVER_NUM_FDS] = { 0, 1, 2 };
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    size_t len;
+    int conn, status, i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i+1 < argc) {
+            config = argv[++i];
+        } else if (strcmp(argv[i], "-q") == 0) {
+            shutdown = true;
+        } else if (argv[i][0] != '-' && socketPath == NULL) {
+            socketPath = argv[i];
+        } else {
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (socketPath == NULL || strlen(socketPath) >= sizeof(addr.sun_path)) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // build request (paths are sent in absolute form, since the server runs
+    // in a different directory)
+    if (!shutdown) {
+        if (getcwd(cwd, PATH_MAX) == NULL) {
+            fprintf(stderr, "ERROR: Unable to read current directory\n");
+            exit(EXIT_FAILURE);
+        }
+        if (config && realpath(config, cfgPath) == NULL) {
+            fprintf(stderr, "ERROR: Unable to find %s\n", config);
+            exit(EXIT_FAILURE);
+        }
+    }
+    len = strlen(cwd) + 1 + strlen(cfgPath) + 1;
+    if (len > FP_FORK_SERVER_MAX_MSG) {
+        fprintf(stderr, "ERROR: Request too long\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(data, cwd, strlen(cwd) + 1);
+    memcpy(data + strlen(cwd) + 1, cfgPath, strlen(cfgPath) + 1);
+
+    conn = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+    if (conn < 0 || connect(conn, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "ERROR: Unable to connect to %s\n", socketPath);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (!shutdown) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+    if (sendmsg(conn, &msg, 0) != (ssize_t)len) {
+        fprintf(stderr, "ERROR: Unable to send request to %s\n", socketPath);
+        exit(EXIT_FAILURE);
+    }
+    if (shutdown) {
+        close(conn);
+        return(EXIT_SUCCESS);
+    }
+
+    // wait for the run to finish and pass its status along
+    if (recv(conn, &status, sizeof(status), 0) != (ssize_t)sizeof(status)) {
+        fprintf(stderr, "ERROR: Lost connection to %s\n", socketPath);
+        exit(EXIT_FAILURE);
+    }
+    close(conn);
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return(EXIT_FAILURE);
+}
+
@@ -39,6 +39,7 @@ unsigned long reducePrecDefaultPrec = 0;
 bool  fpinstAnalysisEnabled[TOTAL_ANALYSIS_COUNT];
 char* fpinstAnalysisParam[TOTAL_ANALYSIS_COUNT];
 vector<FPAnalysis*> activeAnalyses;
+vector<FPRegistrationEntry> regTable;
 
 // instrumentation file options
 char *binary = NULL;
@@ -49,6 +50,8 @@ char configFileName[] = "base.cfg";
 char *configFile = configFileName;
 char *logFile = NULL;
 char *logTag = NULL;
+char *decodeCacheFile = NULL;
+unsigned decodeThreads = 1;
 char *child_argv[45];
 char *child_envp[10];
 
@@ -76,7 +79,9 @@ bool profiling = false;         // enable profiling output
 bool disableSampling = false;   // disable logarithmic cancellation sampling
 bool instrFrames = false;       // add instrumentation stack frames
 bool fortranMode = false;       // switch up instrumentation for FORTRAN programs
-bool multicoreMode = false;     // use the LOCK prefix for INC instructions
+bool multicoreMode = false;     // use per-thread sharded instruction counters
+bool blockCountMode = false;    // count basic blocks instead of instructions (c_inst)
+bool incrementalMode = false;   // instrument all candidates; tags are read at run time
 
 // function/instruction indices and counts
 size_t midx = 0, fidx = 0, bbidx = 0, iidx = 0;
@@ -173,8 +178,9 @@ BPatch_variableExpr *r15PtrExpr = NULL;
 BPatch_function* initFunc;
 BPatch_function* enableFunc;
 BPatch_function* setFunc;
-BPatch_function* setReplaceFunc;
+BPatch_function* setReplaceTagsFunc;
 BPatch_function* regFunc;
+BPatch_function* regTableFunc;
 BPatch_function* handlePreFunc;
 BPatch_function* handlePostFunc;
 BPatch_function* handleReplFunc;
@@ -312,11 +318,36 @@ void setup_config_file(FPConfig *configuration)
         configuration->setValue("enable_sampling", "no");
     }
     if (multicoreMode) {
-        configuration->setValue("use_lock_prefix", "yes");
+        configuration->setValue("use_sharded_counters", "yes");
+    }
+    if (blockCountMode) {
+        configuration->setValue("cinst_block_counts", "yes");
+    }
+    if (incrementalMode) {
+        configuration->setValue("runtime_tags", "yes");
+        if (!configuration->hasValue("runtime_tag_file")) {
+            char cfgPath[PATH_MAX];
+            if (realpath(configFile, cfgPath) != NULL) {
+                configuration->setValue("runtime_tag_file", cfgPath);
+            }
+        }
     }
 }
 
 void initializeActiveAnalyses() {
+    size_t numEnabled = 0;
+    for (size_t aidx=0; aidx < (size_t)TOTAL_ANALYSIS_COUNT; aidx++) {
+        if (fpinstAnalysisEnabled[aidx]) {
+            numEnabled++;
+        }
+    }
+    if (numEnabled > 1) {
+        // inline checks replace the instruction, which might conflict with
+        // another analysis
+        configuration->setValue("cinst_inline", "no");
+        configuration->setValue("dcancel_inline", "no");
+        configuration->setValue("dnan_inline", "no");
+    }
     for (size_t aidx=0; aidx < (size_t)TOTAL_ANALYSIS_COUNT; aidx++) {
         if (fpinstAnalysisEnabled[aidx]) {
             activeAnalyses.push_back(allAnalysisInfo[aidx].instance);
@@ -410,6 +441,38 @@ BPatch_constExpr* saveStringToBinary(const char *str, size_t nbytes)
     return ptr;
 }
 
+BPatch_snippet* embedRegistrationTable()
+{
+    // save the packed registration table to the mutatee and build a single
+    // call to register all instructions at once
+    size_t nbytes = regTable.size() * sizeof(FPRegistrationEntry);
+    BPatch_variableExpr *tableExpr = mainApp->malloc(nbytes);
+    tableExpr->writeValue(&regTable[0], nbytes, false);
+    BPatch_Vector<BPatch_snippet*> *regArgs = new BPatch_Vector<BPatch_snippet*>();
+    regArgs->push_back(new BPatch_constExpr(tableExpr->getBaseAddr()));
+    regArgs->push_back(new BPatch_constExpr((long)regTable.size()));
+    return new BPatch_funcCallExpr(*regTableFunc, *regArgs);
+}
+
+BPatch_snippet* embedReplaceTagTable()
+{
+    // save the resolved (sorted) replacement tags to the mutatee in the binary
+    // configuration file format and build a single call to install them; the
+    // runtime searches the table in place instead of rebuilding the tree
+    vector<FPConfigFileTag> tags;
+    configuration->getReplaceTagTable(tags);
+    if (tags.size() == 0) {
+        return NULL;
+    }
+    size_t nbytes = tags.size() * sizeof(FPConfigFileTag);
+    BPatch_variableExpr *tableExpr = mainApp->malloc(nbytes);
+    tableExpr->writeValue(&tags[0], nbytes, false);
+    BPatch_Vector<BPatch_snippet*> *tagArgs = new BPatch_Vector<BPatch_snippet*>();
+    tagArgs->push_back(new BPatch_constExpr(tableExpr->getBaseAddr()));
+    tagArgs->push_back(new BPatch_constExpr((long)tags.size()));
+    return new BPatch_funcCallExpr(*setReplaceTagsFunc, *tagArgs);
+}
+
 Symbol *findLibFPMSymbol(string name) {
     assert(libFPAnalysis != NULL);
 
@@ -505,6 +568,7 @@ Snippet::Ptr buildDefaultPreInstrumentation(FPAnalysis *analysis, FPSemantics *i
     BPatch_Vector<BPatch_snippet*> *args = new BPatch_Vector<BPatch_snippet*>();
     args->push_back(new BPatch_constExpr(aidx));
     args->push_back(new BPatch_constExpr(iidx));
+    args->push_back(new BPatch_threadIndexExpr());
     return PatchAPI::convert(new BPatch_funcCallExpr(*handlePreFunc, *args));
 }
 
@@ -515,6 +579,7 @@ Snippet::Ptr buildDefaultPostInstrumentation(FPAnalysis *analysis, FPSemantics *
     BPatch_Vector<BPatch_snippet*> *args = new BPatch_Vector<BPatch_snippet*>();
     args->push_back(new BPatch_constExpr(aidx));
     args->push_back(new BPatch_constExpr(iidx));
+    args->push_back(new BPatch_threadIndexExpr());
     return PatchAPI::convert(new BPatch_funcCallExpr(*handlePostFunc, *args));
 }
 
@@ -525,6 +590,7 @@ Snippet::Ptr buildDefaultReplacementCode(FPAnalysis *analysis, FPSemantics *inst
     BPatch_Vector<BPatch_snippet*> *args = new BPatch_Vector<BPatch_snippet*>();
     args->push_back(new BPatch_constExpr(aidx));
     args->push_back(new BPatch_constExpr(iidx));
+    args->push_back(new BPatch_threadIndexExpr());
     return PatchAPI::convert(new BPatch_funcCallExpr(*handleReplFunc, *args));
 }
 
@@ -536,6 +602,12 @@ void buildRegHandlers(FPSemantics *inst, vector<Snippet::Ptr> &handlers)
     BPatch_variableExpr *regPtrExpr = NULL;
     BPatch_snippet *regExpr = NULL;
 
+    // each thread has its own context; the register pointers refer to the
+    // first one, so offset them by the thread index
+    BPatch_snippet *ctxOffsetExpr = new BPatch_arithExpr(BPatch_times,
+            BPatch_threadIndexExpr(), BPatch_constExpr((long)sizeof(FPContext)));
+    BPatch_snippet *slotExpr = NULL;
+
     // {{{ initialize arguments for the value of registers EAX-EDX, EBP and ESP
     if (eaxExpr == NULL) {
         vector<BPatch_register> tempRegs;
@@ -784,8 +856,10 @@ void buildRegHandlers(FPSemantics *inst, vector<Snippet::Ptr> &handlers)
             default: break;
         }
         if (regPtrExpr != NULL && regExpr != NULL) {
+            slotExpr = new BPatch_arithExpr(BPatch_plus,
+                    *regPtrExpr, *ctxOffsetExpr);
             derefExpr = new BPatch_arithExpr(BPatch_deref,
-                    *regPtrExpr);
+                    *slotExpr);
             assignExpr = new BPatch_arithExpr(BPatch_assign,
                     *derefExpr, *regExpr);
 
@@ -841,8 +915,10 @@ void buildRegHandlers(FPSemantics *inst, vector<Snippet::Ptr> &handlers)
             default: break;
         }
         if (regPtrExpr != NULL && regExpr != NULL) {
+            slotExpr = new BPatch_arithExpr(BPatch_plus,
+                    *regPtrExpr, *ctxOffsetExpr);
             derefExpr = new BPatch_arithExpr(BPatch_deref,
-                    *regPtrExpr);
+                    *slotExpr);
             assignExpr = new BPatch_arithExpr(BPatch_assign,
                     *regExpr, *derefExpr);
 
@@ -1000,18 +1076,17 @@ void replaceFunctionCalls(const char* oldFuncName, const char* newFuncName)
         return;
     }
 
-    // build "replace if _INST_status is inactive" snippet
-    BPatch_variableExpr* flagVar = mainImg->findVariable("_INST_status");
-    if (!flagVar) {
-        cout << "ERROR: could not find instrumentation flag \"_INST_status\"" << endl;
-        return;
-    }
-    BPatch_variableExpr* valVar = mainImg->findVariable("_INST_INACTIVE");
-    if (!valVar) {
-        cout << "ERROR: could not find instrumentation flag value \"_INST_INACTIVE\"" << endl;
+    // build "replace if the library is inactive in this thread" snippet (the
+    // per-thread flag is thread-local, so it has to be read by the runtime)
+    funcs.clear();
+    mainImg->findFunction("_INST_replacement_enabled", funcs, false);
+    if (!funcs.size()) {
+        cout << "ERROR: could not find function \"_INST_replacement_enabled\"" << endl;
         return;
     }
-    BPatch_boolExpr flagVarCheck(BPatch_eq, *flagVar, *valVar);
+    BPatch_Vector<BPatch_snippet*> noArgs;
+    BPatch_funcCallExpr flagCall(*funcs[0], noArgs);
+    BPatch_boolExpr flagVarCheck(BPatch_eq, flagCall, BPatch_constExpr(1));
 
     BPatch_funcJumpExpr newJump(*newFunc);
     BPatch_funcJumpExpr oldJump(*oldFunc);
@@ -1397,6 +1472,125 @@ void buildPostInstrumentation(FPSemantics *inst, FPAnalysis *analysis,
             "", "", inst);
 }
 
+/**
+ * Instrumentation decisions for a single instruction. With multiple threads
+ * (-j), these are made for every decoded instruction in parallel before the
+ * insertion walk (see planInstrumentation); otherwise buildInstrumentation
+ * makes them on the spot. The decision functions only read the decoded
+ * instruction and the configuration; building snippets, allocating in the
+ * mutatee, and generating blob code (which needs the final PatchAPI buffer
+ * address) stay on the serial insertion walk.
+ */
+struct FPInstPlan {
+    bool planned;
+    FPReplaceEntryTag tag;      // effective tag (with a configuration tree)
+    bool inlineCheck;           // d_cancel/d_nan can check this tag inline
+    unsigned long replaceMask;  // one bit per active analysis (no tree)
+    unsigned long preMask;
+    unsigned long postMask;
+};
+vector<FPInstPlan> instPlans;
+
+void planInstruction(FPSemantics *inst, FPInstPlan &plan)
+{
+    plan.tag = RETAG_NONE;
+    plan.inlineCheck = false;
+    plan.replaceMask = 0;
+    plan.preMask = 0;
+    plan.postMask = 0;
+
+    if (configuration->hasReplaceTagTree()) {
+        FPReplaceEntryTag tag = configuration->getReplaceTag(inst->getAddress());
+        if (incrementalMode && tag == RETAG_CANDIDATE) {
+            // in-place replacement site whose precision is decided at run
+            // time by the tags in the current configuration
+            tag = RETAG_DOUBLE;
+        }
+        if (tag == RETAG_DCANCEL) {
+            plan.inlineCheck = FPAnalysisDCancel::getInstance()->canCheckInline(inst);
+        } else if (tag == RETAG_DNAN) {
+            plan.inlineCheck = FPAnalysisDNan::getInstance()->canCheckInline(inst);
+        }
+        plan.tag = tag;
+    } else {
+        for (size_t a = 0; a < activeAnalyses.size(); a++) {
+            if (activeAnalyses[a]->shouldReplace(inst)) {
+                plan.replaceMask |= (1UL << a);
+            }
+            if (activeAnalyses[a]->shouldPreInstrument(inst)) {
+                plan.preMask |= (1UL << a);
+            }
+            if (activeAnalyses[a]->shouldPostInstrument(inst)) {
+                plan.postMask |= (1UL << a);
+            }
+        }
+    }
+    plan.planned = true;
+}
+
+struct FPPlanBatch {
+    vector<FPSemantics*> *insts;
+    size_t next;
+};
+
+void* planWorker(void *arg)
+{
+    FPPlanBatch *batch = (FPPlanBatch*)arg;
+    size_t n = batch->insts->size();
+    size_t i;
+
+    // each plan is written by exactly one worker
+    while ((i = __sync_fetch_and_add(&batch->next, 1)) < n) {
+        FPSemantics *inst = batch->insts->at(i);
+        planInstruction(inst, instPlans[inst->getIndex()]);
+    }
+    return NULL;
+}
+
+void planInstrumentation(unsigned nthreads)
+{
+    vector<FPSemantics*> insts;
+    vector<pthread_t> workers;
+    FPPlanBatch batch;
+    FPSemantics *inst;
+    pthread_t tid;
+    unsigned long i;
+
+    // c_inst block counts depend on the block leader, which is only known
+    // during the insertion walk
+    if (blockCountMode) {
+        return;
+    }
+    assert(activeAnalyses.size() <= sizeof(unsigned long)*8);
+
+    // gather the decoded instructions (serially; lookup isn't thread-safe)
+    instPlans.assign(iidx+1, FPInstPlan());
+    for (i = 0; i <= iidx; i++) {
+        instPlans[i].planned = false;
+        inst = mainDecoder->lookup(i);
+        if (inst && inst->isValid()) {
+            insts.push_back(inst);
+        }
+    }
+
+    // decide in parallel (the calling thread helps out)
+    batch.insts = &insts;
+    batch.next = 0;
+    if (nthreads > insts.size()) {
+        nthreads = (unsigned)insts.size();
+    }
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&tid, NULL, planWorker, &batch) != 0) {
+            break;
+        }
+        workers.push_back(tid);
+    }
+    planWorker(&batch);
+    for (i = 0; i < workers.size(); i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
 bool buildInstrumentation(void* addr, FPSemantics *inst, PatchFunction *func, PatchBlock *block)
 {
     vector<Snippet::Ptr> preHandlers;
@@ -1404,12 +1598,22 @@ bool buildInstrumentation(void* addr, FPSemantics *inst, PatchFunction *func, Pa
     bool preNeedsRegisters = false;
     bool postNeedsRegisters = false;
     bool replaced = false;
+    bool blockCounted = false;
+    FPInstPlan localPlan;
+    FPInstPlan *plan = &localPlan;
 
     if (listFuncs) {
         printf("Instrumenting instruction at %p: %s\n", addr, inst->getDisassembly().c_str());
         printf("  in block %p-%p\n", (void*)block->start(), (void*)block->end());
     }
 
+    // use the decisions from planInstrumentation if there are any
+    if (inst->getIndex() < instPlans.size() && instPlans[inst->getIndex()].planned) {
+        plan = &instPlans[inst->getIndex()];
+    } else {
+        planInstruction(inst, localPlan);
+    }
+
     if (configuration->hasReplaceTagTree()) {
 
         // if there is a configuration tree, do what it
@@ -1419,17 +1623,35 @@ bool buildInstrumentation(void* addr, FPSemantics *inst, PatchFunction *func, Pa
         // need to add a handler here (as well as all the associated changes in
         // FPConfig)
         //
-        FPReplaceEntryTag tag = configuration->getReplaceTag(addr);
+        FPReplaceEntryTag tag = plan->tag;
         assert(tag != RETAG_CANDIDATE);
         if (tag == RETAG_NULL) {
             preHandlers.push_back(PatchAPI::convert(new BPatch_nullExpr()));
             logfile->addMessage(STATUS, 0, "Inserted null pre-instrumentation.", "", "", inst);
         } else if (tag == RETAG_CINST) {
-            buildPreInstrumentation(inst, FPAnalysisCInst::getInstance(), preHandlers, preNeedsRegisters);
+            if (FPAnalysisCInst::getInstance()->isCountedByBlock(inst)) {
+                FPAnalysisCInst::getInstance()->addToBlock(inst);
+                blockCounted = true;
+            } else if (FPAnalysisCInst::getInstance()->shouldReplace(inst)) {
+                buildReplacement(addr, inst, block, FPAnalysisCInst::getInstance());
+                replaced = true;
+            } else {
+                buildPreInstrumentation(inst, FPAnalysisCInst::getInstance(), preHandlers, preNeedsRegisters);
+            }
         } else if (tag == RETAG_DCANCEL) {
-            buildPreInstrumentation(inst, FPAnalysisDCancel::getInstance(), preHandlers, preNeedsRegisters);
+            if (plan->inlineCheck) {
+                buildReplacement(addr, inst, block, FPAnalysisDCancel::getInstance());
+                replaced = true;
+            } else {
+                buildPreInstrumentation(inst, FPAnalysisDCancel::getInstance(), preHandlers, preNeedsRegisters);
+            }
         } else if (tag == RETAG_DNAN) {
-            buildPreInstrumentation(inst, FPAnalysisDNan::getInstance(), preHandlers, preNeedsRegisters);
+            if (plan->inlineCheck) {
+                buildReplacement(addr, inst, block, FPAnalysisDNan::getInstance());
+                replaced = true;
+            } else {
+                buildPreInstrumentation(inst, FPAnalysisDNan::getInstance(), preHandlers, preNeedsRegisters);
+            }
         } else if (tag == RETAG_TRANGE) {
             buildReplacement(addr, inst, block, FPAnalysisTRange::getInstance());
             replaced = true;
@@ -1446,24 +1668,30 @@ bool buildInstrumentation(void* addr, FPSemantics *inst, PatchFunction *func, Pa
     } else {
 
         // for each analysis
-        vector<FPAnalysis*>::iterator a;
-        for (a = activeAnalyses.begin(); a != activeAnalyses.end(); a++) {
+        for (size_t a = 0; a < activeAnalyses.size(); a++) {
 
-            if ((*a)->shouldReplace(inst)) {
+            if (plan->replaceMask & (1UL << a)) {
 
                 // can only replace once
                 assert(!replaced);
-                buildReplacement(addr, inst, block, *a);
+                buildReplacement(addr, inst, block, activeAnalyses[a]);
                 replaced = true;
             }
 
-            if ((*a)->shouldPreInstrument(inst)) {
-                buildPreInstrumentation(inst, *a, preHandlers, preNeedsRegisters);
+            if (plan->preMask & (1UL << a)) {
+                buildPreInstrumentation(inst, activeAnalyses[a], preHandlers, preNeedsRegisters);
             }
-            if ((*a)->shouldPostInstrument(inst)) {
-                buildPostInstrumentation(inst, *a, postHandlers, postNeedsRegisters);
+            if (plan->postMask & (1UL << a)) {
+                buildPostInstrumentation(inst, activeAnalyses[a], postHandlers, postNeedsRegisters);
             }
         }
+
+        // instructions counted by their block leader need no instrumentation
+        // for c_inst, but they still need to be registered
+        if (FPAnalysisCInst::getInstance()->isCountedByBlock(inst)) {
+            FPAnalysisCInst::getInstance()->addToBlock(inst);
+            blockCounted = true;
+        }
     }
 
     // add register handlers
@@ -1491,7 +1719,7 @@ bool buildInstrumentation(void* addr, FPSemantics *inst, PatchFunction *func, Pa
         postPoint->pushBack(*k);
     }
 
-    if (replaced || (preHandlers.size() + postHandlers.size() > 0)) {
+    if (replaced || blockCounted || (preHandlers.size() + postHandlers.size() > 0)) {
         // update instrumentation counts
         total_instrumented_instructions++;
         return true;
@@ -1540,22 +1768,19 @@ void instrumentInstruction(void* addr, unsigned char *bytes, size_t nbytes,
         
         if (buildInstrumentation(addr, inst, func, block)) {
 
-            // get instruction bytes and save to mutatee address
-            // space
+            // add instruction to registration table (embedded in the
+            // mutatee later; see embedRegistrationTable)
             //printf("saving instruction registration #%ld [%p]:  %s\n",
                     //inst->getIndex(), addr, inst->getDisassembly().c_str());
-            BPatch_constExpr *bytesExpr = saveStringToBinary((char*)bytes, nbytes);
-            assert(bytesExpr != NULL);
             //FPDecoderXED::printInstBytes(stdout, bytes, nbytes);
-
-            // add registration call to init snippets
-            BPatch_Vector<BPatch_snippet*> *regArgs = new BPatch_Vector<BPatch_snippet*>();
-            regArgs->push_back(new BPatch_constExpr(inst->getIndex()));
-            regArgs->push_back(new BPatch_constExpr(addr));
-            regArgs->push_back(bytesExpr);
-            regArgs->push_back(new BPatch_constExpr(nbytes));
-            BPatch_funcCallExpr *regInst = new BPatch_funcCallExpr(*regFunc, *regArgs);
-            initSnippets.push_back(regInst);
+            FPRegistrationEntry entry;
+            assert(nbytes <= FP_REG_ENTRY_MAX_BYTES);
+            memset(&entry, 0, sizeof(FPRegistrationEntry));
+            entry.iidx = (uint64_t)inst->getIndex();
+            entry.addr = (uint64_t)addr;
+            entry.nbytes = (uint8_t)nbytes;
+            memcpy(entry.bytes, bytes, nbytes);
+            regTable.push_back(entry);
 
         }
     }
@@ -1571,9 +1796,36 @@ void instrumentBasicBlock(BPatch_function * function, BPatch_basicBlock *block,
     unsigned char bytes[MAX_RAW_INSN_SIZE];
     size_t nbytes, i;
 
-    // iterate backwards (PatchAPI restriction)
     PatchBlock::Insns insns;
     PatchAPI::convert(block)->getInsns(insns);
+
+    // in block counting mode, the first instruction that c_inst would count
+    // also counts the rest of the block
+    FPAnalysisCInst *cinst = FPAnalysisCInst::getInstance();
+    if (cinst->isBlockCounting()) {
+        FPSemantics *leader = NULL;
+        PatchBlock::Insns::iterator k;
+        for (k = insns.begin(); k != insns.end() && leader == NULL; k++) {
+            addr = (void*)((*k).first);
+            iptr = (*k).second;
+            nbytes = iptr->size();
+            assert(nbytes <= MAX_RAW_INSN_SIZE);
+            for (i=0; i<nbytes; i++) {
+                bytes[i] = iptr->rawByte(i);
+            }
+            if (!mainDecoder->filter(bytes, nbytes)) {
+                continue;
+            }
+            FPSemantics *inst = mainDecoder->lookupByAddr(addr);
+            if (inst && inst->isValid() && (!configuration->hasReplaceTagTree() ||
+                        configuration->getReplaceTag(addr) == RETAG_CINST)) {
+                leader = inst;
+            }
+        }
+        cinst->setBlockLeader(leader);
+    }
+
+    // iterate backwards (PatchAPI restriction)
     //PatchBlock::Insns::iterator j;
     PatchBlock::Insns::reverse_iterator j;
     //for (j = insns.begin(); j != insns.end(); j++) {
@@ -1596,6 +1848,10 @@ void instrumentBasicBlock(BPatch_function * function, BPatch_basicBlock *block,
                     initSnippets);
         }
     }
+
+    if (cinst->isBlockCounting()) {
+        cinst->setBlockLeader(NULL);
+    }
 }
 
 void instrumentFunction(BPatch_function *function, BPatch_Vector<BPatch_snippet*> &initSnippets)
@@ -1693,8 +1949,9 @@ void instrumentApplication()
     initFunc       = getAnalysisFunction("_INST_init_analysis");
     enableFunc     = getAnalysisFunction("_INST_enable_analysis");
     setFunc        = getAnalysisFunction("_INST_set_config");
-    setReplaceFunc = getAnalysisFunction("_INST_set_config_replace_entry");
+    setReplaceTagsFunc = getAnalysisFunction("_INST_set_config_replace_tags");
     regFunc        = getAnalysisFunction("_INST_register_inst");
+    regTableFunc   = getAnalysisFunction("_INST_register_inst_table");
     handlePreFunc  = getAnalysisFunction("_INST_handle_pre_analysis");
     handlePostFunc = getAnalysisFunction("_INST_handle_post_analysis");
     handleReplFunc = getAnalysisFunction("_INST_handle_replacement");
@@ -1759,6 +2016,11 @@ void instrumentApplication()
         instrumentModule(*m, initSnippets);
     }
 
+    // register all instrumented instructions (after initialization)
+    if (regTable.size() > 0) {
+        initSnippets.push_back(embedRegistrationTable());
+    }
+
     // embed configuration entries and add an initialization call for each;
     // since we need to insert them at the very beginning of initSnippets,
     // add them in reverse order so that they'll be in the correct order in
@@ -1774,27 +2036,14 @@ void instrumentApplication()
         initSnippets.insert(initSnippets.begin(), initConfigEntry);
     }
     
-    // special handling for replacement configuration entries since we don't
-    // want to have to allocate an entire string for them; again,
-    // add them in reverse order so that they'll be in the correct order in
-    // the binary
-    vector<FPReplaceEntry*> rentries;
-    configuration->getAllReplaceEntries(rentries);
-    vector<FPReplaceEntry*>::reverse_iterator renti;
-    for (renti = rentries.rbegin(); renti != rentries.rend(); renti++) {
-        BPatch_Vector<BPatch_snippet*> *initReplaceArgs = new BPatch_Vector<BPatch_snippet*>();
-        FPReplaceEntry *entry = *renti;
-        //printf("adding replace entry: %s\n", entry->toString().c_str());
-        BPatch_constExpr idxExpr (entry->idx);
-        BPatch_constExpr addrExpr(entry->address);
-        BPatch_constExpr typeExpr(entry->type);
-        BPatch_constExpr tagExpr (entry->getEffectiveTag());
-        initReplaceArgs->push_back(&idxExpr);
-        initReplaceArgs->push_back(&addrExpr);
-        initReplaceArgs->push_back(&typeExpr);
-        initReplaceArgs->push_back(&tagExpr);
-        BPatch_funcCallExpr *initReplaceEntry = new BPatch_funcCallExpr(*setReplaceFunc, *initReplaceArgs);
-        initSnippets.insert(initSnippets.begin(), initReplaceEntry);
+    // replacement configuration entries are only needed as resolved tags at
+    // run time, so embed those as a single table (this goes before the
+    // settings, like the individual entries used to)
+    if (configuration->hasReplaceTagTree()) {
+        BPatch_snippet *tagTable = embedReplaceTagTable();
+        if (tagTable) {
+            initSnippets.insert(initSnippets.begin(), tagTable);
+        }
     }
 
     // generate application report
@@ -1887,10 +2136,30 @@ void instrumentApplication()
  * the instruction IDs to be sequential to match config files created by fpconf.
  */
 
+/**
+ * With multiple decoding threads (-j), the CFG walk (which uses Dyninst and
+ * must stay serial) only records each instruction; the XED decoding happens
+ * afterwards in parallel (see FPDecoderXED::decodeDeferred). These are the
+ * copies of the instruction bytes that are kept alive until then.
+ */
+vector<unsigned char*> deferredBytes;
+
 void decodeInstruction(void* addr, unsigned char *bytes, size_t nbytes)
 {
     iidx++;
     total_fp_instructions++;
+
+    if (decodeThreads > 1 && !listFuncs) {
+        unsigned char *copy = (unsigned char*)malloc(nbytes);
+        if (!copy) {
+            fprintf(stderr, "OUT OF MEMORY!\n");
+            exit(-1);
+        }
+        memcpy(copy, bytes, nbytes);
+        deferredBytes.push_back(copy);
+        ((FPDecoderXED*)mainDecoder)->defer(iidx, addr, copy, nbytes);
+        return;
+    }
     
     FPSemantics *inst = mainDecoder->decode(iidx, addr, bytes, nbytes);
 
@@ -2027,6 +2296,15 @@ void decodeApplication()
 
         decodeModule(*m, modname);
     }
+
+    // finish any decoding that was deferred (see decodeInstruction)
+    if (!deferredBytes.empty()) {
+        ((FPDecoderXED*)mainDecoder)->decodeDeferred(decodeThreads);
+        for (size_t i = 0; i < deferredBytes.size(); i++) {
+            free(deferredBytes[i]);
+        }
+        deferredBytes.clear();
+    }
 }
 
 // }}}
@@ -2053,8 +2331,14 @@ void usage()
     printf("\n");
     printf(" Options:\n");
     printf("\n");
-    printf("  -c <filename>        use the specified base configuration file (default is \"base.cfg\")\n");
+    printf("  -B                   block counting mode (c_inst counts basic blocks and derives instruction counts)\n");
+    printf("  -c <filename>        use the specified base configuration file (text or binary; default is \"base.cfg\")\n");
     printf("  -C \"<key>=<value>\"   add the given additional setting to the configuration\n");
+    printf("                         (e.g., \"log_mode=crashsafe\" to flush the log after every message;\n");
+    printf("                          other modes are \"buffered\" (default) and \"thread\"; or\n");
+    printf("                          \"log_format=binary\" to write a binary log (see fplog2xml); or\n");
+    printf("                          \"snapshot_interval=<ms>\" to stream counters to a side file (see fpsnapdump))\n");
+    printf("  -D <filename>        use (and update) the given decoded instruction cache file\n");
     //printf("  -d                   detect cancellations (only activated with shadow/pointer value analyses)\n");
     printf("  -e <function-name>   print the summary on exit from a specific function (default is \"main\")\n");
     printf("                         (NOTE: -e is ignored if _fini can be used instead)\n");
@@ -2063,12 +2347,18 @@ void usage()
 #if INCLUDE_DEBUG
     printf("  -g                   enable debug output (only activated with shadow/pointer value analyses)\n");
 #endif
+    printf("  -I                   incremental mode: instrument all in-place replacement candidates once and\n");
+    printf("                         read the single/double tags at run time (from $CRAFT_CONFIG or the -c file;\n");
+    printf("                         sv_inp or r_prec only)\n");
     printf("  -i                   instrument only (don't run the instrumented program)\n");
+    printf("  -j <n>               decode instructions and make instrumentation decisions using <n> threads\n");
+    printf("                         (default is 1; ignored with -l)\n");
     printf("  -k                   conservative mode (saves entire x87/SSE state outside libfpanalysis)\n");
     printf("  -l                   list all instrumented functions\n");
     printf("  -L <filename>        write to specified log file\n");
     printf("  -m                   detect mismatches (only activated with shadow/pointer value analyses)\n");
-    printf("  -M                   multicore mode (use LOCK prefix for INC instructions)\n");
+    printf("  -M                   multicore mode (use per-thread sharded instruction counters; not\n");
+    printf("                         available with -p)\n");
     printf("  -N                   enable FORTRAN mode (instrument inst_fortran_report instead of printf)\n");
     printf("  -o <filename>        output to specified filename (default is \"mutant\")\n");
     printf("  -p                   run as process instead of using binary rewriter\n");
@@ -2079,6 +2369,7 @@ void usage()
     printf("  -t                   optimize analysis with faster routines for some instructions\n");
     printf("  -T                   specify a tag that is appended to log file names\n");
     printf("  -w                   enable stack walks/traces (only activated with cancellation detection)\n");
+    printf("                         (sampled per instruction; see \"stwalk_max_per_inst\" and \"stwalk_sample_rate\")\n");
     printf("  -y                   insert symbols for instrumentation stack frames (high disk overhead!)\n");
     printf("\n");
 }
@@ -2139,12 +2430,16 @@ bool parseCommandLine(unsigned argc, char *argv[])
 			saveFPR = true;
 		} else if (strcmp(argv[i], "-i")==0) {
 			instOnly = true;
+		} else if (strcmp(argv[i], "-I")==0) {
+			incrementalMode = true;
 		} else if (strcmp(argv[i], "-t")==0) {
 			fastInst = true;
 		} else if (strcmp(argv[i], "-m")==0) {
 			mismatches = true;
 		} else if (strcmp(argv[i], "-M")==0) {
 			multicoreMode = true;
+		} else if (strcmp(argv[i], "-B")==0) {
+			blockCountMode = true;
 		} else if (strcmp(argv[i], "-N")==0) {
 			fortranMode = true;
 		} else if (strcmp(argv[i], "-d")==0) {
@@ -2173,6 +2468,13 @@ bool parseCommandLine(unsigned argc, char *argv[])
             logFile = argv[++i];
 		} else if (strcmp(argv[i], "-T")==0 && i < argc-1) {
             logTag = argv[++i];
+		} else if (strcmp(argv[i], "-D")==0 && i < argc-1) {
+            decodeCacheFile = argv[++i];
+		} else if (strcmp(argv[i], "-j")==0 && i < argc-1) {
+            decodeThreads = (unsigned)strtoul(argv[++i], NULL, 10);
+            if (decodeThreads == 0) {
+                decodeThreads = 1;
+            }
 		} else if (strcmp(argv[i], "-C")==0 && i < argc-1) {
             extraConfigs.push_back(string(argv[++i]));
 		} else if (strcmp(argv[i], "-e")==0 && i < argc-1) {
@@ -2197,6 +2499,14 @@ bool parseCommandLine(unsigned argc, char *argv[])
 		}
 	}
 
+    // the sharded counter blobs reach their per-thread pointers through
+    // initial-exec TLS, which libfpanalysis only gets when it is linked into
+    // the rewritten binary (not when it is dlopen'd into a running process)
+    if (multicoreMode && process) {
+        printf("ERROR: -M is not supported with -p (use the binary rewriter)\n");
+        exit(EXIT_FAILURE);
+    }
+
     // prepare child arguments (sorry, this is ugly)
     for (i = 0; i < 45; i++) {
         child_argv[i] = (char*)malloc(sizeof(char[50]));
@@ -2214,8 +2524,16 @@ bool parseCommandLine(unsigned argc, char *argv[])
 // }}}
 
 
+double elapsedSeconds(struct timeval &start, struct timeval &end)
+{
+    return (double)(end.tv_sec - start.tv_sec) +
+           (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
 int main(int argc, char *argv[])
 {
+    struct timeval phaseStart, phaseEnd;
+
     // enable to get profiling data on the instrumenter
     //_INST_begin_profiling();
 
@@ -2236,6 +2554,35 @@ int main(int argc, char *argv[])
     printf("Reading default configuration from %s\n", configFile);
     configuration = new FPConfig(configFile);
     setup_config_file(configuration);
+    configuration->buildReplaceTagTable();
+
+    // incremental mode hands every candidate to sv_inp, whose blobs (like
+    // r_prec's run-time masks) can switch precision without re-instrumenting;
+    // no other analysis reads its settings at run time
+    if (incrementalMode) {
+        bool runtimeEnabled = false;
+        for (size_t aidx=0; aidx < (size_t)TOTAL_ANALYSIS_COUNT; aidx++) {
+            string tag = allAnalysisInfo[aidx].instance->getTag();
+            if (!fpinstAnalysisEnabled[aidx]) {
+                continue;
+            } else if (tag == "sv_inp" || tag == "r_prec") {
+                runtimeEnabled = true;
+            } else {
+                printf("ERROR: -I is not supported with %s (only sv_inp or r_prec)\n", tag.c_str());
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (!runtimeEnabled) {
+            printf("ERROR: -I requires sv_inp or r_prec\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (configuration->getValue("log_format") == "binary") {
+        logfile->setFormat(LOG_BINARY);
+    }
+    if (configuration->hasValue("log_mode")) {
+        logfile->setWriteMode(FPLog::str2WriteMode(configuration->getValue("log_mode")));
+    }
 
     // initialize analysis stubs
     initializeActiveAnalyses();
@@ -2257,6 +2604,24 @@ int main(int argc, char *argv[])
     mainDecoder = new FPDecoderXED();       // use Intel's decoder from Pin
     //mainDecoder = new FPDecoderIAPI();    // use Dyninst's InstructionAPI
 
+    // use a persistent decode cache if requested (and pass it on to the
+    // runtime library)
+    if (decodeCacheFile) {
+        char cachePath[PATH_MAX];
+        if (realpath(decodeCacheFile, cachePath) == NULL) {
+            strncpy(cachePath, decodeCacheFile, PATH_MAX-1);
+            cachePath[PATH_MAX-1] = '\0';
+        }
+        string cacheKey = FPDecodeCache::computeBinaryKey(binary);
+        FPDecodeCache *cache = new FPDecodeCache(cachePath, cacheKey, true);
+        if (cache->load()) {
+            printf("Loaded decode cache from %s\n", cachePath);
+        }
+        ((FPDecoderXED*)mainDecoder)->setCache(cache);
+        configuration->setValue("decode_cache", cachePath);
+        configuration->setValue("decode_cache_key", cacheKey);
+    }
+
 	// start/open application
 	BPatch_addressSpace *app;
 	printf("Opening file: %s\n", binary);
@@ -2326,8 +2691,26 @@ int main(int argc, char *argv[])
     // perform instrumentation (agnostic to process/rewrite status)
     printf("Configuration:\n%s", configuration->getSummary().c_str());
     printf("Instrumenting application ...\n");
+    gettimeofday(&phaseStart, NULL);
     decodeApplication();
+    ((FPDecoderXED*)mainDecoder)->buildAddressIndex();
+    if (decodeThreads > 1 && !listFuncs) {
+        planInstrumentation(decodeThreads);
+    }
+    gettimeofday(&phaseEnd, NULL);
+    printf("Decoding time: %.3f sec\n", elapsedSeconds(phaseStart, phaseEnd));
+    if (decodeCacheFile) {
+        FPDecodeCache *cache = ((FPDecoderXED*)mainDecoder)->getCache();
+        printf("Decode cache: %lu hit(s), %lu miss(es)\n",
+                (unsigned long)cache->getNumHits(), (unsigned long)cache->getNumMisses());
+        if (cache->isModified() && !cache->save()) {
+            printf("WARNING: Unable to write decode cache to %s\n", cache->getPath().c_str());
+        }
+    }
+    gettimeofday(&phaseStart, NULL);
     instrumentApplication();
+    gettimeofday(&phaseEnd, NULL);
+    printf("Instrumentation time: %.3f sec\n", elapsedSeconds(phaseStart, phaseEnd));
     printf("Instrumentation complete!\n");
 
     // finalize log file
@@ -0,0 +1,175 @@
+/*
+ * fplog2xml.cpp
+ *
+ * Converts binary log files (log_format=binary) to the XML log format read by
+ * the viewer and scripts
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FPLogBinary.h"
+
+using namespace FPInst;
+
+// must match FPLogMsgType and FPLog::msgType2Str
+static const char *msgType2Str(uint32_t type)
+{
+    switch (type) {
+        case 0: return "Status";
+        case 1: return "Error";
+        case 2: return "Warning";
+        case 3: return "Summary";
+        case 4: return "Cancellation";
+        case 5: return "InstCount";
+        case 6: return "ShadowVal";
+        default: return "Unknown";
+    }
+}
+
+static const char *base = NULL;
+static uint64_t stringsEnd = 0;
+
+static const char *getString(uint64_t offset)
+{
+    // offsets point into string records; make sure the string is terminated
+    // inside the readable part of the file
+    if (base == NULL || offset < sizeof(FPLogBinaryHeader) || offset >= stringsEnd ||
+            memchr(base + offset, '\0', stringsEnd - offset) == NULL) {
+        return "";
+    }
+    return base + offset;
+}
+
+static void printMessage(FILE *fout, FPLogBinaryMessage *m)
+{
+    fprintf(fout, "<message time=\"%ld\" priority=\"%ld\" type=\"%s\">\n",
+            (long)m->time, (long)m->priority, msgType2Str(m->type));
+    if (m->label != 0) {
+        fprintf(fout, "<label>%s</label>\n", getString(m->label));
+    }
+    if (m->details != 0) {
+        fprintf(fout, "<details>%s</details>\n", getString(m->details));
+    }
+    if (m->trace != 0) {
+        fprintf(fout, "<trace_id>%u</trace_id>\n", (unsigned)m->trace);
+    }
+    if (m->inst >= 0) {
+        fprintf(fout, "<inst_id>%ld</inst_id>\n", (long)m->inst);
+    }
+    fprintf(fout, "</message>\n");
+}
+
+static void printInst(FILE *fout, FPLogBinaryInst *in)
+{
+    fprintf(fout, "<instruction id=\"%lu\" address=\"%p\"",
+            (unsigned long)in->id, (void*)in->address);
+    if (in->function != 0) {
+        fprintf(fout, " function=\"%s\"", getString(in->function));
+    }
+    if (in->lineno >= 0) {
+        fprintf(fout, " file=\"%s\" lineno=\"%ld\"",
+                getString(in->file), (long)in->lineno);
+    }
+    fprintf(fout, ">\n<disassembly>\n%s\n</disassembly>\n",
+            getString(in->disassembly));
+    fprintf(fout, "<text>\n%s\n</text>\n</instruction>\n", getString(in->text));
+}
+
+int main(int argc, char *argv[])
+{
+    struct stat st;
+    FPLogBinaryHeader *header;
+    FPLogBinaryRecord *rec;
+    uint64_t pos, end;
+    FILE *fout = stdout;
+    size_t size;
+
+    if (argc < 2 || argc > 3) {
+        printf("\nUsage:  fplog2xml <binary-log> [<xml-log>]\n");
+        printf(" Converts a binary log file to XML (written to standard output by default).\n\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FPLogBinaryHeader)) {
+        fprintf(stderr, "ERROR: Unable to read %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    size = (size_t)st.st_size;
+    base = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Unable to map %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    header = (FPLogBinaryHeader*)base;
+    if (memcmp(header->magic, FP_LOG_BINARY_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != FP_LOG_BINARY_VERSION) {
+        fprintf(stderr, "ERROR: %s is not a binary log file\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (header->recordsEnd == 0) {
+        // log was not closed; recover every complete record
+        fprintf(stderr, "WARNING: %s is incomplete; traces and instructions may be missing\n",
+                argv[1]);
+        pos = sizeof(FPLogBinaryHeader);
+        end = size;
+    } else {
+        if (header->recordsEnd > size || header->recordsOffset > header->recordsEnd) {
+            fprintf(stderr, "ERROR: %s is corrupt\n", argv[1]);
+            exit(EXIT_FAILURE);
+        }
+        pos = header->recordsOffset;
+        end = header->recordsEnd;
+    }
+    stringsEnd = end;
+
+    if (argc == 3) {
+        fout = fopen(argv[2], "w");
+        if (!fout) {
+            fprintf(stderr, "ERROR: Unable to write %s\n", argv[2]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (header->appname != 0) {
+        fprintf(fout, "<log appname=\"%s\">\n", getString(header->appname));
+    } else {
+        fprintf(fout, "<log>\n");
+    }
+    while (pos + sizeof(FPLogBinaryRecord) <= end) {
+        rec = (FPLogBinaryRecord*)(base + pos);
+        pos += sizeof(FPLogBinaryRecord);
+        if (rec->size > end - pos) {
+            break;      // partially written
+        }
+        if (rec->kind == FP_LOG_RECORD_MESSAGE &&
+                rec->size >= sizeof(FPLogBinaryMessage)) {
+            printMessage(fout, (FPLogBinaryMessage*)(base + pos));
+        } else if (rec->kind == FP_LOG_RECORD_TRACE &&
+                rec->size >= sizeof(FPLogBinaryTrace)) {
+            FPLogBinaryTrace *t = (FPLogBinaryTrace*)(base + pos);
+            fprintf(fout, "<trace id=\"%lu\">\n%s</trace>\n",
+                    (unsigned long)t->id, getString(t->text));
+        } else if (rec->kind == FP_LOG_RECORD_INST &&
+                rec->size >= sizeof(FPLogBinaryInst)) {
+            printInst(fout, (FPLogBinaryInst*)(base + pos));
+        }
+        pos += rec->size;
+    }
+    fprintf(fout, "</log>\n");
+
+    if (fout != stdout) {
+        fclose(fout);
+    }
+    munmap((void*)base, size);
+    return(EXIT_SUCCESS);
+}
+
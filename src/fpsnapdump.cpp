@@ -0,0 +1,132 @@
+/*
+ * fpsnapdump.cpp
+ *
+ * Prints the counter snapshots written when snapshot_interval is set (see
+ * FPSnapshotFile.h) as comma-separated values
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+
+#include "FPSnapshotFile.h"
+
+using namespace std;
+using namespace FPInst;
+
+void usage()
+{
+    printf("\nUsage:  fpsnapdump [-l] <snapshot-file>\n");
+    printf(" Prints counter snapshots as CSV (seq,time_usec,analysis,kind,inst_id,value).\n");
+    printf(" Each snapshot lists the counters that changed, with their current values.\n");
+    printf(" The file may still be growing; a partially-written last record is ignored.\n");
+    printf("Options:\n");
+    printf("\n");
+    printf("  -l                   only print the latest values of all counters\n");
+    printf("\n");
+}
+
+static const char *kind2Str(uint64_t kind)
+{
+    switch (kind) {
+        case SNAPSHOT_COUNT:    return "count";
+        case SNAPSHOT_CANCELS:  return "cancels";
+        default:                return "unknown";
+    }
+}
+
+static void printEntry(FPSnapshotHeader *header, FPSnapshotRecord *rec,
+        uint64_t key, uint64_t value)
+{
+    uint64_t analysis = FP_SNAPSHOT_ANALYSIS(key);
+    printf("%lu,%lu,%s,%s,%lu,%lu\n",
+            (unsigned long)rec->seq, (unsigned long)rec->time,
+            analysis < header->numAnalyses ? header->tags[analysis] : "unknown",
+            kind2Str(FP_SNAPSHOT_KIND(key)),
+            (unsigned long)FP_SNAPSHOT_IIDX(key), (unsigned long)value);
+}
+
+int main(int argc, char *argv[])
+{
+    FPSnapshotHeader header;
+    FPSnapshotRecord rec, lastRec;
+    FPSnapshotEntry *entries = NULL;
+    uint64_t capacity = 0, dropped = 0, j;
+    map<uint64_t, uint64_t> values;     // current value of each counter
+    map<uint64_t, uint64_t>::iterator v;
+    const char *filename = NULL;
+    bool latestOnly = false;
+    FILE *fin;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0) {
+            latestOnly = true;
+        } else if (argv[i][0] != '-' && filename == NULL) {
+            filename = argv[i];
+        } else {
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (filename == NULL) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    fin = fopen(filename, "rb");
+    if (!fin || fread(&header, sizeof(header), 1, fin) != 1) {
+        fprintf(stderr, "ERROR: Unable to read %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    if (memcmp(header.magic, FP_SNAPSHOT_MAGIC, strlen(FP_SNAPSHOT_MAGIC)) != 0 ||
+            header.version != FP_SNAPSHOT_VERSION ||
+            header.numAnalyses > FP_SNAPSHOT_MAX_ANALYSES) {
+        fprintf(stderr, "ERROR: %s is not a snapshot file\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < (int)header.numAnalyses; i++) {
+        header.tags[i][FP_SNAPSHOT_TAG_LEN-1] = '\0';
+    }
+
+    // records hold increments; accumulate them in order
+    memset(&lastRec, 0, sizeof(lastRec));
+    while (fread(&rec, sizeof(rec), 1, fin) == 1) {
+        if (rec.numEntries > capacity) {
+            capacity = rec.numEntries;
+            entries = (FPSnapshotEntry*)realloc(entries, capacity * sizeof(FPSnapshotEntry));
+            if (!entries) {
+                fprintf(stderr, "OUT OF MEMORY!\n");
+                exit(-1);
+            }
+        }
+        if (rec.numEntries > 0 &&
+                fread(entries, sizeof(FPSnapshotEntry), rec.numEntries, fin) != rec.numEntries) {
+            break;      // still being written
+        }
+        dropped = rec.dropped;
+        for (j = 0; j < rec.numEntries; j++) {
+            uint64_t &value = values[entries[j].key];
+            value += entries[j].value;
+            if (!latestOnly) {
+                printEntry(&header, &rec, entries[j].key, value);
+            }
+        }
+        lastRec = rec;
+    }
+    if (latestOnly) {
+        for (v = values.begin(); v != values.end(); v++) {
+            printEntry(&header, &lastRec, v->first, v->second);
+        }
+    }
+    if (dropped > 0) {
+        fprintf(stderr, "NOTE: %lu snapshot(s) were dropped (writer busy or counters resizing)\n",
+                (unsigned long)dropped);
+    }
+
+    fclose(fin);
+    free(entries);
+    return(EXIT_SUCCESS);
+}
@@ -11,14 +11,27 @@
 #include "fpinfo.h"
 
 // standard C/Unix libs
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// placement new for the context pool
+#include <new>
 
 // helpers
 #include "FPContext.h"
+#include "FPCounterShards.h"
 #include "FPConfig.h"
 #include "FPLog.h"
 #include "FPDecoderXED.h"
 #include "FPDecoderIAPI.h"
+#include "FPForkServer.h"
+#include "FPSnapshot.h"
 
 using namespace FPInst;
 
@@ -26,6 +39,7 @@ FPContext *mainContext;
 FPConfig  *mainConfig;
 FPLog     *mainLog;
 FPDecoder *mainDecoder;
+FPDecoderXED *lazyDecoder = NULL;   // non-NULL if decoding is deferred
 
 FPAnalysis *mainNullAnalysis;
 FPAnalysis *allAnalyses[TOTAL_ANALYSIS_COUNT];
@@ -49,10 +63,27 @@ unsigned long *_INST_reg_r13;
 unsigned long *_INST_reg_r14;
 unsigned long *_INST_reg_r15;
 
+// per-thread contexts; the register pointers above refer to the fields of the
+// first context, and instrumentation offsets them by the Dyninst thread index
+// (in units of sizeof(FPContext)) to reach the context for the current thread.
+// The pool is one reserved mapping (so it never moves); the first max_threads
+// contexts are constructed at initialization and the rest on first use.
+const size_t DEFAULT_MAX_THREADS = 256;
+const size_t CONTEXT_POOL_SLOTS = 16384;
+FPContext *_INST_context_pool = NULL;
+bool *_INST_context_ready = NULL;
+size_t _INST_context_slots = 0;
+size_t _INST_max_threads = 0;
+__thread FPContext *_INST_thread_context = NULL;
+
 //static const char *DEFAULT_LOG_FILE = "analysis.log";
 
 const size_t LOG_FILENAME_LEN = 2048;
 char _INST_log_file[LOG_FILENAME_LEN] = "output.log";
+char _INST_snapshot_file[LOG_FILENAME_LEN] = "";
+
+FPSnapshot *mainSnapshot = NULL;    // non-NULL if snapshots are enabled
+size_t _INST_num_insts = 0;         // one more than the largest instruction index
 
 size_t analysisCount;
 size_t _INST_count;
@@ -73,6 +104,14 @@ size_t _INST_fast_count;
 #endif
 void _INST_alarm_handler(int /*sig*/, siginfo_t* /*info*/, void* /*context*/)
 {
+    // stream counters (take() skips and counts ticks that land during a
+    // resize of the per-instruction arrays)
+    if (mainSnapshot) {
+        int savedErrno = errno;
+        mainSnapshot->take();
+        errno = savedErrno;
+    }
+
     /*
      *if (_INST_Main_PointerAnalysis != NULL) {
      *    fprintf(stderr,
@@ -114,6 +153,52 @@ void _INST_null() {
     return;
 }
 
+/**
+ * Construct the context for a thread index beyond the ones set up at
+ * initialization. The constructor allocates memory, so the application's FPU
+ * state is saved and restored around it (the caller has not saved it yet).
+ */
+static void __attribute__((noinline)) _INST_construct_context(long tidx)
+{
+    char buffer[512+16];
+    char *state = (char*)(((unsigned long)buffer + 15) & ~15UL);
+    __asm__ ("fxsave %0;" : "=m" (*(char (*)[512])state));
+    new (&_INST_context_pool[tidx]) FPContext();
+    _INST_context_ready[tidx] = true;
+    __asm__ ("fxrstor %0;" : : "m" (*(char (*)[512])state));
+}
+
+/**
+ * Look up the context for the given thread index and bind it (as well as the
+ * analyses' context pointer) to the calling thread if necessary.
+ */
+FPContext* _INST_get_context(long tidx)
+{
+    if (_INST_thread_context == NULL) {
+        if (tidx < 0 || (size_t)tidx >= _INST_context_slots) {
+            fprintf(stderr, "ERROR - thread index %ld exceeds context pool size (%lu)\n",
+                    tidx, (unsigned long)_INST_context_slots);
+            exit(-1);
+        }
+        if (!_INST_context_ready[tidx]) {
+            _INST_construct_context(tidx);
+        }
+        _INST_thread_context = &_INST_context_pool[tidx];
+        FPAnalysis::context = _INST_thread_context;
+    }
+    return _INST_thread_context;
+}
+
+/**
+ * Checked by the function replacement guards: calls are only redirected while
+ * the analysis is enabled and the calling thread is not inside the library.
+ */
+long _INST_replacement_enabled()
+{
+    return (_INST_status == _INST_INACTIVE &&
+            _INST_thread_status != _INST_ACTIVE) ? 1 : 0;
+}
+
 void _INST_sigsegv_handler(int)
 {
     fprintf(stderr, "handling SIGSEGV\n");
@@ -125,41 +210,148 @@ void _INST_sigsegv_handler(int)
 
 void _INST_set_config (char* setting)
 {
-    _INST_status = _INST_ACTIVE;
+    _INST_enter_library();
     FPConfig::getMainConfig()->addSetting(setting);
-    _INST_status = _INST_INACTIVE;
+    _INST_leave_library();
 }
 
-void _INST_set_config_replace_entry (size_t idx, void* address, int type, int tag)
+void _INST_set_config_replace_tags (FPConfigFileTag *tags, long count)
 {
-    _INST_status = _INST_ACTIVE;
-    FPReplaceEntry *entry = new FPReplaceEntry((FPReplaceEntryType)type, idx);
-    entry->address = address;
-    entry->tag = (FPReplaceEntryTag)tag;
-    FPConfig::getMainConfig()->addReplaceEntry(entry);
-    _INST_status = _INST_INACTIVE;
+    // the table lives in the rewritten binary and is searched in place
+    _INST_enter_library();
+    FPConfig::getMainConfig()->useReplaceTagTable(tags, (size_t)count);
+    _INST_leave_library();
 }
 
-void _INST_begin_profiling ()
+void _INST_register_decoded_inst (FPSemantics *inst)
+{
+    size_t i;
+    for (i=0; i<analysisCount; i++) {
+        allAnalyses[i]->registerInstruction(inst);
+    }
+}
+
+void _INST_handle_inline_dcancel(long iidx, long opIdx, long setIdx,
+        unsigned long bits1, unsigned long bits2)
+{
+    // called directly from the inline d_cancel blobs, which have already
+    // saved the FPU state
+    _INST_enter_library();
+    FPAnalysisDCancel::getInstance()->handleInlineCancellation(
+            mainDecoder->lookup(iidx), (size_t)opIdx, (size_t)setIdx,
+            bits1, bits2);
+    _INST_leave_library();
+}
+
+void _INST_handle_inline_dnan(long iidx, long opIdx, long setIdx, long inIdx,
+        unsigned long bits)
+{
+    // called directly from the inline d_nan blobs
+    _INST_enter_library();
+    FPAnalysisDNan::getInstance()->handleInlineNaN(
+            mainDecoder->lookup(iidx), (size_t)opIdx, (size_t)setIdx,
+            (size_t)inIdx, bits);
+    _INST_leave_library();
+}
+
+void _INST_publish_handler(const char *key, void *handler)
+{
+    // let the inline blobs start calling out (see
+    // FPAnalysis::allocateHandlerSlot)
+    if (mainConfig->hasValue(key)) {
+        void *handlerAddr = NULL;
+        stringstream ss(mainConfig->getValue(key));
+        ss >> handlerAddr;
+        if (handlerAddr) {
+            *(void**)handlerAddr = handler;
+        }
+    }
+}
+
+/**
+ * Install the SIGPROF handler and arm the profiling timer; profiling and
+ * snapshots share the timer (the last caller picks the interval).
+ */
+void _INST_start_timer(long usec)
 {
     struct sigaction sa;
     sa.sa_sigaction = _INST_alarm_handler;
     sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_SIGINFO;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
     sigaction(SIGPROF, &sa, 0);
+    struct itimerval t;
+    t.it_value.tv_sec     = usec / 1000000;
+    t.it_value.tv_usec    = usec % 1000000;
+    t.it_interval.tv_sec  = usec / 1000000;
+    t.it_interval.tv_usec = usec % 1000000;
+    setitimer(ITIMER_PROF, &t, 0);
+}
+
+void _INST_stop_timer()
+{
     struct itimerval t;
     t.it_value.tv_sec = 0;
+    t.it_value.tv_usec = 0;
     t.it_interval.tv_sec = 0;
-    //t.it_value.tv_usec = 10000;
-    //t.it_interval.tv_usec = 10000;
-    t.it_value.tv_usec    = 500000;  // buzz
-    t.it_interval.tv_usec = 500000;  // buzz
-    //t.it_value.tv_usec = 1000000;
-    //t.it_interval.tv_usec = 1000000;
+    t.it_interval.tv_usec = 0;
     setitimer(ITIMER_PROF, &t, 0);
+}
+
+void _INST_begin_profiling ()
+{
+    //_INST_start_timer(10000);
+    _INST_start_timer(500000);  // buzz
+    //_INST_start_timer(1000000);
     cerr << "FPAnalysis: Registered SIGPROF handler\n";
 }
 
+/**
+ * Start streaming counter snapshots if snapshot_interval (in milliseconds)
+ * is set; the file defaults to the log file name with a ".snap" extension.
+ */
+void _INST_begin_snapshots ()
+{
+    stringstream ss;
+    string filename;
+    long interval = 0;
+
+    if (!mainConfig->hasValue("snapshot_interval")) {
+        return;
+    }
+    ss.clear();
+    ss.str(mainConfig->getValue("snapshot_interval"));
+    ss >> interval;
+    if (interval <= 0) {
+        return;
+    }
+    if (mainConfig->hasValue("snapshot_file")) {
+        filename = mainConfig->getValue("snapshot_file");
+    } else {
+        filename = _INST_log_file;
+        if (filename.length() > 4 && filename.substr(filename.length()-4) == ".log") {
+            filename = filename.substr(0, filename.length()-4);
+        }
+        filename += ".snap";
+    }
+    strncpy(_INST_snapshot_file, filename.c_str(), LOG_FILENAME_LEN-1);
+
+    FPSnapshot *snapshot = FPSnapshot::getInstance();
+    if (!snapshot->open(_INST_snapshot_file, allAnalyses, analysisCount,
+                (_INST_num_insts > 0 ? _INST_num_insts : 1), interval)) {
+        fprintf(stderr, "WARNING - unable to open snapshot file %s\n", _INST_snapshot_file);
+        return;
+    }
+    mainSnapshot = snapshot;
+    _INST_start_timer(interval * 1000);
+
+    ss.clear();
+    ss.str("");
+    ss << "Writing counter snapshots every " << interval << " ms to "
+       << _INST_snapshot_file;
+    mainLog->addMessage(STATUS, 0, "Snapshots enabled.", ss.str(), "");
+    cerr << "FPAnalysis: " << ss.str() << endl;
+}
+
 string sanitize_filename(const char *input)
 {
     string fn = "";
@@ -174,17 +366,81 @@ string sanitize_filename(const char *input)
     return fn;
 }
 
+void _INST_build_log_filename()
+{
+    const char *logfile = mainConfig->getValueC("log_file");
+    const char *appname = mainConfig->getValueC("app_name");
+    const char *tag = getenv("TAG");
+    if (!tag) {
+        tag = mainConfig->getValueC("tag");
+    }
+    if (logfile) {
+        strncpy(_INST_log_file, logfile, LOG_FILENAME_LEN);
+    } else {
+        stringstream log;
+        log.clear();
+        log.str("");
+        if (appname) {
+            log << sanitize_filename(appname) << "-";
+        }
+        if (tag) {
+            log << sanitize_filename(tag) << "-";
+        }
+        char hostname[256] = "";
+        if (gethostname(hostname, 256) == 0) {
+            log << sanitize_filename(hostname) << "-";
+        }
+        log << getpid();
+        log << ".log";
+        strncpy(_INST_log_file, log.str().c_str(), LOG_FILENAME_LEN);
+    }
+}
+
 void _INST_init_analysis ()
 {
     stringstream status;
     status.clear();
     status.str("");
 
-    // default context object
-    mainContext = new FPContext();
+    _INST_enter_library();
+
+    // per-thread context objects (the current thread uses the first one)
+    mainConfig = FPConfig::getMainConfig();
+    _INST_max_threads = DEFAULT_MAX_THREADS;
+    if (mainConfig->hasValue("max_threads")) {
+        status.str(mainConfig->getValue("max_threads"));
+        status >> _INST_max_threads;
+        status.clear(); status.str("");
+        if (_INST_max_threads == 0) {
+            _INST_max_threads = 1;
+        }
+    }
+    _INST_context_slots = _INST_max_threads > CONTEXT_POOL_SLOTS ?
+        _INST_max_threads : CONTEXT_POOL_SLOTS;
+    void *pool = mmap(NULL, _INST_context_slots * sizeof(FPContext),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    _INST_context_ready = (bool*)calloc(_INST_context_slots, sizeof(bool));
+    if (pool == MAP_FAILED || !_INST_context_ready) {
+        fprintf(stderr, "OUT OF MEMORY!\n");
+        exit(-1);
+    }
+    _INST_context_pool = (FPContext*)pool;
+    for (size_t i = 0; i < _INST_max_threads; i++) {
+        new (&_INST_context_pool[i]) FPContext();
+        _INST_context_ready[i] = true;
+    }
+    mainContext = &_INST_context_pool[0];
+    _INST_thread_context = mainContext;
     mainContext->saveAllFPR();
-    _INST_status = _INST_ACTIVE;
-    status << "Initializing analysis using default context." << endl;
+    status << "Initializing analysis using " << _INST_max_threads
+           << " per-thread context(s)." << endl;
+
+    // per-thread instruction counter shards (if any blobs use them)
+    FPCounterShards::getInstance()->initialize(mainConfig, _INST_max_threads);
+    if (FPCounterShards::getInstance()->isInitialized()) {
+        status << "Using " << FPCounterShards::getInstance()->getNumSlots()
+               << " sharded instruction counter(s)." << endl;
+    }
 
     cerr << "FPAnalysis: Initializing..." << endl;
 
@@ -208,44 +464,45 @@ void _INST_init_analysis ()
     _INST_reg_r14 = &mainContext->reg_r14;
     _INST_reg_r15 = &mainContext->reg_r15;
 
-    // main configuration file
+    // main configuration file (all entries have been added by now, so
+    // resolve the replacement tags before any other threads can look them up)
     //mainConfig = new FPConfig("fpinst.cfg");
-    mainConfig = FPConfig::getMainConfig();
+    if (mainConfig->getValue("runtime_tags") == "yes") {
+
+        // incremental mode: the instrumentation covers every candidate, and
+        // the tags come from the current configuration instead
+        const char *tagfile = getenv("CRAFT_CONFIG");
+        if (!tagfile) {
+            tagfile = mainConfig->getValueC("runtime_tag_file");
+        }
+        if (tagfile && mainConfig->loadReplaceTags(tagfile)) {
+            status << "Loaded replacement tags from " << tagfile << endl;
+        } else {
+            status << "WARNING: Unable to load replacement tags from "
+                   << (tagfile ? tagfile : "(none)")
+                   << "; using tags from instrumentation" << endl;
+        }
+    }
+    mainConfig->buildReplaceTagTable();
     status << "Configuration:" << endl << mainConfig->getSummary();
     
     // main log file
-    const char *logfile = mainConfig->getValueC("log_file");
     const char *appname = mainConfig->getValueC("app_name");
-    const char *tag = getenv("TAG");
-    if (!tag) {
-        tag = mainConfig->getValueC("tag");
-    }
-    if (logfile) {
-        strncpy(_INST_log_file, logfile, LOG_FILENAME_LEN);
-    } else {
-        stringstream log;
-        log.clear();
-        log.str("");
-        if (appname) {
-            log << sanitize_filename(appname) << "-";
-        }
-        if (tag) {
-            log << sanitize_filename(tag) << "-";
-        }
-        char hostname[256] = "";
-        if (gethostname(hostname, 256) == 0) {
-            log << sanitize_filename(hostname) << "-";
-        }
-        log << getpid();
-        log << ".log";
-        strncpy(_INST_log_file, log.str().c_str(), LOG_FILENAME_LEN);
-    }
+    _INST_build_log_filename();
     if (appname) {
         mainLog = new FPLog(_INST_log_file, appname);
     } else {
         mainLog = new FPLog(_INST_log_file);
     }
     status << "Opened log file: " << _INST_log_file << endl;
+    if (mainConfig->getValue("log_format") == "binary") {
+        mainLog->setFormat(LOG_BINARY);
+        status << "Log format: binary" << endl;
+    }
+    if (mainConfig->hasValue("log_mode")) {
+        mainLog->setWriteMode(FPLog::str2WriteMode(mainConfig->getValue("log_mode")));
+        status << "Log mode: " << mainConfig->getValue("log_mode") << endl;
+    }
 
     // debug info
     const char *DEBUG_FILE = mainConfig->getValueC("debug_file");
@@ -258,12 +515,40 @@ void _INST_init_analysis ()
     if (mainConfig->getValue("enable_stwalk") == "yes") {
         mainLog->enableStackWalks();
         status << "Stackwalks enabled." << endl;
+        if (mainConfig->hasValue("stwalk_max_per_inst") ||
+                mainConfig->hasValue("stwalk_sample_rate")) {
+            unsigned long maxPerInst = DEFAULT_TRACE_MAX_PER_INST;
+            double rate = DEFAULT_TRACE_SAMPLE_RATE;
+            stringstream ss;
+            if (mainConfig->hasValue("stwalk_max_per_inst")) {
+                ss.clear(); ss.str(mainConfig->getValue("stwalk_max_per_inst"));
+                ss >> maxPerInst;
+            }
+            if (mainConfig->hasValue("stwalk_sample_rate")) {
+                ss.clear(); ss.str(mainConfig->getValue("stwalk_sample_rate"));
+                ss >> rate;
+            }
+            mainLog->setTraceSampling(maxPerInst, rate);
+            status << "Stackwalk sampling: first " << maxPerInst
+                   << " per instruction, then " << rate << endl;
+        }
     }
 
     // the XED decoder is currently more accurate
     mainDecoder = new FPDecoderXED();
     //mainDecoder = new FPDecoderIAPI();
     status << "XED decoder initialized." << endl;
+    if (mainConfig->hasValue("decode_cache")) {
+        FPDecodeCache *cache = new FPDecodeCache(mainConfig->getValue("decode_cache"),
+                mainConfig->getValue("decode_cache_key"), false);
+        if (cache->load()) {
+            ((FPDecoderXED*)mainDecoder)->setCache(cache);
+            status << "Decode cache loaded from " << cache->getPath() << "." << endl;
+        } else {
+            delete cache;
+            status << "Decode cache unavailable." << endl;
+        }
+    }
     
     // initialize various analyses
     analysisCount = 0;
@@ -275,6 +560,8 @@ void _INST_init_analysis ()
             status << tag << ": initialized" << endl;
         }
     }
+    _INST_publish_handler("dcancel_handler_addr", (void*)_INST_handle_inline_dcancel);
+    _INST_publish_handler("dnan_handler_addr", (void*)_INST_handle_inline_dnan);
     if (analysisCount == 0) {
         // TODO: revisit this (should null analysis be in allAnalysisInfo?)
         mainNullAnalysis = new FPAnalysis();
@@ -282,6 +569,23 @@ void _INST_init_analysis ()
         status << "null instrumentation initialized" << endl;
     }
 
+    // lazy decoding (only if every active analysis can handle it)
+    if (mainConfig->getValue("lazy_decode") == "yes") {
+        bool lazyOk = true;
+        for (size_t i=0; i<analysisCount; i++) {
+            if (!allAnalyses[i]->supportsLazyRegistration()) {
+                status << "Lazy decoding not supported by "
+                       << allAnalyses[i]->getTag() << "." << endl;
+                lazyOk = false;
+            }
+        }
+        if (lazyOk) {
+            lazyDecoder = (FPDecoderXED*)mainDecoder;
+            lazyDecoder->setDecodeCallback(_INST_register_decoded_inst);
+            status << "Lazy decoding enabled." << endl;
+        }
+    }
+
     _INST_count = 0;
     _INST_fast_count = 0;
 
@@ -294,14 +598,280 @@ void _INST_init_analysis ()
     cerr << mainConfig->getSummary().c_str();
 
     _INST_status = _INST_DISABLED;
+    _INST_leave_library();
     mainContext->restoreAllFPR();
 }
 
+// {{{ FORK SERVER
+
+int _INST_fork_pipe[2] = { -1, -1 };
+FPConfig *_INST_run_config = NULL;     // per-run settings (fork-server children)
+
+void _INST_fork_sigchld_handler(int)
+{
+    // wake up the server loop; the children are reaped there
+    int err = errno;
+    char c = 0;
+    if (write(_INST_fork_pipe[1], &c, 1) < 0) { }
+    errno = err;
+}
+
+/**
+ * Receive a fork-server request (see FPForkServer.h). Any descriptors that
+ * were not sent are left as -1.
+ */
+bool _INST_fork_receive(int conn, string &cwd, string &cfg, int *fds)
+{
+    char data[FP_FORK_SERVER_MAX_MSG];
+    char control[CMSG_SPACE(FP_FORK_SERVER_NUM_FDS * sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t n;
+    size_t i;
+
+    for (i=0; i<FP_FORK_SERVER_NUM_FDS; i++) {
+        fds[i] = -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = FP_FORK_SERVER_MAX_MSG - 2;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    n = recvmsg(conn, &msg, 0);
+    if (n <= 0) {
+        return false;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+                cmsg->cmsg_len == CMSG_LEN(FP_FORK_SERVER_NUM_FDS * sizeof(int))) {
+            memcpy(fds, CMSG_DATA(cmsg), FP_FORK_SERVER_NUM_FDS * sizeof(int));
+        }
+    }
+    data[n] = '\0';
+    data[n+1] = '\0';
+    cwd = data;
+    cfg = data + strlen(data) + 1;
+    return true;
+}
+
+/**
+ * Set up a fork-server child for a new run; the caller then returns to main.
+ */
+void _INST_fork_child(const string &cwd, const string &cfg, int *fds,
+        FPLogWriteMode logMode)
+{
+    stringstream status;
+    size_t i;
+
+    for (i=0; i<FP_FORK_SERVER_NUM_FDS; i++) {
+        if (fds[i] >= 0) {
+            dup2(fds[i], (int)i);
+            close(fds[i]);
+        }
+    }
+    if (chdir(cwd.c_str()) != 0) {
+        fprintf(stderr, "ERROR - fork server cannot change directory to %s\n", cwd.c_str());
+        _exit(EXIT_FAILURE);
+    }
+    status.clear();
+    status.str("");
+    status << "Forked from server " << getppid() << " in " << cwd << endl;
+
+    // reload run-time settings from this run's configuration
+    if (cfg != "") {
+        setenv("CRAFT_CONFIG", cfg.c_str(), 1);
+        if (mainConfig->getValue("runtime_tags") == "yes") {
+            if (mainConfig->loadReplaceTags(cfg)) {
+                status << "Loaded replacement tags from " << cfg << endl;
+            } else {
+                status << "WARNING: Unable to load replacement tags from " << cfg << endl;
+            }
+        }
+        // analyses may keep this pointer for the rest of the run; it is freed
+        // during cleanup
+        delete _INST_run_config;
+        _INST_run_config = new FPConfig(cfg);
+        for (i=0; i<analysisCount; i++) {
+            allAnalyses[i]->reloadConfiguration(_INST_run_config);
+        }
+    }
+
+    // fresh log (and profiling timer, which is not inherited)
+    _INST_build_log_filename();
+    mainLog->reopen(_INST_log_file);
+    mainLog->setWriteMode(logMode);
+    status << "Opened log file: " << _INST_log_file << endl;
+    if (mainConfig->getValue("enable_profiling") == "yes") {
+        _INST_begin_profiling();
+    }
+    mainLog->addMessage(STATUS, 0, "Fork server run started.", status.str(), "");
+}
+
+/**
+ * Fork-server loop (see FPForkServer.h). Only returns in a child process,
+ * which then continues into main.
+ */
+void _INST_fork_server(const char *path)
+{
+    map<pid_t, int> children;       // running child -> client connection (-1 if gone)
+    map<pid_t, int>::iterator c;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    vector<struct pollfd> pfds;
+    vector<pid_t> pfdChildren;
+    struct pollfd pfd;
+    FPLogWriteMode logMode;
+    string cwd, cfg;
+    int fds[FP_FORK_SERVER_NUM_FDS];
+    int sock, conn, status;
+    bool done = false;
+    pid_t pid;
+    char wake;
+    size_t i;
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    unlink(addr.sun_path);
+    if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(sock, 64) != 0 || pipe(_INST_fork_pipe) != 0) {
+        fprintf(stderr, "ERROR - fork server cannot listen on %s\n", path);
+        exit(-1);
+    }
+    fcntl(_INST_fork_pipe[1], F_SETFL, O_NONBLOCK);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _INST_fork_sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // children must not inherit the parent's writer thread or pending output
+    logMode = mainLog->getWriteMode();
+    mainLog->setWriteMode(LOG_BUFFERED);
+    mainLog->addMessage(STATUS, 0, "Fork server started.", string("Listening on ") + path, "");
+    mainLog->flush();
+    cerr << "FPAnalysis: Fork server listening on " << path << endl;
+
+    while (!done || !children.empty()) {
+        pfds.clear();
+        pfdChildren.clear();
+        pfd.fd = (done ? -1 : sock);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        pfds.push_back(pfd);
+        pfd.fd = _INST_fork_pipe[0];
+        pfds.push_back(pfd);
+        for (c = children.begin(); c != children.end(); c++) {
+            if (c->second >= 0) {
+                pfd.fd = c->second;
+                pfds.push_back(pfd);
+                pfdChildren.push_back(c->first);
+            }
+        }
+        if (poll(&pfds[0], pfds.size(), -1) < 0) {
+            continue;   // EINTR
+        }
+
+        // clients only read the final status, so any activity on their
+        // connection means they went away (e.g., killed by a timeout); stop
+        // the corresponding run as well
+        for (i=0; i<pfdChildren.size(); i++) {
+            if (pfds[i+2].revents != 0) {
+                kill(pfdChildren[i], SIGKILL);
+                close(pfds[i+2].fd);
+                children[pfdChildren[i]] = -1;
+            }
+        }
+
+        // report finished runs
+        if (pfds[1].revents & POLLIN) {
+            if (read(_INST_fork_pipe[0], &wake, 1) < 0) { }
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                c = children.find(pid);
+                if (c != children.end()) {
+                    if (c->second >= 0) {
+                        send(c->second, &status, sizeof(status), MSG_NOSIGNAL);
+                        close(c->second);
+                    }
+                    children.erase(c);
+                }
+            }
+        }
+
+        // start new runs
+        if (pfds[0].revents & POLLIN) {
+            conn = accept(sock, NULL, NULL);
+            if (conn < 0) {
+                continue;
+            }
+            if (!_INST_fork_receive(conn, cwd, cfg, fds)) {
+                close(conn);
+                continue;
+            }
+            if (cwd == "") {
+                // shutdown request; finish the outstanding runs first
+                close(conn);
+                done = true;
+                continue;
+            }
+            pid = fork();
+            if (pid == 0) {
+                signal(SIGCHLD, SIG_DFL);
+                close(sock);
+                close(conn);
+                close(_INST_fork_pipe[0]);
+                close(_INST_fork_pipe[1]);
+                for (c = children.begin(); c != children.end(); c++) {
+                    if (c->second >= 0) {
+                        close(c->second);
+                    }
+                }
+                _INST_fork_child(cwd, cfg, fds, logMode);
+                return;
+            }
+            for (i=0; i<FP_FORK_SERVER_NUM_FDS; i++) {
+                if (fds[i] >= 0) {
+                    close(fds[i]);
+                }
+            }
+            if (pid < 0) {
+                status = EXIT_FAILURE << 8;
+                send(conn, &status, sizeof(status), MSG_NOSIGNAL);
+                close(conn);
+            } else {
+                children[pid] = conn;
+            }
+        }
+    }
+
+    close(sock);
+    unlink(addr.sun_path);
+    mainLog->addMessage(STATUS, 0, "Fork server finished.", "", "");
+    mainLog->close();
+    cerr << "FPAnalysis: Fork server finished" << endl;
+    _exit(EXIT_SUCCESS);
+}
+
+// }}}
+
 void _INST_enable_analysis ()
 {
-    _INST_status = _INST_ACTIVE;
+    _INST_enter_library();
+    if (getenv(FP_FORK_SERVER_ENV)) {
+        // everything has been initialized and registered by now, so this is
+        // the last point that all runs have in common
+        string path = getenv(FP_FORK_SERVER_ENV);
+        unsetenv(FP_FORK_SERVER_ENV);
+        _INST_fork_server(path.c_str());
+    }
+    _INST_begin_snapshots();
     cerr << "FPAnalysis: Profiler enabled.\n";
     _INST_status = _INST_INACTIVE;
+    _INST_leave_library();
 }
 
 void _INST_register_inst (long iidx, void* addr, char* bytes, long nbytes)
@@ -309,23 +879,67 @@ void _INST_register_inst (long iidx, void* addr, char* bytes, long nbytes)
     //fprintf(stderr, "registering instruction #%ld:  %p @ %p  (%ld bytes)  ",
             //iidx, addr, bytes, nbytes);
     //FPDecoderXED::printInstBytes(stdout, (unsigned char*)bytes, nbytes);
-    _INST_status = _INST_ACTIVE;
+    if ((size_t)iidx >= _INST_num_insts) {
+        _INST_num_insts = (size_t)iidx + 1;
+    }
+    _INST_enter_library();
+    if (lazyDecoder) {
+        // bytes are embedded in the mutatee, so they'll still be around
+        lazyDecoder->defer(iidx, addr, (unsigned char*)bytes, nbytes);
+        _INST_leave_library();
+        return;
+    }
     FPSemantics *inst = mainDecoder->decode(iidx, addr, (unsigned char*)bytes, nbytes);
     //fprintf(stderr, "  %s\n", inst->getDisassembly().c_str());
     size_t i;
     for (i=0; i<analysisCount; i++) {
         allAnalyses[i]->registerInstruction(inst);
     }
-    _INST_status = _INST_INACTIVE;
+    _INST_leave_library();
+}
+
+void _INST_register_inst_table (FPRegistrationEntry *table, long count)
+{
+    FPSemantics *inst;
+    long j;
+    size_t i, numInsts = 0;
+    for (j=0; j<count; j++) {
+        if ((size_t)table[j].iidx >= numInsts) {
+            numInsts = (size_t)table[j].iidx + 1;
+        }
+    }
+    _INST_enter_library();
+    for (i=0; i<analysisCount; i++) {
+        allAnalyses[i]->reserveInstructions(numInsts);
+    }
+    if (numInsts > _INST_num_insts) {
+        _INST_num_insts = numInsts;
+    }
+    if (lazyDecoder) {
+        for (j=0; j<count; j++) {
+            lazyDecoder->defer((size_t)table[j].iidx, (void*)table[j].addr,
+                    (unsigned char*)table[j].bytes, (size_t)table[j].nbytes);
+        }
+        _INST_leave_library();
+        return;
+    }
+    for (j=0; j<count; j++) {
+        inst = mainDecoder->decode((size_t)table[j].iidx, (void*)table[j].addr,
+                (unsigned char*)table[j].bytes, (size_t)table[j].nbytes);
+        for (i=0; i<analysisCount; i++) {
+            allAnalyses[i]->registerInstruction(inst);
+        }
+    }
+    _INST_leave_library();
 }
 
 void _INST_handle_unsupported_inst(long iidx)
 {
-    _INST_status = _INST_ACTIVE;
+    _INST_enter_library();
     FPSemantics *inst = mainDecoder->lookup(iidx);
     fprintf(stderr, "ERROR - unhandled runtime instruction at %p: %s\n",
            inst->getAddress(), inst->getDisassembly().c_str());
-    _INST_status = _INST_INACTIVE;
+    _INST_leave_library();
 }
 
 long _INST_get_analysis_id(FPAnalysis *analysis)
@@ -338,44 +952,53 @@ long _INST_get_analysis_id(FPAnalysis *analysis)
     return 0;
 }
 
-void _INST_handle_pre_analysis(long analysisID, long iidx)
+// The heavyweight handlers always save and restore the full x87/SSE/MXCSR
+// state: the library is built with -mfpmath=sse, so any analysis code may
+// clobber it. Analyses that need cheaper instrumentation should emit snippets
+// or binary blobs instead (see FPAnalysisCInst).
+
+void _INST_handle_pre_analysis(long analysisID, long iidx, long tidx)
 {
     assert(analysisID >=0  && analysisID < (long)TOTAL_ANALYSIS_COUNT);
     FPAnalysis *analysis = allAnalysisInfo[analysisID].instance;
-    __asm__ ("fxsave %0;" : : "m" (*mainContext->fxsave_state));
-    _INST_status = _INST_ACTIVE;
+    FPContext *context = _INST_get_context(tidx);
+    __asm__ ("fxsave %0;" : : "m" (*context->fxsave_state));
+    _INST_enter_library();
     analysis->handlePreInstruction(mainDecoder->lookup(iidx));
-    _INST_status = _INST_INACTIVE;
-    __asm__ ("fxrstor %0;" : : "m" (*mainContext->fxsave_state));
+    _INST_leave_library();
+    __asm__ ("fxrstor %0;" : : "m" (*context->fxsave_state));
 }
 
-void _INST_handle_post_analysis(long analysisID, long iidx)
+void _INST_handle_post_analysis(long analysisID, long iidx, long tidx)
 {
     assert(analysisID >=0  && analysisID < (long)TOTAL_ANALYSIS_COUNT);
     FPAnalysis *analysis = allAnalysisInfo[analysisID].instance;
-    __asm__ ("fxsave %0;" : : "m" (*mainContext->fxsave_state));
-    _INST_status = _INST_ACTIVE;
+    FPContext *context = _INST_get_context(tidx);
+    __asm__ ("fxsave %0;" : : "m" (*context->fxsave_state));
+    _INST_enter_library();
     analysis->handlePostInstruction(mainDecoder->lookup(iidx));
-    _INST_status = _INST_INACTIVE;
-    __asm__ ("fxrstor %0;" : : "m" (*mainContext->fxsave_state));
+    _INST_leave_library();
+    __asm__ ("fxrstor %0;" : : "m" (*context->fxsave_state));
 }
 
-void _INST_handle_replacement(long analysisID, long iidx)
+void _INST_handle_replacement(long analysisID, long iidx, long tidx)
 {
     assert(analysisID >=0  && analysisID < (long)TOTAL_ANALYSIS_COUNT);
     FPAnalysis *analysis = allAnalysisInfo[analysisID].instance;
-    __asm__ ("fxsave %0;" : : "m" (*mainContext->fxsave_state));
-    _INST_status = _INST_ACTIVE;
+    FPContext *context = _INST_get_context(tidx);
+    __asm__ ("fxsave %0;" : : "m" (*context->fxsave_state));
+    _INST_enter_library();
     analysis->handleReplacement(mainDecoder->lookup(iidx));
-    _INST_status = _INST_INACTIVE;
-    __asm__ ("fxrstor %0;" : : "m" (*mainContext->fxsave_state));
+    _INST_leave_library();
+    __asm__ ("fxrstor %0;" : : "m" (*context->fxsave_state));
 }
 
 void _INST_disable_analysis ()
 {
-    _INST_status = _INST_ACTIVE;
+    _INST_enter_library();
     cerr << "FPAnalysis: Profiler disabled.\n";
     _INST_status = _INST_DISABLED;
+    _INST_leave_library();
 }
 
 void _INST_cleanup_analysis ()
@@ -384,15 +1007,14 @@ void _INST_cleanup_analysis ()
     stringstream msg;
 
     mainContext->saveAllFPR();
-    _INST_status = _INST_ACTIVE;
+    _INST_enter_library();
 
-    if (mainConfig->getValue("enable_profiling") == "yes") {
-        struct itimerval t;
-        t.it_value.tv_sec = 0;
-        t.it_value.tv_usec = 0;
-        t.it_interval.tv_sec = 0;
-        t.it_interval.tv_usec = 0;
-        setitimer(ITIMER_VIRTUAL, &t, 0);
+    if (mainSnapshot || mainConfig->getValue("enable_profiling") == "yes") {
+        _INST_stop_timer();
+    }
+    if (mainSnapshot) {
+        // last snapshot has the final counts
+        mainSnapshot->close();
     }
 
     cerr << "FPAnalysis: Cleanup in process ..." << endl;
@@ -410,6 +1032,15 @@ void _INST_cleanup_analysis ()
     msg.str("");
     msg << "Full analysis: " << _INST_count << " instruction(s) handled" << endl;
     msg << "Optimized analysis: " << _INST_fast_count << " instruction(s) handled";
+    if (lazyDecoder) {
+        msg << endl << "Lazy decoding: " << lazyDecoder->getNumDecoded()
+            << " instruction(s) decoded";
+    }
+    if (mainSnapshot) {
+        msg << endl << "Snapshots: " << mainSnapshot->getNumTaken()
+            << " written (" << mainSnapshot->getNumDropped() << " dropped) to "
+            << _INST_snapshot_file;
+    }
     mainLog->addMessage(STATUS, 0, "Profiling finished.", msg.str(), "");
     mainLog->close();
     cerr << msg.str() << endl;
@@ -418,7 +1049,11 @@ void _INST_cleanup_analysis ()
     cerr << "FPAnalysis: Optimized analysis: " << _INST_fast_count << " instruction(s) handled" << endl;
     cerr << "FPAnalysis: Log written to " << _INST_log_file << endl;
 
+    delete _INST_run_config;
+    _INST_run_config = NULL;
+
     _INST_status = _INST_DISABLED;
+    _INST_leave_library();
     mainContext->restoreAllFPR();
 
     return;
@@ -426,7 +1061,8 @@ void _INST_cleanup_analysis ()
     // clean up memory
     // TODO: fix all this to work properly
     delete mainConfig;
-    delete mainContext;
+    munmap(_INST_context_pool, _INST_context_slots * sizeof(FPContext));
+    free(_INST_context_ready);
     delete mainDecoder;
     delete mainLog;
 }
@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# Compares instrumentation (rewriting) wall time of two fpinst builds on the
+# same mutatee. Meant for checking mutator-side performance changes; it does
+# not run the instrumented binaries.
+#
+# Usage: ./bench_inst.sh <baseline-fpinst> <new-fpinst> [mutatee] [mode] [runs]
+#
+
+BASE=${1:-fpinst}
+NEW=${2:-fpinst}
+MUTATEE=${3:-lulesh}
+MODE=${4:---cinst}
+RUNS=${5:-5}
+
+# build the mutatee (lulesh by default; it has the most FP instructions)
+make $MUTATEE &>/dev/null
+if [ $? -ne 0 ]; then
+    echo "ERROR: Cannot build $MUTATEE!"
+    exit
+fi
+
+mkdir -p bench
+
+# time_fpinst <fpinst> <tag>: prints the average wall time over all runs
+time_fpinst () {
+    total=0
+    for (( r=1; r<=$RUNS; r++ ))
+    do
+        start=$(date +%s.%N)
+        $1 -i $MODE -o bench/$MUTATEE.$2 $MUTATEE &>bench/$MUTATEE.$2.fpout
+        if [ $? -ne 0 ]; then
+            echo "ERROR: $1 failed on $MUTATEE (see bench/$MUTATEE.$2.fpout)" >&2
+        fi
+        end=$(date +%s.%N)
+        total=$(echo "$total + $end - $start" | bc -l)
+    done
+    echo "$total / $RUNS" | bc -l
+}
+
+echo ""
+echo "===  FPINST INSTRUMENTATION BENCHMARK  ==="
+echo "Mutatee: $MUTATEE  Mode: $MODE  Runs: $RUNS"
+
+base_time=$(time_fpinst $BASE base)
+new_time=$(time_fpinst $NEW new)
+
+printf "Baseline (%s): %8.3f sec\n" "$BASE" $base_time
+printf "New      (%s): %8.3f sec\n" "$NEW"  $new_time
+printf "Speedup: %.3fx\n" $(echo "$base_time / $new_time" | bc -l)
+
+# phase breakdown (only printed by newer versions of fpinst)
+grep "time:" bench/$MUTATEE.new.fpout
+
+rm -f fpinst.log